@@ -230,6 +230,7 @@ static const char *OSINFO =
 #define _DEBUGSET	"DEBUG"
 #define _SETCONFIG	"SETCONFIG"
 #define _USBSTATS	"USBSTATS"
+#define _USBLATENCY	"USBLATENCY"
 
 static const char ISJSON = '{';
 #define JSON0		"{"
@@ -272,6 +273,7 @@ static const char ISJSON = '{';
 #define JSON_DEBUGSET	JSON1 _DEBUGSET JSON2
 #define JSON_SETCONFIG	JSON1 _SETCONFIG JSON2
 #define JSON_USBSTATS	JSON1 _USBSTATS JSON2
+#define JSON_USBLATENCY	JSON1 _USBLATENCY JSON2
 #define JSON_END	JSON4 JSON5
 #define JSON_END_TRUNCATED	JSON4_TRUNCATED JSON5
 
@@ -378,6 +380,7 @@ static const char *JSON_PARAMETER = "parameter";
 #define MSG_CONVAL 86
 #define MSG_USBSTA 87
 #define MSG_NOUSTA 88
+#define MSG_USBLAT 94
 
 #ifdef HAVE_AN_FPGA
 #define MSG_MISPGAOPT 89
@@ -552,6 +555,7 @@ struct CODES {
  { SEVERITY_ERR,   MSG_CONVAL,	PARAM_STR,	"Missing config value N for '%s,N'" },
  { SEVERITY_SUCC,  MSG_USBSTA,	PARAM_NONE,	"USB Statistics" },
  { SEVERITY_INFO,  MSG_NOUSTA,	PARAM_NONE,	"No USB Statistics" },
+ { SEVERITY_SUCC,  MSG_USBLAT,	PARAM_NONE,	"USB Latency" },
 #ifdef HAVE_AN_FPGA
  { SEVERITY_ERR,   MSG_MISPGAOPT, PARAM_NONE,	"Missing option after PGA number" },
  { SEVERITY_WARN,  MSG_PGANOSET, PARAM_PGA,	"PGA %d does not support pgaset" },
@@ -3142,6 +3146,47 @@ static void usbstats(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __may
 #endif
 }
 
+static void usblatency(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
+{
+	struct api_data *root = NULL;
+
+#if defined(USE_MODMINER) || defined(USE_BITFORCE)
+	char buf[TMPBUFSIZ];
+	bool io_open = false;
+	int count = 0;
+
+	root = api_usb_latency(&count);
+#endif
+
+	if (!root) {
+		message(io_data, MSG_NOUSTA, 0, NULL, isjson);
+		return;
+	}
+
+#if defined(USE_MODMINER) || defined(USE_BITFORCE)
+
+	message(io_data, MSG_USBLAT, 0, NULL, isjson);
+
+	if (isjson)
+		io_open = io_add(io_data, COMSTR JSON_USBLATENCY);
+
+	root = print_data(root, buf, isjson, false);
+	io_add(io_data, buf);
+
+	while (42) {
+		root = api_usb_latency(&count);
+		if (!root)
+			break;
+
+		root = print_data(root, buf, isjson, isjson);
+		io_add(io_data, buf);
+	}
+
+	if (isjson && io_open)
+		io_close(io_data);
+#endif
+}
+
 #ifdef HAVE_AN_FPGA
 static void pgaset(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
 {
@@ -3256,6 +3301,7 @@ struct CMDS {
 	{ "debug",		debugstate,	true },
 	{ "setconfig",		setconfig,	true },
 	{ "usbstats",		usbstats,	false },
+	{ "usblatency",		usblatency,	false },
 #ifdef HAVE_AN_FPGA
 	{ "pgaset",		pgaset,		true },
 #endif
@@ -0,0 +1,46 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* Allocation counting for the cgminer-bench binary built by "make bench".
+ * It is linked with -Wl,--wrap for each allocator below so every call from
+ * cgminer and its static libraries comes through here first. */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+unsigned long bench_allocs;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+char *__real_strdup(const char *s);
+
+void *__wrap_malloc(size_t size)
+{
+	__sync_fetch_and_add(&bench_allocs, 1);
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+	__sync_fetch_and_add(&bench_allocs, 1);
+	return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	__sync_fetch_and_add(&bench_allocs, 1);
+	return __real_realloc(ptr, size);
+}
+
+char *__wrap_strdup(const char *s)
+{
+	__sync_fetch_and_add(&bench_allocs, 1);
+	return __real_strdup(s);
+}
@@ -0,0 +1,34 @@
+#if !defined(__BENCH_PIPELINE_H__)
+	#define __BENCH_PIPELINE_H__ 1
+
+	/* Work templates for --bench-pipeline. The stratum notify, nonce1 and
+	 * coinbase are as recorded from a pool, with the merkle branch (%s)
+	 * filled in per template size. The GBT template reuses the same
+	 * coinbase with nonce1 and a zero nonce2 as its extranonce, and gets
+	 * its transactions (%s) generated the same way. */
+	#define BENCH_PIPE_NOTIFY \
+		"{\"params\": [\"bf\", \"4d16b6f85af6e2198f44ae2a6de67f78487ae5611b77c6c0440b921e00000000\", " \
+		"\"01000000010000000000000000000000000000000000000000000000000000000000000000ffffffff20020862062f503253482f04b8864e5008\", " \
+		"\"072f736c7573682f000000000100f2052a010000001976a914d23fcdf86f7e756a64a7a9688ef9903327048ed988ac00000000\", " \
+		"[%s], \"00000002\", \"1c2ac4af\", \"504e86b9\", false], \"id\": null, \"method\": \"mining.notify\"}"
+
+	#define BENCH_PIPE_NONCE1 "08000002"
+	#define BENCH_PIPE_N2SIZE 4
+
+	#define BENCH_PIPE_GBT \
+		"{\"previousblockhash\": \"000000000000048b95347e83192f69cf0366076336c639f9b7228e9ba171342e\", " \
+		"\"target\": \"00000000000005db8b0000000000000000000000000000000000000000000000\", " \
+		"\"coinbasetxn\": {\"data\": \"01000000010000000000000000000000000000000000000000000000000000000000000000ffffffff20020862062f503253482f04b8864e5008" \
+		"0800000200000000072f736c7573682f000000000100f2052a010000001976a914d23fcdf86f7e756a64a7a9688ef9903327048ed988ac00000000\"}, " \
+		"\"longpollid\": \"bench\", \"expires\": 120, \"version\": 2, \"curtime\": 1355100000, " \
+		"\"submitold\": true, \"bits\": \"1a05db8b\", \"workid\": \"bench\", \"transactions\": [%s]}"
+
+	/* Size in bytes of each generated GBT transaction, about the median */
+	#define BENCH_PIPE_TXN_LEN 250
+
+	/* The genesis block header, which is below difficulty 1 */
+	#define BENCH_PIPE_GENESIS \
+		"0100000000000000000000000000000000000000000000000000000000000000" \
+		"000000003ba3edfd7a7b12b27ac72c3e67768f617fc81bc3888a51323a9fb8aa" \
+		"4b1e5e4a29ab5f49ffff001d1dac2b7c"
+#endif
@@ -48,6 +48,7 @@
 #include "driver-cpu.h"
 #include "driver-opencl.h"
 #include "bench_block.h"
+#include "bench_pipeline.h"
 #include "scrypt.h"
 
 #if defined(unix)
@@ -75,6 +76,9 @@ static char packagename[256];
 
 bool opt_protocol;
 static bool opt_benchmark;
+static bool opt_bench_pipeline;
+static char *opt_bench_pipeline_compare;
+static char *opt_bench_pipeline_json;
 bool have_longpoll;
 bool want_per_device_stats;
 bool use_syslog;
@@ -87,6 +91,7 @@ int opt_log_interval = 5;
 int opt_queue = 1;
 int opt_scantime = 60;
 int opt_expiry = 120;
+int opt_detect_threads = 8;
 int opt_bench_algo = -1;
 static const bool opt_time = true;
 unsigned long long global_hashrate;
@@ -95,6 +100,8 @@ unsigned long long global_hashrate;
 int opt_dynamic_interval = 7;
 int nDevs;
 int opt_g_threads = 2;
+bool opt_gpu_pipeline;
+int opt_gpu_autotune;
 int gpu_threads;
 #ifdef USE_SCRYPT
 bool opt_scrypt;
@@ -134,9 +141,14 @@ bool opt_delaynet;
 bool opt_disable_pool = true;
 char *opt_icarus_options = NULL;
 char *opt_icarus_timing = NULL;
+bool opt_icarus_pipeline;
+bool opt_icarus_events;
+int opt_icarus_sim;
 bool opt_worktime;
 #ifdef HAVE_LIBUSB
 int opt_usbdump = -1;
+int opt_usb_latency;
+int opt_usb_hotplug;
 #endif
 
 char *opt_kernel_path;
@@ -144,6 +156,11 @@ char *cgminer_path;
 
 #if defined(USE_BITFORCE)
 bool opt_bfl_noncerange;
+bool opt_bfl_queue;
+#endif
+#ifdef USE_MODMINER
+bool opt_mmq_governor;
+bool opt_mmq_pipeline;
 #endif
 #define QUIET	(opt_quiet || opt_realquiet)
 
@@ -366,7 +383,7 @@ static FILE *sharelog_file = NULL;
 
 static void sharelog(const char*disposition, const struct work*work)
 {
-	char *target, *hash, *data;
+	char target[65], hash[65], data[257];
 	struct cgpu_info *cgpu;
 	unsigned long int t;
 	struct pool *pool;
@@ -381,15 +398,12 @@ static void sharelog(const char*disposition, const struct work*work)
 	cgpu = thr_info[thr_id].cgpu;
 	pool = work->pool;
 	t = (unsigned long int)(work->tv_work_found.tv_sec);
-	target = bin2hex(work->target, sizeof(work->target));
-	hash = bin2hex(work->hash, sizeof(work->hash));
-	data = bin2hex(work->data, sizeof(work->data));
+	__bin2hex(target, work->target, sizeof(work->target));
+	__bin2hex(hash, work->hash, sizeof(work->hash));
+	__bin2hex(data, work->data, sizeof(work->data));
 
 	// timestamp,disposition,target,pool,dev,thr,sharehash,sharedata
 	rv = snprintf(s, sizeof(s), "%lu,%s,%s,%s,%s%u,%u,%s,%s\n", t, disposition, target, pool->rpc_url, cgpu->drv->name, cgpu->device_id, thr_id, hash, data);
-	free(target);
-	free(hash);
-	free(data);
 	if (rv >= (int)(sizeof(s)))
 		s[sizeof(s) - 1] = '\0';
 	else if (rv < 0) {
@@ -845,15 +859,38 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITHOUT_ARG("--benchmark",
 			opt_set_bool, &opt_benchmark,
 			"Run cgminer in benchmark mode - produces no shares"),
+	OPT_WITHOUT_ARG("--bench-pipeline",
+			opt_set_bool, &opt_bench_pipeline,
+			"Benchmark the work generation, queueing and share checking paths, then exit"),
+	OPT_WITH_ARG("--bench-pipeline-compare",
+		     opt_set_charp, NULL, &opt_bench_pipeline_compare,
+		     "Compare --bench-pipeline against the results in this file and fail on regressions"),
+	OPT_WITH_ARG("--bench-pipeline-json",
+		     opt_set_charp, NULL, &opt_bench_pipeline_json,
+		     "Write the --bench-pipeline results as JSON to this file"),
 #if defined(USE_BITFORCE)
 	OPT_WITHOUT_ARG("--bfl-range",
 			opt_set_bool, &opt_bfl_noncerange,
 			"Use nonce range on bitforce devices if supported"),
+	OPT_WITHOUT_ARG("--bfl-queue",
+			opt_set_bool, &opt_bfl_queue,
+			"Keep several jobs queued on bitforce devices if supported"),
 #endif
 #ifdef WANT_CPUMINE
 	OPT_WITH_ARG("--bench-algo|-b",
 		     set_int_0_to_9999, opt_show_intval, &opt_bench_algo,
 		     opt_hidden),
+	OPT_WITH_ARG("--bench-cpu",
+		     set_int_0_to_9999, opt_show_intval, &opt_bench_cpu,
+		     "Benchmark every CPU algorithm at 1 to N threads, then exit"),
+	OPT_WITH_ARG("--bench-cpu-json",
+		     opt_set_charp, NULL, &opt_bench_cpu_json,
+		     "Write the --bench-cpu results as JSON to this file, - for stdout"),
+#ifdef USE_SCRYPT
+	OPT_WITH_ARG("--bench-scrypt",
+		     set_int_0_to_9999, opt_show_intval, &opt_bench_scrypt,
+		     "Benchmark CPU scrypt scratchpads at 1 and N threads, then exit"),
+#endif
 #endif
 #ifdef HAVE_CURSES
 	OPT_WITHOUT_ARG("--compact",
@@ -864,10 +901,21 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITH_ARG("--cpu-threads|-t",
 		     force_nthreads_int, opt_show_intval, &opt_n_threads,
 		     "Number of miner CPU threads"),
+	OPT_WITH_ARG("--cpu-sysfs",
+		     opt_set_charp, opt_show_charp, &opt_cpu_sysfs,
+		     "Directory to read the CPU topology from, for testing placement"),
+#ifdef USE_SCRYPT
+	OPT_WITH_ARG("--cpu-lookup-gap",
+		     set_cpu_lookup_gap, NULL, &opt_cpu_lookup_gap,
+		     "Set CPU lookup gap for scrypt mining (auto or 1 - 4, default: auto)"),
+#endif
 #endif
 	OPT_WITHOUT_ARG("--debug|-D",
 		     enable_debug, &opt_debug,
 		     "Enable debug output"),
+	OPT_WITH_ARG("--detect-threads",
+		     set_int_1_to_65535, opt_show_intval, &opt_detect_threads,
+		     "Number of devices to detect at a time (default: 8)"),
 	OPT_WITH_ARG("--device|-d",
 		     set_devices, NULL, NULL,
 	             "Select device to use, (Use repeat -d for multiple devices, default: all)"),
@@ -894,9 +942,15 @@ static struct opt_table opt_config_table[] = {
 			opt_set_bool, &opt_fix_protocol,
 			"Do not redirect to a different getwork protocol (eg. stratum)"),
 #ifdef HAVE_OPENCL
+	OPT_WITH_ARG("--gpu-autotune",
+		     set_int_1_to_65535, opt_show_intval, &opt_gpu_autotune,
+		     "Tune each GPU's vectors, worksize and intensity at startup, keeping kernel launches under <arg> ms"),
 	OPT_WITH_ARG("--gpu-dyninterval",
 		     set_int_1_to_65535, opt_show_intval, &opt_dynamic_interval,
 		     "Set the refresh interval in ms for GPUs using dynamic intensity"),
+	OPT_WITHOUT_ARG("--gpu-pipeline",
+			opt_set_bool, &opt_gpu_pipeline,
+			"Queue each GPU kernel before reading the results of the last, double buffered"),
 	OPT_WITH_ARG("--gpu-platform",
 		     set_int_0_to_9999, opt_show_intval, &opt_platform_id,
 		     "Select OpenCL platform ID to use for GPU mining"),
@@ -937,6 +991,9 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITH_ARG("--intensity|-I",
 		     set_intensity, NULL, NULL,
 		     "Intensity of GPU scanning (d or " _MIN_INTENSITY_STR " -> " _MAX_INTENSITY_STR ", default: d to maintain desktop interactivity)"),
+	OPT_WITH_ARG("--kernel-cache",
+		     set_kernel_cache, NULL, NULL,
+		     "Directory to cache compiled GPU kernels in (default: ~/.cgminer/kernels)"),
 #endif
 #if defined(HAVE_OPENCL) || defined(HAVE_MODMINER)
 	OPT_WITH_ARG("--kernel-path|-K",
@@ -955,6 +1012,15 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITH_ARG("--icarus-timing",
 		     set_icarus_timing, NULL, NULL,
 		     opt_hidden),
+	OPT_WITHOUT_ARG("--icarus-events",
+			opt_set_bool, &opt_icarus_events,
+			opt_hidden),
+	OPT_WITHOUT_ARG("--icarus-pipeline",
+			opt_set_bool, &opt_icarus_pipeline,
+			opt_hidden),
+	OPT_WITH_ARG("--icarus-sim",
+		     set_int_0_to_9999, opt_show_intval, &opt_icarus_sim,
+		     opt_hidden),
 #endif
 	OPT_WITHOUT_ARG("--load-balance",
 		     set_loadbalance, &pool_strategy,
@@ -962,6 +1028,14 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITH_ARG("--log|-l",
 		     set_int_0_to_9999, opt_show_intval, &opt_log_interval,
 		     "Interval in seconds between log output"),
+#ifdef USE_MODMINER
+	OPT_WITHOUT_ARG("--mmq-governor",
+			opt_set_bool, &opt_mmq_governor,
+			"Tune each ModMiner FPGA clock for the most valid hashes and remember it"),
+	OPT_WITHOUT_ARG("--mmq-pipeline",
+			opt_set_bool, &opt_mmq_pipeline,
+			"Keep several bitstream writes in flight when uploading to a ModMiner"),
+#endif
 #if defined(unix)
 	OPT_WITH_ARG("--monitor|-m",
 		     opt_set_charp, NULL, &opt_stderr_cmd,
@@ -992,6 +1066,11 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITHOUT_ARG("--no-submit-stale",
 			opt_set_invbool, &opt_submit_stale,
 		        "Don't submit shares if they are detected as stale"),
+#ifdef HAVE_OPENCL
+	OPT_WITHOUT_ARG("--opencl-cpu",
+			opt_set_bool, &opt_opencl_cpu,
+			"Also mine on OpenCL CPU devices, for testing on platforms like POCL"),
+#endif
 	OPT_WITH_ARG("--pass|-p",
 		     set_pass, NULL, NULL,
 		     "Password for bitcoin JSON-RPC server"),
@@ -1043,6 +1122,11 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITHOUT_ARG("--scrypt",
 			opt_set_bool, &opt_scrypt,
 			"Use the scrypt algorithm for mining (litecoin only)"),
+#ifdef WANT_CPUMINE
+	OPT_WITHOUT_ARG("--scrypt-hugepages",
+			opt_set_bool, &opt_scrypt_hugepages,
+			"Back CPU scrypt scratchpads with huge pages where available"),
+#endif
 	OPT_WITH_ARG("--shaders",
 		     set_shaders, NULL, NULL,
 		     "GPU shaders per card for tuning scrypt, comma separated"),
@@ -1097,9 +1181,15 @@ static struct opt_table opt_config_table[] = {
 		     set_user, NULL, NULL,
 		     "Username for bitcoin JSON-RPC server"),
 #ifdef HAVE_LIBUSB
+	OPT_WITH_ARG("--usb-hotplug",
+		     set_int_0_to_9999, opt_show_intval, &opt_usb_hotplug,
+		     "Number of USB devices that can be plugged in while running (default: 0)"),
 	OPT_WITH_ARG("--usb-dump",
 		     set_int_0_to_10, opt_show_intval, &opt_usbdump,
 		     opt_hidden),
+	OPT_WITH_ARG("--usb-latency",
+		     set_int_0_to_9999, opt_show_intval, &opt_usb_latency,
+		     opt_hidden),
 #endif
 #ifdef HAVE_OPENCL
 	OPT_WITH_ARG("--vectors|-v",
@@ -1579,11 +1669,11 @@ static void gen_gbt_work(struct pool *pool, struct work *work)
 	hex2bin(work->data + 4 + 32 + 32 + 4 + 4 + 4, workpadding, 48);
 
 	if (opt_debug) {
-		char *header = bin2hex(work->data, 128);
+		char header[257];
 
+		__bin2hex(header, work->data, 128);
 		applog(LOG_DEBUG, "Generated GBT header %s", header);
 		applog(LOG_DEBUG, "Work coinbase %s", work->gbt_coinbase);
-		free(header);
 	}
 
 	calc_midstate(work);
@@ -2629,7 +2719,7 @@ static void calc_diff(struct work *work, int known)
 	}
 }
 
-static void get_benchmark_work(struct work *work)
+void get_benchmark_work(struct work *work)
 {
 	// Use a random work block pulled from a pool
 	static uint8_t bench_block[] = { CGMINER_BENCHMARK_BLOCK };
@@ -2643,7 +2733,9 @@ static void get_benchmark_work(struct work *work)
 	work->pool = pools[0];
 	gettimeofday(&(work->tv_getwork), NULL);
 	memcpy(&(work->tv_getwork_reply), &(work->tv_getwork), sizeof(struct timeval));
+	memcpy(&(work->tv_staged), &(work->tv_getwork), sizeof(struct timeval));
 	work->getwork_mode = GETWORK_MODE_BENCHMARK;
+	calc_midstate(work);
 	calc_diff(work, 0);
 }
 
@@ -2879,7 +2971,7 @@ static void push_curl_entry(struct curl_ent *ce, struct pool *pool)
 	mutex_unlock(&pool->pool_lock);
 }
 
-static bool stale_work(struct work *work, bool share);
+bool stale_work(struct work *work, bool share);
 
 static inline bool should_roll(struct work *work)
 {
@@ -3015,7 +3107,7 @@ static void pool_died(struct pool *pool)
 	}
 }
 
-static bool stale_work(struct work *work, bool share)
+bool stale_work(struct work *work, bool share)
 {
 	struct timeval now;
 	time_t work_expiry;
@@ -3117,6 +3209,12 @@ static void *submit_work_thread(void *userdata)
 
 	check_solve(work);
 
+	/* There is no pool to take benchmark shares */
+	if (opt_benchmark) {
+		applog(LOG_DEBUG, "Benchmark share found, not submitting");
+		goto out;
+	}
+
 	if (stale_work(work, true)) {
 		if (opt_submit_stale)
 			applog(LOG_NOTICE, "Pool %d stale share detected, submitting as user requested", pool->pool_no);
@@ -3140,7 +3238,7 @@ static void *submit_work_thread(void *userdata)
 	if (work->stratum) {
 		struct stratum_share *sshare = calloc(sizeof(struct stratum_share), 1);
 		uint32_t *hash32 = (uint32_t *)work->hash, nonce;
-		char *noncehex;
+		char noncehex[9];
 		char s[1024];
 
 		sshare->work = copy_work(work);
@@ -3151,11 +3249,10 @@ static void *submit_work_thread(void *userdata)
 		mutex_unlock(&sshare_lock);
 
 		nonce = *((uint32_t *)(work->data + 76));
-		noncehex = bin2hex((const unsigned char *)&nonce, 4);
+		__bin2hex(noncehex, (const unsigned char *)&nonce, 4);
 		memset(s, 0, 1024);
 		sprintf(s, "{\"params\": [\"%s\", \"%s\", \"%s\", \"%s\", \"%s\"], \"id\": %d, \"method\": \"mining.submit\"}",
 			pool->rpc_user, work->job_id, work->nonce2, work->ntime, noncehex, sshare->id);
-		free(noncehex);
 
 		applog(LOG_INFO, "Submitting share %08lx to pool %d", (unsigned long)(hash32[6]), pool->pool_no);
 
@@ -3422,12 +3519,10 @@ static bool block_exists(char *hexstr)
 /* Tests if this work is from a block that has been seen before */
 static inline bool from_existing_block(struct work *work)
 {
-	char *hexstr = bin2hex(work->data + 8, 18);
-	bool ret;
+	char hexstr[37];
 
-	ret = block_exists(hexstr);
-	free(hexstr);
-	return ret;
+	__bin2hex(hexstr, work->data + 8, 18);
+	return block_exists(hexstr);
 }
 
 static int block_sort(struct block *blocka, struct block *blockb)
@@ -3477,15 +3572,15 @@ static void set_blockdiff(const struct work *work)
 static bool test_work_current(struct work *work)
 {
 	bool ret = true;
-	char *hexstr;
+	char hexstr[37];
 
 	if (work->mandatory)
 		return ret;
 
 	/* Hack to work around dud work sneaking into test */
-	hexstr = bin2hex(work->data + 8, 18);
+	__bin2hex(hexstr, work->data + 8, 18);
 	if (!strncmp(hexstr, "000000000000000000000000000000000000", 36))
-		goto out_free;
+		return ret;
 
 	/* Search to see if this block exists yet and if not, consider it a
 	 * new block and set the current block details to this one */
@@ -3518,7 +3613,7 @@ static bool test_work_current(struct work *work)
 			applog(LOG_DEBUG, "Deleted block %d from database", deleted_block);
 		set_curblock(hexstr, work->data);
 		if (unlikely(new_blocks == 1))
-			goto out_free;
+			return ret;
 
 		work->work_block = ++work_block;
 
@@ -3541,8 +3636,6 @@ static bool test_work_current(struct work *work)
 		}
 	}
 	work->longpoll = false;
-out_free:
-	free(hexstr);
 	return ret;
 }
 
@@ -3971,6 +4064,7 @@ void zero_stats(void)
 		cgpu->utility = 0.0;
 		cgpu->last_share_pool_time = 0;
 		cgpu->diff1 = 0;
+		cgpu->diff1_frac = 0;
 		cgpu->diff_accepted = 0;
 		cgpu->diff_rejected = 0;
 		cgpu->last_share_diff = 0;
@@ -4378,7 +4472,7 @@ void thread_reportin(struct thr_info *thr)
 	thr->cgpu->device_last_well = time(NULL);
 }
 
-static inline void thread_reportout(struct thr_info *thr)
+void thread_reportout(struct thr_info *thr)
 {
 	thr->getwork = true;
 }
@@ -4496,6 +4590,26 @@ out_unlock:
 	}
 }
 
+/* Hash accounting for a device run without a miner thread, passed on to
+ * hashmeter() at the same interval as miner_thread() does */
+void thread_hashes(struct thr_info *thr, int64_t hashes)
+{
+	struct cgpu_info *cgpu = thr->cgpu;
+	struct timeval now, diff;
+
+	thr->hashes_done += hashes;
+	if (hashes > cgpu->max_hashes)
+		cgpu->max_hashes = hashes;
+
+	gettimeofday(&now, NULL);
+	timersub(&now, &thr->tv_lastupdate, &diff);
+	if (diff.tv_sec >= opt_log_interval) {
+		hashmeter(thr->id, &diff, thr->hashes_done);
+		thr->hashes_done = 0;
+		thr->tv_lastupdate = now;
+	}
+}
+
 static void stratum_share_result(json_t *val, json_t *res_val, json_t *err_val,
 				 struct stratum_share *sshare)
 {
@@ -4981,12 +5095,16 @@ static void pool_resus(struct pool *pool)
 		applog(LOG_INFO, "Pool %d %s resumed returning work", pool->pool_no, pool->rpc_url);
 }
 
-static struct work *hash_pop(void)
+static struct work *hash_pop(const bool blocking)
 {
 	struct work *work = NULL, *tmp;
 	int hc;
 
 	mutex_lock(stgd_lock);
+	if (!blocking && !HASH_COUNT(staged_work)) {
+		mutex_unlock(stgd_lock);
+		return NULL;
+	}
 	while (!getq->frozen && !HASH_COUNT(staged_work))
 		pthread_cond_wait(&getq->cond, stgd_lock);
 
@@ -5052,6 +5170,11 @@ static void gen_hash(unsigned char *data, unsigned char *hash, int len)
 {
 	unsigned char hash1[32];
 
+	/* Merkle tree nodes are always a pair of hashes */
+	if (len == 64) {
+		sha2_double64(data, hash);
+		return;
+	}
 	sha2(data, len, hash1);
 	sha2(hash1, 32, hash);
 }
@@ -5090,10 +5213,10 @@ static void set_work_target(struct work *work, double diff)
 	}
 
 	if (opt_debug) {
-		char *htarget = bin2hex(target, 32);
+		char htarget[65];
 
+		__bin2hex(htarget, target, 32);
 		applog(LOG_DEBUG, "Generated target %s", htarget);
-		free(htarget);
 	}
 	memcpy(work->target, target, 32);
 }
@@ -5103,16 +5226,15 @@ static void set_work_target(struct work *work, double diff)
  * other means to detect when the pool has died in stratum_thread */
 static void gen_stratum_work(struct pool *pool, struct work *work)
 {
-	unsigned char *coinbase, merkle_root[32], merkle_sha[64], *merkle_hash;
+	unsigned char *coinbase, merkle_root[32], merkle_sha[64];
 	int len, cb1_len, n1_len, cb2_len, i;
 	uint32_t *data32, *swap32;
-	char *header;
+	bool header_ok;
 
 	mutex_lock(&pool->pool_lock);
 
 	/* Generate coinbase */
 	work->nonce2 = bin2hex((const unsigned char *)&pool->nonce2, pool->n2size);
-	pool->nonce2++;
 	cb1_len = strlen(pool->swork.coinbase1) / 2;
 	n1_len = strlen(pool->nonce1) / 2;
 	cb2_len = strlen(pool->swork.coinbase2) / 2;
@@ -5120,7 +5242,8 @@ static void gen_stratum_work(struct pool *pool, struct work *work)
 	coinbase = alloca(len + 1);
 	hex2bin(coinbase, pool->swork.coinbase1, cb1_len);
 	hex2bin(coinbase + cb1_len, pool->nonce1, n1_len);
-	hex2bin(coinbase + cb1_len + n1_len, work->nonce2, pool->n2size);
+	memcpy(coinbase + cb1_len + n1_len, &pool->nonce2, pool->n2size);
+	pool->nonce2++;
 	hex2bin(coinbase + cb1_len + n1_len + pool->n2size, pool->swork.coinbase2, cb2_len);
 
 	/* Generate merkle root */
@@ -5138,15 +5261,15 @@ static void gen_stratum_work(struct pool *pool, struct work *work)
 	swap32 = (uint32_t *)merkle_root;
 	for (i = 0; i < 32 / 4; i++)
 		swap32[i] = swab32(data32[i]);
-	merkle_hash = (unsigned char *)bin2hex((const unsigned char *)merkle_root, 32);
 
-	header = strdup(pool->swork.bbversion);
-	header = realloc_strcat(header, pool->swork.prev_hash);
-	header = realloc_strcat(header, (char *)merkle_hash);
-	header = realloc_strcat(header, pool->swork.ntime);
-	header = realloc_strcat(header, pool->swork.nbit);
-	header = realloc_strcat(header, "00000000"); /* nonce */
-	header = realloc_strcat(header, workpadding);
+	/* Decode the header fields straight into the work data */
+	header_ok = hex2bin(work->data, pool->swork.bbversion, 4) &&
+		    hex2bin(work->data + 4, pool->swork.prev_hash, 32) &&
+		    hex2bin(work->data + 4 + 32 + 32, pool->swork.ntime, 4) &&
+		    hex2bin(work->data + 4 + 32 + 32 + 4, pool->swork.nbit, 4);
+	memcpy(work->data + 4 + 32, merkle_root, 32);
+	memset(work->data + 4 + 32 + 32 + 4 + 4, 0, 4); /* nonce */
+	hex2bin(work->data + 4 + 32 + 32 + 4 + 4 + 4, workpadding, 48);
 
 	/* Store the stratum work diff to check it still matches the pool's
 	 * stratum diff when submitting shares */
@@ -5158,16 +5281,19 @@ static void gen_stratum_work(struct pool *pool, struct work *work)
 
 	mutex_unlock(&pool->pool_lock);
 
-	applog(LOG_DEBUG, "Generated stratum merkle %s", merkle_hash);
-	applog(LOG_DEBUG, "Generated stratum header %s", header);
-	applog(LOG_DEBUG, "Work job_id %s nonce2 %s ntime %s", work->job_id, work->nonce2, work->ntime);
+	if (unlikely(!header_ok))
+		quit(1, "Failed to convert header to data in gen_stratum_work");
 
-	free(merkle_hash);
+	if (opt_debug) {
+		char merkle_hash[65], header[257];
+
+		__bin2hex(merkle_hash, merkle_root, 32);
+		__bin2hex(header, work->data, 128);
+		applog(LOG_DEBUG, "Generated stratum merkle %s", merkle_hash);
+		applog(LOG_DEBUG, "Generated stratum header %s", header);
+		applog(LOG_DEBUG, "Work job_id %s nonce2 %s ntime %s", work->job_id, work->nonce2, work->ntime);
+	}
 
-	/* Convert hex data to binary data for work */
-	if (unlikely(!hex2bin(work->data, header, 128)))
-		quit(1, "Failed to convert header to data in gen_stratum_work");
-	free(header);
 	calc_midstate(work);
 
 	set_work_target(work, work->sdiff);
@@ -5185,7 +5311,7 @@ static void gen_stratum_work(struct pool *pool, struct work *work)
 	gettimeofday(&work->tv_staged, NULL);
 }
 
-static struct work *get_work(struct thr_info *thr, const int thr_id)
+struct work *get_work(struct thr_info *thr, const int thr_id)
 {
 	struct work *work = NULL;
 
@@ -5195,7 +5321,7 @@ static struct work *get_work(struct thr_info *thr, const int thr_id)
 
 	applog(LOG_DEBUG, "Popping work from get queue to get work");
 	while (!work) {
-		work = hash_pop();
+		work = hash_pop(true);
 		if (stale_work(work, false)) {
 			discard_work(work);
 			work = NULL;
@@ -5210,6 +5336,30 @@ static struct work *get_work(struct thr_info *thr, const int thr_id)
 	return work;
 }
 
+/* As get_work() but returns NULL instead of waiting when nothing is staged,
+ * for devices run from an event thread that must not block */
+struct work *get_work_nowait(struct thr_info *thr, const int thr_id)
+{
+	struct work *work;
+
+	while ((work = hash_pop(false))) {
+		if (!stale_work(work, false))
+			break;
+		discard_work(work);
+		wake_gws();
+	}
+
+	if (!work) {
+		thread_reportout(thr);
+		return NULL;
+	}
+
+	work->thr_id = thr_id;
+	thread_reportin(thr);
+	work->mined = true;
+	return work;
+}
+
 void submit_work_async(struct work *work_in, struct timeval *tv_work_found)
 {
 	struct work *work = copy_work(work_in);
@@ -5222,18 +5372,37 @@ void submit_work_async(struct work *work_in, struct timeval *tv_work_found)
 		quit(1, "Failed to create submit_work_thread");
 }
 
-static bool hashtest(struct thr_info *thr, struct work *work)
+/* Every work item carries the midstate of the first 64 bytes of its header,
+ * so checking a nonce only needs the last 16 bytes hashed on top of it. */
+static void midstate_context(sha2_context *ctx, const struct work *work)
 {
-	uint32_t *data32 = (uint32_t *)(work->data);
-	unsigned char swap[80];
-	uint32_t *swap32 = (uint32_t *)swap;
+	memcpy(ctx->state, work->midstate, sizeof(ctx->state));
+#if defined(__BIG_ENDIAN__) || defined(MIPSEB)
+	int i;
+	for (i = 0; i < 8; i++)
+		ctx->state[i] = swab32(ctx->state[i]);
+#endif
+	ctx->total[0] = 64;
+	ctx->total[1] = 0;
+}
+
+static bool hashtest(struct thr_info *thr, struct work *work, const sha2_context *mid)
+{
+	uint32_t *data32 = (uint32_t *)(work->data + 64);
+	uint32_t tail[4];
 	unsigned char hash1[32];
 	unsigned char hash2[32];
 	uint32_t *hash2_32 = (uint32_t *)hash2;
+	sha2_context ctx;
 	bool ret = false;
+	int i;
 
-	flip80(swap32, data32);
-	sha2(swap, 80, hash1);
+	for (i = 0; i < 4; i++)
+		tail[i] = swab32(data32[i]);
+	memcpy(ctx.total, mid->total, sizeof(ctx.total));
+	memcpy(ctx.state, mid->state, sizeof(ctx.state));
+	sha2_update(&ctx, (unsigned char *)tail, sizeof(tail));
+	sha2_finish(&ctx, hash1);
 	sha2(hash1, 32, work->hash);
 	flip32(hash2_32, work->hash);
 
@@ -5263,25 +5432,53 @@ out:
 	return ret;
 }
 
-void submit_nonce(struct thr_info *thr, struct work *work, uint32_t nonce)
+/* Checks and submits all the nonces a device found on one work item, taking
+ * the stats lock and setting up the midstate once for the lot. Devices that
+ * only return nonces above difficulty 1 give the number of difficulty 1
+ * shares each nonce stands for in diff1 */
+void submit_nonces_diff1(struct thr_info *thr, struct work *work, const uint32_t *nonces, int count, double diff1)
 {
 	uint32_t *work_nonce = (uint32_t *)(work->data + 64 + 12);
 	struct timeval tv_work_found;
+	sha2_context mid;
+	int i, shares;
+
+	if (unlikely(count < 1))
+		return;
 
 	gettimeofday(&tv_work_found, NULL);
-	*work_nonce = htole32(nonce);
 
 	mutex_lock(&stats_lock);
-	total_diff1++;
-	thr->cgpu->diff1++;
-	work->pool->diff1++;
+	thr->cgpu->diff1_frac += diff1 * count;
+	shares = (int)(thr->cgpu->diff1_frac);
+	thr->cgpu->diff1_frac -= shares;
+	total_diff1 += shares;
+	thr->cgpu->diff1 += shares;
+	work->pool->diff1 += shares;
 	mutex_unlock(&stats_lock);
 
-	/* Do one last check before attempting to submit the work */
-	if (!opt_scrypt && !hashtest(thr, work))
-		return;
+	if (!opt_scrypt)
+		midstate_context(&mid, work);
+
+	for (i = 0; i < count; i++) {
+		*work_nonce = htole32(nonces[i]);
+
+		/* Do one last check before attempting to submit the work */
+		if (!opt_scrypt && !hashtest(thr, work, &mid))
+			continue;
+
+		submit_work_async(work, &tv_work_found);
+	}
+}
+
+void submit_nonces(struct thr_info *thr, struct work *work, const uint32_t *nonces, int count)
+{
+	submit_nonces_diff1(thr, work, nonces, count, 1.0);
+}
 
-	submit_work_async(work, &tv_work_found);
+void submit_nonce(struct thr_info *thr, struct work *work, uint32_t nonce)
+{
+	submit_nonces(thr, work, &nonce, 1);
 }
 
 static inline bool abandon_work(struct work *work, struct timeval *wdiff, uint64_t hashes)
@@ -5352,7 +5549,10 @@ void *miner_thread(void *userdata)
 
 	while (1) {
 		mythr->work_restart = false;
-		work = get_work(mythr, thr_id);
+		if (drv->get_work)
+			work = drv->get_work(mythr);
+		else
+			work = get_work(mythr, thr_id);
 		cgpu->new_work = true;
 
 		gettimeofday(&tv_workstart, NULL);
@@ -5409,6 +5609,17 @@ void *miner_thread(void *userdata)
 				applog(LOG_ERR, "%s %d failure, disabling!", drv->name, cgpu->device_id);
 				cgpu->deven = DEV_DISABLED;
 				dev_error(cgpu, REASON_THREAD_ZERO_HASH);
+#if defined(USE_MODMINER) || defined(USE_BITFORCE)
+				/* An unplugged device's thread ends, leaving its
+				 * slot for hotplug_process() to start it again in.
+				 * The driver data stays, the API may still show it */
+				if (cgpu->unplugged) {
+					free_work(work);
+					applog(LOG_WARNING, "Thread %d ending, device unplugged", thr_id);
+					tq_freeze(mythr->q);
+					return NULL;
+				}
+#endif
 				mt_disable(mythr, thr_id, drv);
 			}
 
@@ -5430,7 +5641,9 @@ void *miner_thread(void *userdata)
 			if (unlikely((long)sdiff.tv_sec < cycle)) {
 				int mult;
 
-				if (likely(!drv->can_limit_work || max_nonce == 0xffffffff))
+				/* No hashes means the driver had nothing left to
+				 * scan rather than that it scanned very fast */
+				if (likely(!drv->can_limit_work || max_nonce == 0xffffffff || !hashes))
 					continue;
 
 				mult = 1000000 / ((sdiff.tv_usec + 0x400) / 0x400) + 0x10;
@@ -5709,6 +5922,9 @@ void reinit_device(struct cgpu_info *cgpu)
 }
 
 static struct timeval rotate_tv;
+#if defined(USE_MODMINER) || defined(USE_BITFORCE)
+static struct timeval usb_latency_tv;
+#endif
 
 /* We reap curls if they are unused for over a minute */
 static void reap_curl(struct pool *pool)
@@ -5809,6 +6025,9 @@ static void *watchdog_thread(void __maybe_unused *userdata)
 
 	memset(&zero_tv, 0, sizeof(struct timeval));
 	gettimeofday(&rotate_tv, NULL);
+#if defined(USE_MODMINER) || defined(USE_BITFORCE)
+	gettimeofday(&usb_latency_tv, NULL);
+#endif
 
 	while (1) {
 		int i;
@@ -5836,6 +6055,13 @@ static void *watchdog_thread(void __maybe_unused *userdata)
 
 		gettimeofday(&now, NULL);
 
+#if defined(USE_MODMINER) || defined(USE_BITFORCE)
+		if (opt_usb_latency && now.tv_sec - usb_latency_tv.tv_sec >= opt_usb_latency) {
+			usb_latency_dump();
+			usb_latency_tv = now;
+		}
+#endif
+
 		if (!sched_paused && !should_run()) {
 			applog(LOG_WARNING, "Pausing execution as per stop time %02d:%02d scheduled",
 			       schedstop.tm.tm_hour, schedstop.tm.tm_min);
@@ -6058,6 +6284,9 @@ static void clean_up(void)
 #ifdef HAVE_OPENCL
 	clear_adl(nDevs);
 #endif
+#if defined(USE_MODMINER) || defined(USE_BITFORCE)
+	usb_cleanup();
+#endif
 #ifdef HAVE_LIBUSB
         libusb_exit(NULL);
 #endif
@@ -6321,6 +6550,14 @@ extern struct device_drv ztex_drv;
 
 static int cgminer_id_count = 0;
 
+/* Thread and device slots kept free for --usb-hotplug, since neither
+ * thr_info nor devices can move once the mining threads are running */
+static int hotplug_slots;
+static bool hotplug_active;
+static int hotplug_thr_max, hotplug_dev_max;
+static struct cgpu_info **hotplug_devices;
+static int hotplug_total;
+
 void enable_device(struct cgpu_info *cgpu)
 {
 	cgpu->deven = DEV_ENABLED;
@@ -6346,7 +6583,10 @@ bool add_cgpu(struct cgpu_info*cgpu)
 {
 	static struct _cgpu_devid_counter *devids = NULL;
 	struct _cgpu_devid_counter *d;
-	
+
+	// Devices detected in parallel are still added in the order tried
+	detect_ordered();
+
 	HASH_FIND_STR(devids, cgpu->drv->name, d);
 	if (d)
 		cgpu->device_id = ++d->lastid;
@@ -6356,11 +6596,563 @@ bool add_cgpu(struct cgpu_info*cgpu)
 		cgpu->device_id = d->lastid = 0;
 		HASH_ADD_STR(devids, name, d);
 	}
+	if (hotplug_active) {
+		// hotplug_process() adds it to devices once it's running
+		hotplug_devices = realloc(hotplug_devices, sizeof(struct cgpu_info *) * (hotplug_total + 1));
+		hotplug_devices[hotplug_total++] = cgpu;
+		return true;
+	}
 	devices = realloc(devices, sizeof(struct cgpu_info *) * (total_devices + 2));
 	devices[total_devices++] = cgpu;
 	return true;
 }
 
+/* Work pipeline microbenchmarks. Each path runs with doubling iteration
+ * counts until a run takes BENCH_PIPE_MIN_US, then the fastest of
+ * BENCH_PIPE_RUNS runs at that count gives ns/op. Allocations are only
+ * counted when built as cgminer-bench by "make bench", which wraps the
+ * allocator. */
+#define BENCH_PIPE_MIN_US	100000
+#define BENCH_PIPE_RUNS		5
+/* Percentage slowdown or extra allocations that count as a regression */
+#define BENCH_PIPE_TOLERANCE	10
+
+#ifdef WANT_BENCH_ALLOCS
+extern unsigned long bench_allocs;
+#define bench_alloc_count() (bench_allocs)
+#else
+#define bench_alloc_count() (0UL)
+#endif
+
+static const int bench_pipe_merkles[] = { 0, 6, 12 };
+static const int bench_pipe_txns[] = { 0, 100, 1000 };
+
+static struct device_drv bench_pipe_drv = {
+	.dname = "bench",
+	.name = "BEN",
+};
+
+static struct {
+	struct pool *stratum[ARRAY_SIZE(bench_pipe_merkles)];
+	struct pool *gbt[ARRAY_SIZE(bench_pipe_txns)];
+	struct work *work;
+	struct work *share;
+	struct work *spare;
+	uint32_t nonce;
+	unsigned char hash[32];
+	unsigned char bin[128];
+	char hex[257];
+	struct cgpu_info cgpu;
+	struct thr_info thr;
+	json_t *results;
+	/* The results of an earlier run to compare against */
+	json_t *base;
+	bool compare_allocs;
+} bench_pipe;
+
+/* Deterministic hex for merkle branches and transactions, so every run hashes
+ * the same data */
+static void bench_pipe_fill(char *hex, int len, int seed)
+{
+	unsigned char hash[32];
+	int i;
+
+	for (i = 0; i < len; i += 32) {
+		int n = len - i < 32 ? len - i : 32;
+
+		sha2((unsigned char *)&seed, sizeof(seed), hash);
+		memcpy(&seed, hash, sizeof(seed));
+		__bin2hex(hex + i * 2, hash, n);
+	}
+}
+
+static struct pool *bench_pipe_stratum_pool(int merkles)
+{
+	struct pool *pool = add_pool();
+	char *branch, *notify;
+	int i, len;
+
+	branch = calloc(merkles * 70 + 1, 1);
+	notify = malloc(strlen(BENCH_PIPE_NOTIFY) + merkles * 70 + 1);
+	if (unlikely(!branch || !notify))
+		quit(1, "Failed to alloc stratum template in bench_pipe_stratum_pool");
+	for (i = 0, len = 0; i < merkles; i++) {
+		len += sprintf(branch + len, "%s\"", i ? ", " : "");
+		bench_pipe_fill(branch + len, 32, i);
+		len += 64;
+		len += sprintf(branch + len, "\"");
+	}
+	sprintf(notify, BENCH_PIPE_NOTIFY, branch);
+	if (unlikely(!parse_method(pool, notify)))
+		quit(1, "Failed to parse stratum template in bench_pipe_stratum_pool");
+	free(notify);
+	free(branch);
+
+	pool->has_stratum = true;
+	pool->nonce1 = strdup(BENCH_PIPE_NONCE1);
+	pool->n2size = BENCH_PIPE_N2SIZE;
+	pool->swork.diff = 1;
+	return pool;
+}
+
+static struct pool *bench_pipe_gbt_pool(int txns)
+{
+	int i, len, txn_len = BENCH_PIPE_TXN_LEN * 2 + 64 + 32;
+	struct pool *pool = add_pool();
+	char *txn, *tmpl;
+	json_error_t err;
+	json_t *val;
+
+	txn = calloc(txns * txn_len + 1, 1);
+	tmpl = malloc(strlen(BENCH_PIPE_GBT) + txns * txn_len + 1);
+	if (unlikely(!txn || !tmpl))
+		quit(1, "Failed to alloc GBT template in bench_pipe_gbt_pool");
+	for (i = 0, len = 0; i < txns; i++) {
+		len += sprintf(txn + len, "%s{\"data\": \"", i ? ", " : "");
+		bench_pipe_fill(txn + len, BENCH_PIPE_TXN_LEN, i);
+		len += BENCH_PIPE_TXN_LEN * 2;
+		len += sprintf(txn + len, "\"}");
+	}
+	sprintf(tmpl, BENCH_PIPE_GBT, txn);
+	val = JSON_LOADS(tmpl, &err);
+	if (unlikely(!val || !gbt_decode(pool, val)))
+		quit(1, "Failed to decode GBT template in bench_pipe_gbt_pool");
+	json_decref(val);
+	free(tmpl);
+	free(txn);
+
+	pool->has_gbt = true;
+	/* Stops gen_gbt_work asking the pool for an update during the run */
+	gettimeofday(&pool->tv_lastwork, NULL);
+	return pool;
+}
+
+static void bench_pipe_init(void)
+{
+	unsigned char header[80];
+	unsigned int i;
+
+	getq = tq_new();
+	if (unlikely(!getq))
+		quit(1, "Failed to create getq");
+	stgd_lock = &getq->mutex;
+
+	for (i = 0; i < ARRAY_SIZE(bench_pipe_merkles); i++)
+		bench_pipe.stratum[i] = bench_pipe_stratum_pool(bench_pipe_merkles[i]);
+	for (i = 0; i < ARRAY_SIZE(bench_pipe_txns); i++)
+		bench_pipe.gbt[i] = bench_pipe_gbt_pool(bench_pipe_txns[i]);
+
+	bench_pipe.work = make_work();
+	gen_stratum_work(bench_pipe.stratum[0], bench_pipe.work);
+	/* Registers the block so later calls take the common known block path */
+	test_work_current(bench_pipe.work);
+
+	/* A real share that is below an impossible target, so submit_nonce
+	 * runs its full check without submitting anything */
+	bench_pipe.share = make_work();
+	hex2bin(header, BENCH_PIPE_GENESIS, 80);
+	flip80(bench_pipe.share->data, header);
+	calc_midstate(bench_pipe.share);
+	bench_pipe.nonce = ((uint32_t *)bench_pipe.share->data)[19];
+	bench_pipe.share->pool = bench_pipe.stratum[0];
+	regen_hash(bench_pipe.share);
+	flip32(bench_pipe.hash, bench_pipe.share->hash);
+
+	bench_pipe.spare = make_work();
+	bench_pipe.spare->pool = bench_pipe.stratum[0];
+	for (i = 0; i < 4; i++) {
+		struct work *work = make_work();
+
+		work->pool = bench_pipe.stratum[0];
+		hash_push(work);
+	}
+
+	for (i = 0; i < sizeof(bench_pipe.bin); i++)
+		bench_pipe.bin[i] = i * 7;
+	bench_pipe_fill(bench_pipe.hex, sizeof(bench_pipe.bin), 0);
+
+	bench_pipe.cgpu.drv = &bench_pipe_drv;
+	bench_pipe.thr.cgpu = &bench_pipe.cgpu;
+}
+
+static void bench_pipe_hex2bin(void __maybe_unused *ctx)
+{
+	hex2bin(bench_pipe.bin, bench_pipe.hex, sizeof(bench_pipe.bin));
+}
+
+static void bench_pipe_bin2hex(void __maybe_unused *ctx)
+{
+	free(bin2hex(bench_pipe.bin, sizeof(bench_pipe.bin)));
+}
+
+static void bench_pipe_fulltest(void *ctx)
+{
+	fulltest(bench_pipe.hash, ((struct work *)ctx)->target);
+}
+
+static void bench_pipe_regen_hash(void __maybe_unused *ctx)
+{
+	regen_hash(bench_pipe.share);
+}
+
+static void bench_pipe_gen_stratum(void *ctx)
+{
+	struct work *work = make_work();
+
+	gen_stratum_work(ctx, work);
+	free_work(work);
+}
+
+static void bench_pipe_gen_gbt(void *ctx)
+{
+	struct work *work = make_work();
+
+	gen_gbt_work(ctx, work);
+	free_work(work);
+}
+
+/* One work item in and one out of a shallow staged queue */
+static void bench_pipe_queue(void __maybe_unused *ctx)
+{
+	hash_push(bench_pipe.spare);
+	bench_pipe.spare = hash_pop(true);
+}
+
+static void bench_pipe_stale(void __maybe_unused *ctx)
+{
+	stale_work(bench_pipe.work, false);
+}
+
+static void bench_pipe_current(void __maybe_unused *ctx)
+{
+	test_work_current(bench_pipe.work);
+}
+
+static void bench_pipe_submit(void __maybe_unused *ctx)
+{
+	submit_nonce(&bench_pipe.thr, bench_pipe.share, bench_pipe.nonce);
+}
+
+/* Eight nonces from one work item, as a GPU buffer or BitForce reply has */
+static void bench_pipe_submit_batch(void __maybe_unused *ctx)
+{
+	uint32_t nonces[8];
+	int i;
+
+	for (i = 0; i < 8; i++)
+		nonces[i] = bench_pipe.nonce;
+	submit_nonces(&bench_pipe.thr, bench_pipe.share, nonces, 8);
+}
+
+static json_t *bench_pipe_find(json_t *results, const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < json_array_size(results); i++) {
+		json_t *res = json_array_get(results, i);
+
+		if (!strcmp(json_string_value(json_object_get(res, "name")), name))
+			return res;
+	}
+	return NULL;
+}
+
+/* Returns true if the path regressed against its entry in base */
+static bool bench_pipe_run(const char *name, void (*func)(void *), void *ctx)
+{
+	double us, ns_op, allocs_op;
+	struct timeval tv_start, tv_end;
+	unsigned long allocs, i, iters;
+	bool regressed = false;
+	char change[64] = "";
+	int run;
+	json_t *res;
+
+	/* Warm the caches and any lazily allocated state first */
+	func(ctx);
+	for (iters = 1; ; iters *= 2) {
+		gettimeofday(&tv_start, NULL);
+		for (i = 0; i < iters; i++)
+			func(ctx);
+		gettimeofday(&tv_end, NULL);
+		if (us_tdiff(&tv_end, &tv_start) >= BENCH_PIPE_MIN_US)
+			break;
+	}
+	/* The fastest run is the one least disturbed by the rest of the system */
+	for (run = 0, us = 0; run < BENCH_PIPE_RUNS; run++) {
+		double run_us;
+
+		allocs = bench_alloc_count();
+		gettimeofday(&tv_start, NULL);
+		for (i = 0; i < iters; i++)
+			func(ctx);
+		gettimeofday(&tv_end, NULL);
+		allocs = bench_alloc_count() - allocs;
+		run_us = us_tdiff(&tv_end, &tv_start);
+		if (!run || run_us < us)
+			us = run_us;
+	}
+	ns_op = us * 1000 / iters;
+	allocs_op = (double)allocs / iters;
+
+	res = bench_pipe.base ? bench_pipe_find(bench_pipe.base, name) : NULL;
+	if (res) {
+		double base_ns = json_real_value(json_object_get(res, "ns_per_op"));
+		double base_allocs = json_real_value(json_object_get(res, "allocs_per_op"));
+
+		if (ns_op > base_ns * (100 + BENCH_PIPE_TOLERANCE) / 100)
+			regressed = true;
+		/* Only compare allocations when both runs counted them */
+		if (bench_pipe.compare_allocs && allocs_op > base_allocs * (100 + BENCH_PIPE_TOLERANCE) / 100 + 0.01)
+			regressed = true;
+		if (base_ns > 0)
+			snprintf(change, sizeof(change), " %+6.1f%%%s",
+				 (ns_op - base_ns) * 100 / base_ns,
+				 regressed ? " REGRESSION" : "");
+	}
+#ifdef WANT_BENCH_ALLOCS
+	printf("%-24s %10lu %12.1f ns/op %8.2f allocs/op%s\n", name, iters, ns_op, allocs_op, change);
+#else
+	printf("%-24s %10lu %12.1f ns/op%s\n", name, iters, ns_op, change);
+#endif
+	fflush(stdout);
+
+	res = json_object();
+	json_object_set_new(res, "name", json_string(name));
+	json_object_set_new(res, "iterations", json_integer(iters));
+	json_object_set_new(res, "ns_per_op", json_real(ns_op));
+	json_object_set_new(res, "allocs_per_op", json_real(allocs_op));
+	json_array_append_new(bench_pipe.results, res);
+
+	return regressed;
+}
+
+static void bench_pipeline(void)
+{
+	json_t *root, *base = NULL;
+	int regressions = 0;
+	unsigned int i;
+	char name[64];
+
+	if (opt_bench_pipeline_compare) {
+		json_error_t err;
+
+#if JANSSON_MAJOR_VERSION > 1
+		base = json_load_file(opt_bench_pipeline_compare, 0, &err);
+#else
+		base = json_load_file(opt_bench_pipeline_compare, &err);
+#endif
+		if (!base)
+			quit(1, "Failed to load %s to compare against: %s", opt_bench_pipeline_compare, err.text);
+		bench_pipe.base = json_object_get(base, "results");
+#ifdef WANT_BENCH_ALLOCS
+		bench_pipe.compare_allocs = json_is_true(json_object_get(base, "allocs_counted"));
+#endif
+	}
+
+	bench_pipe_init();
+	bench_pipe.results = json_array();
+	printf("sha2 backend: %s\n", sha2_backend());
+
+	regressions += bench_pipe_run("hex2bin/128", bench_pipe_hex2bin, NULL);
+	regressions += bench_pipe_run("bin2hex/128", bench_pipe_bin2hex, NULL);
+	regressions += bench_pipe_run("fulltest", bench_pipe_fulltest, bench_pipe.work);
+	regressions += bench_pipe_run("regen_hash", bench_pipe_regen_hash, NULL);
+	for (i = 0; i < ARRAY_SIZE(bench_pipe_merkles); i++) {
+		sprintf(name, "gen_stratum_work/%d", bench_pipe_merkles[i]);
+		regressions += bench_pipe_run(name, bench_pipe_gen_stratum, bench_pipe.stratum[i]);
+	}
+	for (i = 0; i < ARRAY_SIZE(bench_pipe_txns); i++) {
+		sprintf(name, "gen_gbt_work/%d", bench_pipe_txns[i]);
+		regressions += bench_pipe_run(name, bench_pipe_gen_gbt, bench_pipe.gbt[i]);
+	}
+	regressions += bench_pipe_run("hash_push+hash_pop", bench_pipe_queue, NULL);
+	regressions += bench_pipe_run("stale_work", bench_pipe_stale, NULL);
+	regressions += bench_pipe_run("test_work_current", bench_pipe_current, NULL);
+	regressions += bench_pipe_run("submit_nonce", bench_pipe_submit, NULL);
+	regressions += bench_pipe_run("submit_nonces/8", bench_pipe_submit_batch, NULL);
+
+	if (opt_bench_pipeline_json) {
+		FILE *f = fopen(opt_bench_pipeline_json, "w");
+
+		root = json_object();
+		json_object_set_new(root, "version", json_string(VERSION));
+		json_object_set_new(root, "sha2_backend", json_string(sha2_backend()));
+#ifdef WANT_BENCH_ALLOCS
+		json_object_set_new(root, "allocs_counted", json_true());
+#else
+		json_object_set_new(root, "allocs_counted", json_false());
+#endif
+		json_object_set_new(root, "results", bench_pipe.results);
+		if (!f || json_dumpf(root, f, JSON_INDENT(2) | JSON_PRESERVE_ORDER))
+			applog(LOG_ERR, "Failed to write the benchmark results to %s", opt_bench_pipeline_json);
+		if (f)
+			fclose(f);
+		json_decref(root);
+	} else
+		json_decref(bench_pipe.results);
+	if (base)
+		json_decref(base);
+
+	if (regressions)
+		quit(1, "%d paths regressed by more than %d%% against %s", regressions,
+		     BENCH_PIPE_TOLERANCE, opt_bench_pipeline_compare);
+}
+
+/* Create the mining threads of a device, numbered from first_thr */
+static void start_cgpu_threads(struct cgpu_info *cgpu, int first_thr)
+{
+	struct thr_info *thr;
+	int j, k = first_thr;
+
+	cgpu->thr = malloc(sizeof(*cgpu->thr) * (cgpu->threads+1));
+	cgpu->thr[cgpu->threads] = NULL;
+	cgpu->status = LIFE_INIT;
+
+	for (j = 0; j < cgpu->threads; ++j, ++k) {
+		thr = &thr_info[k];
+		thr->id = k;
+		thr->cgpu = cgpu;
+		thr->device_thread = j;
+
+		thr->q = tq_new();
+		if (!thr->q)
+			quit(1, "tq_new failed in starting %s%d mining thread (#%d)", cgpu->drv->name, cgpu->device_id, cgpu->cgminer_id);
+
+		/* Enable threads for devices set not to mine but disable
+		 * their queue in case we wish to enable them later */
+		if (cgpu->deven != DEV_DISABLED) {
+			applog(LOG_DEBUG, "Pushing ping to thread %d", thr->id);
+
+			tq_push(thr->q, &ping);
+		}
+
+		if (cgpu->drv->thread_prepare && !cgpu->drv->thread_prepare(thr))
+			continue;
+
+		/* The driver may run the device from its own event
+		 * thread, leaving it without a miner thread */
+		gettimeofday(&thr->tv_lastupdate, NULL);
+		if (cgpu->drv->thread_attach && cgpu->drv->thread_attach(thr)) {
+			cgpu->thr[j] = thr;
+			continue;
+		}
+
+		thread_reportout(thr);
+
+		if (unlikely(thr_info_create(thr, NULL, miner_thread, thr)))
+			quit(1, "thread %d create failed", thr->id);
+
+		cgpu->thr[j] = thr;
+	}
+}
+
+#if defined(USE_MODMINER) || defined(USE_BITFORCE)
+/* The unplugged device cgpu is, if it has come back, with the first of its
+ * thread slots in first_thr. Its threads have ended or are about to */
+static struct cgpu_info *hotplug_returning(struct cgpu_info *cgpu, int *first_thr)
+{
+	struct cgpu_info *old;
+	int i, j;
+
+	for (i = 0; i < total_devices; i++) {
+		old = devices[i];
+		if (old->drv != cgpu->drv || !old->unplugged || !usb_same_device(old, cgpu))
+			continue;
+
+		for (j = 0; j < mining_threads; j++)
+			if (thr_info[j].cgpu == old) {
+				*first_thr = j;
+				return old;
+			}
+	}
+
+	return NULL;
+}
+
+/* Called by the USB hotplug thread after it has detected new devices.
+ * A device that was unplugged and has come back is started again in its
+ * old thread slots and keeps its old number. Any other's threads are
+ * started in a free slot before it is added to devices and mining_threads,
+ * where everything else will see it */
+void hotplug_process(void)
+{
+	struct cgpu_info *old;
+	int i, j, first_thr;
+
+	for (i = 0; i < hotplug_total; i++) {
+		struct cgpu_info *cgpu = hotplug_devices[i];
+
+		cgpu->deven = DEV_ENABLED;
+		cgpu->cgminer_stats.getwork_wait_min.tv_sec = MIN_SEC_UNSET;
+		if (!cgpu->cutofftemp)
+			cgpu->cutofftemp = opt_cutofftemp;
+
+		old = hotplug_returning(cgpu, &first_thr);
+		if (old && old->threads == cgpu->threads) {
+			for (j = 0; j < old->threads; j++)
+				pthread_join(thr_info[first_thr + j].pth, NULL);
+
+			/* The old cgpu isn't freed, since the API and the
+			 * watchdog may still be looking at it, but it is
+			 * replaced in devices with the same number and
+			 * the counts zero_stats() clears */
+			cgpu->cgminer_id = old->cgminer_id;
+			cgpu->device_id = old->device_id;
+			cgpu->total_mhashes = old->total_mhashes;
+			cgpu->accepted = old->accepted;
+			cgpu->rejected = old->rejected;
+			cgpu->hw_errors = old->hw_errors;
+			cgpu->utility = old->utility;
+			cgpu->last_share_pool_time = old->last_share_pool_time;
+			cgpu->diff1 = old->diff1;
+			cgpu->diff1_frac = old->diff1_frac;
+			cgpu->diff_accepted = old->diff_accepted;
+			cgpu->diff_rejected = old->diff_rejected;
+			cgpu->last_share_diff = old->last_share_diff;
+
+			start_cgpu_threads(cgpu, first_thr);
+			devices[cgpu->cgminer_id] = cgpu;
+
+			applog(LOG_WARNING, "%s%d: Plugged back in, now mining",
+				cgpu->drv->name, cgpu->device_id);
+			continue;
+		}
+
+		if (total_devices >= hotplug_dev_max || mining_threads + cgpu->threads > hotplug_thr_max) {
+			applog(LOG_WARNING, "%s%d: No --usb-hotplug slots left, restart cgminer to use it",
+				cgpu->drv->name, cgpu->device_id);
+			continue;
+		}
+
+		cgpu->cgminer_id = cgminer_id_count++;
+		start_cgpu_threads(cgpu, mining_threads);
+
+		/* Nothing else takes a lock to read these, the lock just
+		 * makes sure devices is filled in before the counts grow */
+		mutex_lock(&hash_lock);
+		devices[cgpu->cgminer_id] = cgpu;
+		total_devices++;
+		mining_threads += cgpu->threads;
+		mutex_unlock(&hash_lock);
+
+#ifdef HAVE_CURSES
+		lock_curses();
+		adj_width(mining_threads, &dev_width);
+		if (!opt_compact)
+			logstart++;
+		unlock_curses();
+		if (!opt_compact)
+			check_winsizes();
+#endif
+		applog(LOG_WARNING, "%s%d: Hotplugged, now mining",
+			cgpu->drv->name, cgpu->device_id);
+	}
+
+	hotplug_total = 0;
+}
+#endif
+
 int main(int argc, char *argv[])
 {
 	bool pools_active = false;
@@ -6368,7 +7160,7 @@ int main(int argc, char *argv[])
 	struct thr_info *thr;
 	struct block *block;
 	unsigned int k;
-	int i, j;
+	int i;
 	char *s;
 
 	/* This dangerous functions tramples random dynamically allocated
@@ -6490,6 +7282,15 @@ int main(int argc, char *argv[])
 		successful_connect = true;
 	}
 
+#ifdef WANT_CPUMINE
+	if (opt_bench_cpu > 0 && opt_bench_cpu_json && !strcmp(opt_bench_cpu_json, "-")) {
+#ifdef HAVE_CURSES
+		use_curses = false;
+#endif
+		bench_cpu_stdout();
+	}
+#endif
+
 #ifdef HAVE_CURSES
 	if (opt_realquiet || devices_enabled == -1)
 		use_curses = false;
@@ -6523,8 +7324,21 @@ int main(int argc, char *argv[])
 	if (want_per_device_stats)
 		opt_log_output = true;
 
+	if (opt_bench_pipeline) {
+		bench_pipeline();
+		exit(0);
+	}
+
 #ifdef WANT_CPUMINE
+	if (opt_bench_cpu > 0) {
+		bench_cpu(opt_bench_cpu);
+		exit(0);
+	}
 #ifdef USE_SCRYPT
+	if (opt_bench_scrypt > 0) {
+		bench_scrypt_scratchpads(opt_bench_scrypt);
+		exit(0);
+	}
 	if (opt_scrypt)
 		set_scrypt_algo(&opt_algo);
 	else
@@ -6636,6 +7450,14 @@ int main(int argc, char *argv[])
 	if (!total_devices)
 		quit(1, "All devices disabled, cannot mine!");
 
+#ifdef HAVE_LIBUSB
+	hotplug_slots = opt_usb_hotplug;
+#endif
+	if (hotplug_slots) {
+		hotplug_dev_max = total_devices + hotplug_slots;
+		devices = realloc(devices, sizeof(struct cgpu_info *) * (hotplug_dev_max + 1));
+	}
+
 	load_temp_cutoffs();
 
 	for (i = 0; i < total_devices; ++i)
@@ -6685,13 +7507,14 @@ int main(int argc, char *argv[])
 			fork_monitor();
 	#endif // defined(unix)
 
-	total_threads = mining_threads + 7;
+	hotplug_thr_max = mining_threads + hotplug_slots;
+	total_threads = hotplug_thr_max + 7;
 	thr_info = calloc(total_threads, sizeof(*thr));
 	if (!thr_info)
 		quit(1, "Failed to calloc thr_info");
 
-	gwsched_thr_id = mining_threads;
-	stage_thr_id = mining_threads + 1;
+	gwsched_thr_id = hotplug_thr_max;
+	stage_thr_id = hotplug_thr_max + 1;
 	thr = &thr_info[stage_thr_id];
 	thr->q = tq_new();
 	if (!thr->q)
@@ -6778,39 +7601,8 @@ begin_bench:
 	// Start threads
 	k = 0;
 	for (i = 0; i < total_devices; ++i) {
-		struct cgpu_info *cgpu = devices[i];
-		cgpu->thr = malloc(sizeof(*cgpu->thr) * (cgpu->threads+1));
-		cgpu->thr[cgpu->threads] = NULL;
-		cgpu->status = LIFE_INIT;
-
-		for (j = 0; j < cgpu->threads; ++j, ++k) {
-			thr = &thr_info[k];
-			thr->id = k;
-			thr->cgpu = cgpu;
-			thr->device_thread = j;
-
-			thr->q = tq_new();
-			if (!thr->q)
-				quit(1, "tq_new failed in starting %s%d mining thread (#%d)", cgpu->drv->name, cgpu->device_id, i);
-
-			/* Enable threads for devices set not to mine but disable
-			 * their queue in case we wish to enable them later */
-			if (cgpu->deven != DEV_DISABLED) {
-				applog(LOG_DEBUG, "Pushing ping to thread %d", thr->id);
-
-				tq_push(thr->q, &ping);
-			}
-
-			if (cgpu->drv->thread_prepare && !cgpu->drv->thread_prepare(thr))
-				continue;
-
-			thread_reportout(thr);
-
-			if (unlikely(thr_info_create(thr, NULL, miner_thread, thr)))
-				quit(1, "thread %d create failed", thr->id);
-
-			cgpu->thr[j] = thr;
-		}
+		start_cgpu_threads(devices[i], k);
+		k += devices[i]->threads;
 	}
 
 #ifdef HAVE_OPENCL
@@ -6829,14 +7621,14 @@ begin_bench:
 	gettimeofday(&total_tv_start, NULL);
 	gettimeofday(&total_tv_end, NULL);
 
-	watchpool_thr_id = mining_threads + 2;
+	watchpool_thr_id = hotplug_thr_max + 2;
 	thr = &thr_info[watchpool_thr_id];
 	/* start watchpool thread */
 	if (thr_info_create(thr, NULL, watchpool_thread, NULL))
 		quit(1, "watchpool thread create failed");
 	pthread_detach(thr->pth);
 
-	watchdog_thr_id = mining_threads + 3;
+	watchdog_thr_id = hotplug_thr_max + 3;
 	thr = &thr_info[watchdog_thr_id];
 	/* start watchdog thread */
 	if (thr_info_create(thr, NULL, watchdog_thread, NULL))
@@ -6845,7 +7637,7 @@ begin_bench:
 
 #ifdef HAVE_OPENCL
 	/* Create reinit gpu thread */
-	gpur_thr_id = mining_threads + 4;
+	gpur_thr_id = hotplug_thr_max + 4;
 	thr = &thr_info[gpur_thr_id];
 	thr->q = tq_new();
 	if (!thr->q)
@@ -6855,7 +7647,7 @@ begin_bench:
 #endif	
 
 	/* Create API socket thread */
-	api_thr_id = mining_threads + 5;
+	api_thr_id = hotplug_thr_max + 5;
 	thr = &thr_info[api_thr_id];
 	if (thr_info_create(thr, NULL, api_thread, thr))
 		quit(1, "API thread create failed");
@@ -6864,13 +7656,20 @@ begin_bench:
 	/* Create curses input thread for keyboard input. Create this last so
 	 * that we know all threads are created since this can call kill_work
 	 * to try and shut down ll previous threads. */
-	input_thr_id = mining_threads + 6;
+	input_thr_id = hotplug_thr_max + 6;
 	thr = &thr_info[input_thr_id];
 	if (thr_info_create(thr, NULL, input_thread, thr))
 		quit(1, "input thread create failed");
 	pthread_detach(thr->pth);
 #endif
 
+#if defined(USE_MODMINER) || defined(USE_BITFORCE)
+	if (hotplug_slots) {
+		hotplug_active = true;
+		usb_hotplug_init();
+	}
+#endif
+
 	/* Once everything is set up, main() becomes the getwork scheduler */
 	while (42) {
 		int ts, max_staged = opt_queue;
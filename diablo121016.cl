@@ -44,6 +44,81 @@
 #define ZR26(n) ((Zrotr((n), 26) ^ Zrotr((n), 21) ^ Zrotr((n), 7)))
 #define ZR30(n) ((Zrotr((n), 30) ^ Zrotr((n), 19) ^ Zrotr((n), 10)))
 
+__constant uint TK[64] = {
+	0x428a2f98U, 0x71374491U, 0xb5c0fbcfU, 0xe9b5dba5U, 0x3956c25bU, 0x59f111f1U, 0x923f82a4U, 0xab1c5ed5U,
+	0xd807aa98U, 0x12835b01U, 0x243185beU, 0x550c7dc3U, 0x72be5d74U, 0x80deb1feU, 0x9bdc06a7U, 0xc19bf174U,
+	0xe49b69c1U, 0xefbe4786U, 0x0fc19dc6U, 0x240ca1ccU, 0x2de92c6fU, 0x4a7484aaU, 0x5cb0a9dcU, 0x76f988daU,
+	0x983e5152U, 0xa831c66dU, 0xb00327c8U, 0xbf597fc7U, 0xc6e00bf3U, 0xd5a79147U, 0x06ca6351U, 0x14292967U,
+	0x27b70a85U, 0x2e1b2138U, 0x4d2c6dfcU, 0x53380d13U, 0x650a7354U, 0x766a0abbU, 0x81c2c92eU, 0x92722c85U,
+	0xa2bfe8a1U, 0xa81a664bU, 0xc24b8b70U, 0xc76c51a3U, 0xd192e819U, 0xd6990624U, 0xf40e3585U, 0x106aa070U,
+	0x19a4c116U, 0x1e376c08U, 0x2748774cU, 0x34b0bcb5U, 0x391c0cb3U, 0x4ed8aa4aU, 0x5b9cca4fU, 0x682e6ff3U,
+	0x748f82eeU, 0x78a5636fU, 0x84c87814U, 0x8cc70208U, 0x90befffaU, 0xa4506cebU, 0xbef9a3f7U, 0xc67178f2U
+};
+
+void target_block(uint *hs, uint *tw)
+{
+	uint tv[8], x, y, i;
+
+	for (i = 0; i < 8; i++)
+		tv[i] = hs[i];
+	for (i = 0; i < 64; i++) {
+		if (i >= 16) {
+			x = tw[(i + 14) & 15];
+			y = tw[(i + 1) & 15];
+			tw[i & 15] += (rotate(x, 15U) ^ rotate(x, 13U) ^ (x >> 10U)) + tw[(i + 9) & 15] +
+				      (rotate(y, 25U) ^ rotate(y, 14U) ^ (y >> 3U));
+		}
+		x = tv[7] + TK[i] + tw[i & 15] + bitselect(tv[6], tv[5], tv[4]) +
+		    (rotate(tv[4], 26U) ^ rotate(tv[4], 21U) ^ rotate(tv[4], 7U));
+		y = bitselect(tv[0], tv[1], tv[2] ^ tv[0]) +
+		    (rotate(tv[0], 30U) ^ rotate(tv[0], 19U) ^ rotate(tv[0], 10U));
+		tv[7] = tv[6];
+		tv[6] = tv[5];
+		tv[5] = tv[4];
+		tv[4] = tv[3] + x;
+		tv[3] = tv[2];
+		tv[2] = tv[1];
+		tv[1] = tv[0];
+		tv[0] = x + y;
+	}
+	for (i = 0; i < 8; i++)
+		hs[i] += tv[i];
+}
+
+// Rehash H7 candidates so that nonces below the share target never leave the GPU
+bool meets_target(const uint state0, const uint state1, const uint state2, const uint state3,
+		  const uint state4, const uint state5, const uint state6, const uint state7,
+		  const uint merkle, const uint ntime, const uint nbits, const uint nonce,
+		  const uint target)
+{
+	uint hs[8], tw[16], i;
+
+	hs[0] = state0; hs[1] = state1; hs[2] = state2; hs[3] = state3;
+	hs[4] = state4; hs[5] = state5; hs[6] = state6; hs[7] = state7;
+	tw[0] = merkle; tw[1] = ntime; tw[2] = nbits; tw[3] = nonce;
+	tw[4] = 0x80000000U;
+	for (i = 5; i < 15; i++)
+		tw[i] = 0;
+	tw[15] = 0x280U;
+	target_block(hs, tw);
+
+	for (i = 0; i < 8; i++)
+		tw[i] = hs[i];
+	tw[8] = 0x80000000U;
+	for (i = 9; i < 15; i++)
+		tw[i] = 0;
+	tw[15] = 0x100U;
+	hs[0] = 0x6a09e667U; hs[1] = 0xbb67ae85U; hs[2] = 0x3c6ef372U; hs[3] = 0xa54ff53aU;
+	hs[4] = 0x510e527fU; hs[5] = 0x9b05688cU; hs[6] = 0x1f83d9abU; hs[7] = 0x5be0cd19U;
+	target_block(hs, tw);
+
+	if (hs[7])
+		return false;
+	// The target is little endian
+	hs[6] = (rotate(hs[6], 8U) & 0x00ff00ffU) | (rotate(hs[6], 24U) & 0xff00ff00U);
+	return hs[6] <= target;
+}
+
 __kernel
 __attribute__((vec_type_hint(z)))
 __attribute__((reqd_work_group_size(WORKSIZE, 1, 1)))
@@ -62,6 +137,7 @@ void search(
     const uint c1_plus_k5, const uint b1_plus_k6,
     const uint state0, const uint state1, const uint state2, const uint state3,
     const uint state4, const uint state5, const uint state6, const uint state7,
+    const uint merkle, const uint ntime, const uint nbits, const uint target,
     volatile __global uint * output)
 {
 
@@ -1243,7 +1319,11 @@ void search(
     ZA[924] = (ZCh(ZA[922], ZA[920], ZA[918]) + ZA[923]) + ZR26(ZA[922]);
     
 #define FOUND (0x0F)
-#define SETFOUND(Xnonce) output[output[FOUND]++] = Xnonce
+#define SETFOUND(Xnonce) do { \
+	if (meets_target(state0, state1, state2, state3, state4, state5, state6, state7, \
+			 merkle, ntime, nbits, Xnonce, target)) \
+		output[output[FOUND]++] = Xnonce; \
+} while (0)
 
 #if defined(VECTORS4)
 	bool result = any(ZA[924] == 0x136032EDU);
@@ -39,6 +39,12 @@
 #define BITFORCE_SENDWORK_LEN (sizeof(BITFORCE_SENDWORK)-1)
 #define BITFORCE_WORKSTATUS "ZFX"
 #define BITFORCE_WORKSTATUS_LEN (sizeof(BITFORCE_WORKSTATUS)-1)
+#define BITFORCE_QUEUEWORK "ZNX"
+#define BITFORCE_QUEUEWORK_LEN (sizeof(BITFORCE_QUEUEWORK)-1)
+#define BITFORCE_QUEUERESULTS "ZOX"
+#define BITFORCE_QUEUERESULTS_LEN (sizeof(BITFORCE_QUEUERESULTS)-1)
+#define BITFORCE_QUEUEFLUSH "ZQX"
+#define BITFORCE_QUEUEFLUSH_LEN (sizeof(BITFORCE_QUEUEFLUSH)-1)
 
 #define BITFORCE_SLEEP_MS 500
 #define BITFORCE_TIMEOUT_S 7
@@ -53,9 +59,21 @@
 
 #define KNAME_WORK  "full work"
 #define KNAME_RANGE "nonce range"
+#define KNAME_QUEUE "queued work"
 
 #define BITFORCE_BUFSIZ (0x200)
 
+// Most jobs the firmware work queue holds
+#define BITFORCE_QUEUE_MAX 40
+// Keep the device queue topped up to this many jobs
+#define BITFORCE_QUEUE_TARGET 20
+// But don't bother sending fewer than this many at once
+#define BITFORCE_QUEUE_BATCH 10
+// Each queued job is a length byte, the midstate and the last 12 bytes of data
+#define BITFORCE_QUEUE_JOB_LEN (1 + 32 + 12)
+// A result line is "midstate,data,count" followed by up to 16 ",nonce"
+#define BITFORCE_QUEUE_BUFSIZ (BITFORCE_QUEUE_MAX * 0x100)
+
 // If initialisation fails the first time,
 // sleep this amount (ms) and try again
 #define REINIT_TIME_MS 1000
@@ -66,6 +84,18 @@ static const char *blank = "";
 
 struct device_drv bitforce_drv;
 
+// --bfl-queue state, kept in thr->cgpu_data
+struct bitforce_queue {
+	// Jobs the device has accepted, oldest first
+	struct work *queued[BITFORCE_QUEUE_MAX];
+	int nqueued;
+	// Work waiting to go out in the next batch
+	struct work *pending[BITFORCE_QUEUE_MAX];
+	int npending;
+	// The firmware has accepted a batch so does have a queue
+	bool supported;
+};
+
 static void bitforce_initialise(struct cgpu_info *bitforce, bool lock)
 {
 	int err;
@@ -503,7 +533,8 @@ static int64_t bitforce_get_result(struct thr_info *thr, struct work *work)
 	char buf[BITFORCE_BUFSIZ+1];
 	int amount;
 	char *pnoncebuf;
-	uint32_t nonce;
+	uint32_t nonce, nonces[BITFORCE_BUFSIZ / 9];
+	int found = 0;
 
 	while (1) {
 		if (unlikely(thr->work_restart))
@@ -514,6 +545,9 @@ static int64_t bitforce_get_result(struct thr_info *thr, struct work *work)
 		usb_ftdi_read_nl(bitforce, buf, sizeof(buf)-1, &amount, C_GETWORKSTATUS);
 		mutex_unlock(&bitforce->device_mutex);
 
+		if (unlikely(usb_nodev(bitforce)))
+			return -1;
+
 		gettimeofday(&now, NULL);
 		timersub(&now, &bitforce->work_start_tv, &elapsed);
 
@@ -600,18 +634,380 @@ static int64_t bitforce_get_result(struct thr_info *thr, struct work *work)
 				bitforce->kname = KNAME_WORK;
 		}
 			
-		submit_nonce(thr, work, nonce);
-		if (strncmp(&pnoncebuf[8], ",", 1))
+		nonces[found++] = nonce;
+		if (strncmp(&pnoncebuf[8], ",", 1) || found == ARRAY_SIZE(nonces))
 			break;
 		pnoncebuf += 9;
 	}
+	submit_nonces(thr, work, nonces, found);
 
 	return bitforce->nonces;
 }
 
+static void bitforce_queue_discard(struct cgpu_info *bitforce, struct bitforce_queue *q)
+{
+	int i;
+
+	for (i = 0; i < q->nqueued; i++)
+		free_work(q->queued[i]);
+	for (i = 0; i < q->npending; i++)
+		free_work(q->pending[i]);
+	q->nqueued = q->npending = 0;
+	bitforce->queued = 0;
+}
+
+/* Throw away everything queued here and on the device, since after a block
+ * change or a restart none of it is worth finishing */
+static bool bitforce_queue_flush(struct thr_info *thr)
+{
+	struct cgpu_info *bitforce = thr->cgpu;
+	struct bitforce_queue *q = thr->cgpu_data;
+	char buf[BITFORCE_BUFSIZ+1];
+	int err, amount;
+
+	bitforce_queue_discard(bitforce, q);
+
+	mutex_lock(&bitforce->device_mutex);
+	if ((err = usb_write(bitforce, BITFORCE_QUEUEFLUSH, BITFORCE_QUEUEFLUSH_LEN, &amount, C_REQUESTQUEUEFLUSH)) < 0 || amount != BITFORCE_QUEUEFLUSH_LEN) {
+		mutex_unlock(&bitforce->device_mutex);
+		applog(LOG_ERR, "%s%i: request queue flush failed (%d:%d)",
+				bitforce->drv->name, bitforce->device_id, amount, err);
+		return false;
+	}
+
+	if ((err = usb_ftdi_read_nl(bitforce, buf, sizeof(buf)-1, &amount, C_QUEUEFLUSHSTATUS)) < 0 || amount < 1) {
+		mutex_unlock(&bitforce->device_mutex);
+		applog(LOG_ERR, "%s%i: read queue flush status failed (%d:%d)",
+				bitforce->drv->name, bitforce->device_id, amount, err);
+		return false;
+	}
+	mutex_unlock(&bitforce->device_mutex);
+	buf[amount] = '\0';
+
+	if (unlikely(strncasecmp(buf, "OK", 2))) {
+		applog(LOG_ERR, "%s%i: Error: Queue flush reports: %s",
+				bitforce->drv->name, bitforce->device_id, buf);
+		return false;
+	}
+
+	return true;
+}
+
+/* Send as much pending work as the device has room for in one batch.
+ * If the first batch is refused the firmware has no queue, so the thread
+ * drops back to sending one job at a time */
+static bool bitforce_queue_send(struct thr_info *thr)
+{
+	struct cgpu_info *bitforce = thr->cgpu;
+	struct bitforce_queue *q = thr->cgpu_data;
+	unsigned char ob[1 + BITFORCE_QUEUE_MAX * BITFORCE_QUEUE_JOB_LEN + 8];
+	unsigned char *p;
+	char buf[BITFORCE_BUFSIZ+1];
+	int err, amount, len;
+	int i, n, accepted;
+
+	n = q->npending;
+	if (n > BITFORCE_QUEUE_MAX - q->nqueued)
+		n = BITFORCE_QUEUE_MAX - q->nqueued;
+	if (n < 1)
+		return true;
+
+	mutex_lock(&bitforce->device_mutex);
+	if ((err = usb_write(bitforce, BITFORCE_QUEUEWORK, BITFORCE_QUEUEWORK_LEN, &amount, C_REQUESTQUEUEWORK)) < 0 || amount != BITFORCE_QUEUEWORK_LEN) {
+		mutex_unlock(&bitforce->device_mutex);
+		applog(LOG_ERR, "%s%i: request queue work failed (%d:%d)",
+				bitforce->drv->name, bitforce->device_id, amount, err);
+		return false;
+	}
+
+	if ((err = usb_ftdi_read_nl(bitforce, buf, sizeof(buf)-1, &amount, C_REQUESTQUEUEWORKSTATUS)) < 0) {
+		mutex_unlock(&bitforce->device_mutex);
+		applog(LOG_ERR, "%s%i: read request queue work status failed (%d:%d)",
+				bitforce->drv->name, bitforce->device_id, amount, err);
+		return false;
+	}
+	buf[amount] = '\0';
+
+	// Busy, leave the work pending until the next drain
+	if (amount == 0 || !buf[0] || !strncasecmp(buf, "B", 1)) {
+		mutex_unlock(&bitforce->device_mutex);
+		return true;
+	} else if (unlikely(strncasecmp(buf, "OK", 2))) {
+		mutex_unlock(&bitforce->device_mutex);
+		if (!q->supported) {
+			applog(LOG_WARNING, "%s%i: Does not support work queue, disabling",
+						bitforce->drv->name, bitforce->device_id);
+			bitforce_queue_discard(bitforce, q);
+			free(q);
+			thr->cgpu_data = NULL;
+			bitforce->sleep_ms = BITFORCE_SLEEP_MS * 5;
+			bitforce->kname = KNAME_WORK;
+			return true;
+		}
+		applog(LOG_ERR, "%s%i: Error: Queue work reports: %s",
+				bitforce->drv->name, bitforce->device_id, buf);
+		return false;
+	}
+
+	p = ob;
+	*(p++) = n;
+	for (i = 0; i < n; i++) {
+		*(p++) = BITFORCE_QUEUE_JOB_LEN - 1;
+		memcpy(p, q->pending[i]->midstate, 32);
+		memcpy(p + 32, q->pending[i]->data + 64, 12);
+		p += 32 + 12;
+	}
+	memcpy(p, ">>>>>>>>", 8);
+	len = p + 8 - ob;
+
+	if ((err = usb_write(bitforce, (char *)ob, len, &amount, C_QUEUEWORK)) < 0 || amount != len) {
+		mutex_unlock(&bitforce->device_mutex);
+		applog(LOG_ERR, "%s%i: queue work failed (%d:%d)",
+				bitforce->drv->name, bitforce->device_id, amount, err);
+		return false;
+	}
+
+	if ((err = usb_ftdi_read_nl(bitforce, buf, sizeof(buf)-1, &amount, C_QUEUEWORKSTATUS)) < 0) {
+		mutex_unlock(&bitforce->device_mutex);
+		applog(LOG_ERR, "%s%i: read queue work status failed (%d:%d)",
+				bitforce->drv->name, bitforce->device_id, amount, err);
+		return false;
+	}
+
+	mutex_unlock(&bitforce->device_mutex);
+	buf[amount] = '\0';
+
+	if (amount == 0 || !buf[0]) {
+		applog(LOG_ERR, "%s%i: Error: Queue work returned empty string/timed out",
+				bitforce->drv->name, bitforce->device_id);
+		return false;
+	}
+
+	if (unlikely(strncasecmp(buf, "OK:QUEUED", 9))) {
+		applog(LOG_ERR, "%s%i: Error: Queue work reports: %s",
+				bitforce->drv->name, bitforce->device_id, buf);
+		return false;
+	}
+
+	// The device may have had room for fewer than we sent
+	accepted = atoi(buf + 9);
+	if (accepted < 0 || accepted > n)
+		accepted = n;
+
+	applog(LOG_DEBUG, "%s%i: queued %d of %d jobs, %d on device",
+			bitforce->drv->name, bitforce->device_id,
+			accepted, n, q->nqueued + accepted);
+
+	memcpy(&q->queued[q->nqueued], q->pending, accepted * sizeof(struct work *));
+	q->nqueued += accepted;
+	bitforce->queued = q->nqueued;
+	q->npending -= accepted;
+	memmove(q->pending, &q->pending[accepted], q->npending * sizeof(struct work *));
+	q->supported = true;
+
+	return true;
+}
+
+/* Collect every finished job in one go and submit their nonces, returning
+ * the hashes done or -1 on a comms error */
+static int64_t bitforce_queue_results(struct thr_info *thr)
+{
+	struct cgpu_info *bitforce = thr->cgpu;
+	struct bitforce_queue *q = thr->cgpu_data;
+	char buf[BITFORCE_QUEUE_BUFSIZ+1];
+	unsigned char midstate[32], tail[12];
+	uint32_t nonce, nonces[16];
+	unsigned int delay_time_ms;
+	int err, amount, len, lines, count, want;
+	int i, j, done, found;
+	int64_t hashes = 0;
+	char *line, *next, *s;
+
+	mutex_lock(&bitforce->device_mutex);
+	if ((err = usb_write(bitforce, BITFORCE_QUEUERESULTS, BITFORCE_QUEUERESULTS_LEN, &amount, C_REQUESTQUEUERESULTS)) < 0 || amount != BITFORCE_QUEUERESULTS_LEN) {
+		mutex_unlock(&bitforce->device_mutex);
+		applog(LOG_ERR, "%s%i: request queue results failed (%d:%d)",
+				bitforce->drv->name, bitforce->device_id, amount, err);
+		return -1;
+	}
+
+	/* The reply is "COUNT:n", n result lines then "OK", which may arrive
+	 * in any number of reads */
+	len = lines = 0;
+	want = 1;
+	while (lines < want && len < (int)sizeof(buf)-1) {
+		err = usb_ftdi_read_nl(bitforce, buf + len, sizeof(buf)-1 - len, &amount, C_GETQUEUERESULTS);
+		if (err < 0 || amount < 1)
+			break;
+		for (i = len; i < len + amount; i++)
+			if (buf[i] == '\n')
+				lines++;
+		len += amount;
+		buf[len] = '\0';
+		if (want == 1 && lines > 0) {
+			if (strncasecmp(buf, "COUNT:", 6))
+				break;
+			want = atoi(buf + 6) + 2;
+		}
+	}
+	mutex_unlock(&bitforce->device_mutex);
+	buf[len] = '\0';
+
+	if (len == 0 || strncasecmp(buf, "COUNT:", 6) || lines < want) {
+		applog(LOG_ERR, "%s%i: Error: Queue results reports: %.40s",
+				bitforce->drv->name, bitforce->device_id, buf);
+		return -1;
+	}
+
+	count = want - 2;
+	line = strchr(buf, '\n') + 1;
+	for (done = 0; done < count; done++, line = next) {
+		next = strchr(line, '\n') + 1;
+
+		if (next - line < 64 + 1 + 24 + 2 || line[64] != ',' || line[64 + 1 + 24] != ',') {
+			applog(LOG_WARNING, "%s%i: Error: Garbled queue result: %.40s",
+					bitforce->drv->name, bitforce->device_id, line);
+			bitforce->hw_errors++;
+			continue;
+		}
+		line[64] = line[64 + 1 + 24] = '\0';
+		if (!hex2bin(midstate, line, 32) || !hex2bin(tail, line + 64 + 1, 12)) {
+			applog(LOG_WARNING, "%s%i: Error: Garbled queue result: %.40s",
+					bitforce->drv->name, bitforce->device_id, line);
+			bitforce->hw_errors++;
+			continue;
+		}
+
+		for (j = 0; j < q->nqueued; j++)
+			if (!memcmp(q->queued[j]->midstate, midstate, 32) &&
+			    !memcmp(q->queued[j]->data + 64, tail, 12))
+				break;
+		if (j == q->nqueued) {
+			// Most likely queued before the last flush
+			applog(LOG_DEBUG, "%s%i: Ignoring result for unknown job",
+					bitforce->drv->name, bitforce->device_id);
+			continue;
+		}
+
+		found = 0;
+		s = strchr(line + 64 + 1 + 24 + 1, ',');
+		while (s && s < next && found < (int)ARRAY_SIZE(nonces)) {
+			hex2bin((void*)&nonce, s + 1, 4);
+#ifndef __BIG_ENDIAN__
+			nonce = swab32(nonce);
+#endif
+			nonces[found++] = nonce;
+			s = strchr(s + 1, ',');
+		}
+		submit_nonces(thr, q->queued[j], nonces, found);
+
+		free_work(q->queued[j]);
+		q->nqueued--;
+		bitforce->queued = q->nqueued;
+		memmove(&q->queued[j], &q->queued[j + 1], (q->nqueued - j) * sizeof(struct work *));
+		hashes += 0xffffffff;
+	}
+
+	/* Aim to collect half a batch each time, which is often enough that
+	 * the device queue never runs dry without wasting polls on it */
+	delay_time_ms = bitforce->sleep_ms;
+	if (!count)
+		bitforce->sleep_ms += bitforce->sleep_ms / 2;
+	else
+		bitforce->sleep_ms = bitforce->sleep_ms * (BITFORCE_QUEUE_BATCH / 2) / count;
+	if (bitforce->sleep_ms < WORK_CHECK_INTERVAL_MS)
+		bitforce->sleep_ms = WORK_CHECK_INTERVAL_MS;
+	else if (bitforce->sleep_ms > BITFORCE_LONG_TIMEOUT_MS)
+		bitforce->sleep_ms = BITFORCE_LONG_TIMEOUT_MS;
+
+	if (delay_time_ms != bitforce->sleep_ms)
+		applog(LOG_DEBUG, "%s%i: Wait time changed to: %d, collected %d",
+				bitforce->drv->name, bitforce->device_id,
+				bitforce->sleep_ms, count);
+
+	return hashes;
+}
+
+/* The device is gone, so let the miner thread disable it and end. It stays
+ * listed and --usb-hotplug can start it again if it comes back */
+static int64_t bitforce_unplugged(struct cgpu_info *bitforce)
+{
+	applog(LOG_ERR, "%s%i: Unplugged", bitforce->drv->name, bitforce->device_id);
+	dev_error(bitforce, REASON_DEV_COMMS_ERROR);
+	usb_nodev_release(bitforce);
+	return -1;
+}
+
+static int64_t bitforce_queue_scanhash(struct thr_info *thr, struct work *work)
+{
+	struct cgpu_info *bitforce = thr->cgpu;
+	struct bitforce_queue *q = thr->cgpu_data;
+	struct work *oldest;
+	int64_t hashes;
+
+	oldest = q->nqueued ? q->queued[0] : (q->npending ? q->pending[0] : NULL);
+	if (oldest && oldest->work_block != work->work_block && !bitforce_queue_flush(thr))
+		goto commserr;
+
+	// Only possible while the device keeps reporting busy
+	if (unlikely(q->npending == BITFORCE_QUEUE_MAX)) {
+		free_work(q->pending[0]);
+		memmove(q->pending, &q->pending[1], --q->npending * sizeof(struct work *));
+	}
+	q->pending[q->npending++] = copy_work(work);
+	work->blk.nonce = 0xffffffff;
+
+	// Once the device has a batch to get on with, only top it up in bulk
+	if (q->nqueued >= BITFORCE_QUEUE_BATCH && q->nqueued + q->npending < BITFORCE_QUEUE_TARGET)
+		return 0;
+
+	if (!bitforce_queue_send(thr))
+		goto commserr;
+	if (unlikely(!thr->cgpu_data))
+		return 0;
+
+	if (q->nqueued < BITFORCE_QUEUE_TARGET && !q->npending)
+		return 0;
+
+	if (!restart_wait(bitforce->sleep_ms)) {
+		if (!bitforce_queue_flush(thr))
+			goto commserr;
+		return 0;
+	}
+	bitforce->wait_ms = bitforce->sleep_ms;
+
+	bitforce->polling = true;
+	hashes = bitforce_queue_results(thr);
+	bitforce->polling = false;
+	if (hashes < 0)
+		goto commserr;
+
+	return hashes;
+
+commserr:
+	if (usb_nodev(bitforce))
+		return bitforce_unplugged(bitforce);
+
+	applog(LOG_ERR, "%s%i: Comms error", bitforce->drv->name, bitforce->device_id);
+	dev_error(bitforce, REASON_DEV_COMMS_ERROR);
+	bitforce->hw_errors++;
+	bitforce_initialise(bitforce, true);
+	/* Whatever state the device queue is in now, its results can't be
+	 * matched reliably so start it again */
+	bitforce_queue_flush(thr);
+	return 0;
+}
+
 static void bitforce_shutdown(__maybe_unused struct thr_info *thr)
 {
-//	struct cgpu_info *bitforce = thr->cgpu;
+	struct cgpu_info *bitforce = thr->cgpu;
+	struct bitforce_queue *q = thr->cgpu_data;
+
+	if (q) {
+		bitforce_queue_discard(bitforce, q);
+		free(q);
+		thr->cgpu_data = NULL;
+	}
 }
 
 static void biforce_thread_enable(struct thr_info *thr)
@@ -619,6 +1015,8 @@ static void biforce_thread_enable(struct thr_info *thr)
 	struct cgpu_info *bitforce = thr->cgpu;
 
 	bitforce_initialise(bitforce, true);
+	if (thr->cgpu_data)
+		bitforce_queue_flush(thr);
 }
 
 static int64_t bitforce_scanhash(struct thr_info *thr, struct work *work, int64_t __maybe_unused max_nonce)
@@ -627,6 +1025,13 @@ static int64_t bitforce_scanhash(struct thr_info *thr, struct work *work, int64_
 	bool send_ret;
 	int64_t ret;
 
+	if (thr->cgpu_data) {
+		ret = bitforce_queue_scanhash(thr, work);
+		// Unless it found there's no queue, and this work still needs doing
+		if (thr->cgpu_data)
+			return ret;
+	}
+
 	send_ret = bitforce_send_work(thr, work);
 
 	if (!restart_wait(bitforce->sleep_ms))
@@ -642,6 +1047,9 @@ static int64_t bitforce_scanhash(struct thr_info *thr, struct work *work, int64_
 		ret = -1;
 
 	if (ret == -1) {
+		if (usb_nodev(bitforce))
+			return bitforce_unplugged(bitforce);
+
 		ret = 0;
 		applog(LOG_ERR, "%s%i: Comms error", bitforce->drv->name, bitforce->device_id);
 		dev_error(bitforce, REASON_DEV_COMMS_ERROR);
@@ -654,6 +1062,9 @@ static int64_t bitforce_scanhash(struct thr_info *thr, struct work *work, int64_
 
 static bool bitforce_get_stats(struct cgpu_info *bitforce)
 {
+	if (usb_nodev(bitforce))
+		return false;
+
 	return bitforce_get_temp(bitforce);
 }
 
@@ -674,6 +1085,14 @@ static bool bitforce_thread_init(struct thr_info *thr)
 			bitforce->drv->name, bitforce->device_id, wait / 1000);
 	nmsleep(wait);
 
+	if (opt_bfl_queue) {
+		thr->cgpu_data = calloc(1, sizeof(struct bitforce_queue));
+		// Queued work is always full work
+		bitforce->nonce_range = false;
+		bitforce->sleep_ms = BITFORCE_SLEEP_MS;
+		bitforce->kname = KNAME_QUEUE;
+	}
+
 	return true;
 }
 
@@ -687,6 +1106,8 @@ static struct api_data *bitforce_api_stats(struct cgpu_info *cgpu)
 	// If locking becomes an issue for any of them, use copy_data=true also
 	root = api_add_uint(root, "Sleep Time", &(cgpu->sleep_ms), false);
 	root = api_add_uint(root, "Avg Wait", &(cgpu->avg_wait_d), false);
+	if (opt_bfl_queue)
+		root = api_add_int(root, "Queued", &(cgpu->queued), false);
 
 	return root;
 }
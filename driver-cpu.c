@@ -28,19 +28,24 @@
 #include <sys/resource.h>
 #endif
 #include <libgen.h>
+#include <math.h>
 
 #include "compat.h"
 #include "miner.h"
 #include "bench_block.h"
 #include "driver-cpu.h"
+#include "sha2.h"
 
 #if defined(unix)
 	#include <errno.h>
 	#include <fcntl.h>
 #endif
 
-#if defined(__linux) && defined(cpu_set_t) /* Linux specific policy and affinity management */
+#if defined(__linux)
 #include <sched.h>
+#endif
+
+#if defined(__linux) && defined(CPU_SET) /* Linux specific policy and affinity management */
 static inline void drop_policy(void)
 {
 	struct sched_param param;
@@ -59,7 +64,7 @@ static inline void affine_to_cpu(int id, int cpu)
 
 	CPU_ZERO(&set);
 	CPU_SET(cpu, &set);
-	sched_setaffinity(0, sizeof(&set), &set);
+	sched_setaffinity(0, sizeof(set), &set);
 	applog(LOG_INFO, "Binding cpu mining thread %d to cpu %d", id, cpu);
 }
 #else
@@ -78,6 +83,8 @@ static inline void affine_to_cpu(int __maybe_unused id, int __maybe_unused cpu)
 extern void submit_work_async(const struct work *work_in, struct timeval *tv);
 extern char *set_int_range(const char *arg, int *i, int min, int max);
 extern int dev_from_id(int thr_id);
+extern struct work *get_work(struct thr_info *thr, const int thr_id);
+extern bool stale_work(struct work *work, bool share);
 
 
 /* chipset-optimized hash functions */
@@ -131,10 +138,6 @@ extern bool scanhash_sse2_32(struct thr_info*, const unsigned char *pmidstate, u
 	uint32_t max_nonce, uint32_t *last_nonce,
 	uint32_t nonce);
 
-extern bool scanhash_scrypt(struct thr_info *thr, int thr_id, unsigned char *pdata, unsigned char *scratchbuf,
-	const unsigned char *ptarget,
-	uint32_t max_nonce, unsigned long *hashes_done);
-
 
 
 #ifdef WANT_CPUMINE
@@ -210,6 +213,13 @@ enum sha256_algos opt_algo = ALGO_SSE2_32;
 enum sha256_algos opt_algo = ALGO_C;
 #endif
 bool opt_usecpu = false;
+int opt_bench_cpu;
+char *opt_bench_cpu_json;
+#ifdef WANT_SCRYPT
+bool opt_scrypt_hugepages;
+int opt_bench_scrypt;
+int opt_cpu_lookup_gap;
+#endif
 static int cpur_thr_id;
 static bool forced_n_threads;
 #endif
@@ -271,6 +281,90 @@ double bench_algo_stage3(
 	return rate;
 }
 
+#ifdef WANT_SCRYPT
+/* Scratchpad benchmark, compares scratchpad backings at 1 and N threads */
+#define SCRYPT_BENCH_HASHES 512
+
+struct scrypt_bench_thr {
+	pthread_t pth;
+	struct thr_info thr;
+	struct cpu_thread_data cpud;
+};
+
+static void *scrypt_bench_thread(void *userdata)
+{
+	static uint8_t bench_block[] = { CGMINER_BENCHMARK_BLOCK };
+	struct scrypt_bench_thr *sbt = userdata;
+	struct work work __attribute__((aligned(128)));
+	size_t work_size = sizeof(bench_block);
+	uint32_t last_nonce = 0;
+
+	memset(&work, 0, sizeof(work));
+	memcpy(&work, &bench_block, work_size < sizeof(work) ? work_size : sizeof(work));
+	/* Unreachable target so every nonce in the range is hashed */
+	memset(work.target, 0, sizeof(work.target));
+
+	scanhash_scrypt(&sbt->thr, work.midstate, work.data, NULL, work.hash,
+			work.target, SCRYPT_BENCH_HASHES, &last_nonce, 0);
+	return NULL;
+}
+
+static double scrypt_bench_run(int threads, bool hugepages, const char **backing)
+{
+	struct timeval tv_start, tv_end;
+	struct scrypt_bench_thr *sbt;
+	int i;
+
+	sbt = calloc(threads, sizeof(*sbt));
+	if (unlikely(!sbt))
+		quit(1, "Failed to calloc in scrypt_bench_run");
+	for (i = 0; i < threads; i++) {
+		sbt[i].thr.id = i;
+		sbt[i].thr.cgpu_data = &sbt[i].cpud;
+		if (unlikely(!scrypt_alloc_scratchpad(&sbt[i].cpud.scratch, hugepages)))
+			quit(1, "Failed to alloc scrypt scratchpad in scrypt_bench_run");
+	}
+	*backing = sbt[0].cpud.scratch.backing;
+
+	gettimeofday(&tv_start, NULL);
+	for (i = 0; i < threads; i++) {
+		if (unlikely(pthread_create(&sbt[i].pth, NULL, scrypt_bench_thread, &sbt[i])))
+			quit(1, "Failed to create scrypt bench thread");
+	}
+	for (i = 0; i < threads; i++)
+		pthread_join(sbt[i].pth, NULL);
+	gettimeofday(&tv_end, NULL);
+
+	for (i = 0; i < threads; i++)
+		scrypt_free_scratchpad(&sbt[i].cpud.scratch);
+	free(sbt);
+
+	return (double)SCRYPT_BENCH_HASHES * threads / tdiff(&tv_end, &tv_start);
+}
+
+void bench_scrypt_scratchpads(int threads)
+{
+	int counts[2] = { 1, threads };
+	int i, j;
+
+	applog(LOG_ERR, "benchmarking scrypt scratchpads, %d hashes per thread ...",
+	       SCRYPT_BENCH_HASHES);
+	for (i = 0; i < 2; i++) {
+		if (i && counts[i] == counts[0])
+			break;
+		for (j = 0; j < 2; j++) {
+			const char *backing;
+			double rate;
+
+			rate = scrypt_bench_run(counts[i], j, &backing);
+			applog(LOG_ERR, "%2d thread%s, %-7s scratchpads: %9.2f H/s (%.2f H/s per thread)",
+			       counts[i], counts[i] > 1 ? "s" : " ", backing,
+			       rate, rate / counts[i]);
+		}
+	}
+}
+#endif
+
 #if defined(unix)
 
 	// Change non-blocking status on a file descriptor
@@ -328,7 +422,9 @@ static double bench_algo_stage2(
 			exit(1);
 		}
 
-		// Fork a child to do the actual benchmarking
+		// Fork a child to do the actual benchmarking, with nothing
+		// left buffered for it to write out a second time
+		fflush(stdout);
 		pid_t child_pid = fork();
 		if (child_pid<0) {
 			perror("fork - failed to create a child process for --algo auto");
@@ -669,6 +765,273 @@ static enum sha256_algos pick_fastest_algo()
 	return best_algo;
 }
 
+/* CPU benchmark suite: every usable algorithm at 1..N threads, repeated
+ * to get the variance, with the results written out as JSON */
+#define BENCH_CPU_RUNS		3
+#define BENCH_CPU_NONCES	(1 << 20)
+#define BENCH_CPU_SCRYPT_HASHES	256
+
+struct cpu_bench_thr {
+	pthread_t pth;
+	struct thr_info thr;
+	struct cpu_thread_data cpud;
+	enum sha256_algos algo;
+	uint32_t first_nonce;
+	uint32_t hashes;
+};
+
+static void *cpu_bench_thread(void *userdata)
+{
+	static uint8_t bench_block[] = { CGMINER_BENCHMARK_BLOCK };
+	struct cpu_bench_thr *cbt = userdata;
+	struct work work __attribute__((aligned(128)));
+	size_t work_size = sizeof(bench_block);
+	unsigned char hash1[64];
+	uint32_t last_nonce = cbt->first_nonce;
+	uint32_t count = cbt->algo == ALGO_SCRYPT ? BENCH_CPU_SCRYPT_HASHES : BENCH_CPU_NONCES;
+
+	memset(&work, 0, sizeof(work));
+	memcpy(&work, &bench_block, work_size < sizeof(work) ? work_size : sizeof(work));
+	/* Unreachable target so every nonce in the range is hashed */
+	memset(work.target, 0, sizeof(work.target));
+	hex2bin(hash1, "00000000000000000000000000000000000000000000000000000000000000000000008000000000000000000000000000000000000000000000000000010000", 64);
+	if (cbt->algo != ALGO_SCRYPT)
+		sha256_precalc_init(&cbt->cpud.precalc, work.midstate, work.data);
+
+	sha256_funcs[cbt->algo](&cbt->thr, work.midstate, work.data, hash1,
+				work.hash, work.target, cbt->first_nonce + count,
+				&last_nonce, cbt->first_nonce);
+	cbt->hashes = last_nonce - cbt->first_nonce;
+	return NULL;
+}
+
+/* Hashes per second of one run of algo on threads threads */
+static double cpu_bench_run(enum sha256_algos algo, int threads)
+{
+	struct timeval tv_start, tv_end;
+	struct cpu_bench_thr *cbt;
+	double hashes = 0;
+	int i;
+
+	cbt = calloc(threads, sizeof(*cbt));
+	if (unlikely(!cbt))
+		quit(1, "Failed to calloc in cpu_bench_run");
+	for (i = 0; i < threads; i++) {
+		cbt[i].thr.id = i;
+		cbt[i].thr.cgpu_data = &cbt[i].cpud;
+		cbt[i].algo = algo;
+		/* Each thread on its own part of the nonce range */
+		cbt[i].first_nonce = i * BENCH_CPU_NONCES;
+#ifdef WANT_SCRYPT
+		if (algo == ALGO_SCRYPT &&
+		    unlikely(!scrypt_alloc_scratchpad(&cbt[i].cpud.scratch, opt_scrypt_hugepages)))
+			quit(1, "Failed to alloc scrypt scratchpad in cpu_bench_run");
+#endif
+	}
+
+	gettimeofday(&tv_start, NULL);
+	for (i = 0; i < threads; i++) {
+		if (unlikely(pthread_create(&cbt[i].pth, NULL, cpu_bench_thread, &cbt[i])))
+			quit(1, "Failed to create cpu bench thread");
+	}
+	for (i = 0; i < threads; i++) {
+		pthread_join(cbt[i].pth, NULL);
+		hashes += cbt[i].hashes;
+	}
+	gettimeofday(&tv_end, NULL);
+
+#ifdef WANT_SCRYPT
+	if (algo == ALGO_SCRYPT) {
+		for (i = 0; i < threads; i++)
+			scrypt_free_scratchpad(&cbt[i].cpud.scratch);
+	}
+#endif
+	free(cbt);
+
+	return hashes / tdiff(&tv_end, &tv_start);
+}
+
+/* Check algo finds a known solution and that fulltest agrees with it. For
+ * sha256 that is the genesis block, scanned from just below its nonce. */
+static bool cpu_bench_validate(enum sha256_algos algo)
+{
+	static const char genesis[] = "01000000000000000000000000000000000000000000000000000000"
+		"00000000000000003ba3edfd7a7b12b27ac72c3e67768f617fc81bc3888a51323a9fb8aa"
+		"4b1e5e4a29ab5f49ffff001d1dac2b7c";
+	struct work work __attribute__((aligned(128)));
+	unsigned char header[80], hash1[64], hash[32];
+	uint32_t *data32 = (uint32_t *)work.data;
+	uint32_t *target32 = (uint32_t *)work.target;
+	struct thr_info dummy = {0};
+	uint32_t nonce, last_nonce;
+	sha2_context ctx;
+	int i;
+
+	memset(&work, 0, sizeof(work));
+	hex2bin(hash1, "00000000000000000000000000000000000000000000000000000000000000000000008000000000000000000000000000000000000000000000000000010000", 64);
+#ifdef WANT_SCRYPT
+	if (algo == ALGO_SCRYPT) {
+		static uint8_t bench_block[] = { CGMINER_BENCHMARK_BLOCK };
+		size_t work_size = sizeof(bench_block);
+
+		memcpy(&work, &bench_block, work_size < sizeof(work) ? work_size : sizeof(work));
+		/* About one in 256 hashes meets this */
+		memset(work.target, 0, sizeof(work.target));
+		target32[7] = 0x00ffffff;
+		if (!scanhash_scrypt(&dummy, work.midstate, work.data, hash1, work.hash,
+				     work.target, 0x10000, &last_nonce, 0))
+			return false;
+		/* scrypt_test takes the nonce as it is stored in the header */
+		return scrypt_test(work.data, work.target, htobe32(last_nonce));
+	}
+#endif
+	hex2bin(header, genesis, 80);
+	flip80(work.data, header);
+	data32[20] = 0x80000000;
+	data32[31] = 0x280;
+	sha2_starts(&ctx);
+	sha2_update(&ctx, header, 64);
+	for (i = 0; i < 8; i++)
+		((uint32_t *)work.midstate)[i] = ctx.state[i];
+	/* Difficulty 1 */
+	target32[6] = 0xffff0000;
+
+	nonce = data32[19];
+	if (!sha256_funcs[algo](&dummy, work.midstate, work.data, hash1, work.hash,
+				work.target, nonce + 0x1000, &last_nonce, nonce - 0x10000))
+		return false;
+	if (last_nonce != nonce)
+		return false;
+
+	/* Rehash independently rather than trusting the backend's hash */
+	data32[19] = last_nonce;
+	flip80(header, work.data);
+	sha2(header, 80, hash1);
+	sha2(hash1, 32, hash);
+	flip32(work.hash, hash);
+	return fulltest(work.hash, work.target);
+}
+
+static json_t *cpu_bench_algo(enum sha256_algos algo, int max_threads)
+{
+	json_t *res, *results;
+	double base = 0;
+	int threads, run;
+
+	res = json_object();
+	json_object_set_new(res, "algo", json_string(algo_names[algo]));
+
+	/* The fork-safe single thread run catches algorithms that crash here */
+	if (algo != ALGO_SCRYPT && bench_algo_stage2(algo) < 0) {
+		applog(LOG_ERR, "\"%s\" : algorithm fails on this platform", algo_names[algo]);
+		json_object_set_new(res, "error", json_string("fails on this platform"));
+		return res;
+	}
+	if (!cpu_bench_validate(algo)) {
+		applog(LOG_ERR, "\"%s\" : algorithm does not find a valid nonce", algo_names[algo]);
+		json_object_set_new(res, "valid", json_false());
+		return res;
+	}
+	json_object_set_new(res, "valid", json_true());
+
+	results = json_array();
+	for (threads = 1; threads <= max_threads; threads++) {
+		double rate[BENCH_CPU_RUNS], mean = 0, var = 0, min, max, eff;
+		json_t *r;
+
+		for (run = 0; run < BENCH_CPU_RUNS; run++) {
+			rate[run] = cpu_bench_run(algo, threads);
+			mean += rate[run];
+		}
+		mean /= BENCH_CPU_RUNS;
+		min = max = rate[0];
+		for (run = 0; run < BENCH_CPU_RUNS; run++) {
+			var += (rate[run] - mean) * (rate[run] - mean);
+			if (rate[run] < min)
+				min = rate[run];
+			if (rate[run] > max)
+				max = rate[run];
+		}
+		var /= BENCH_CPU_RUNS - 1;
+		if (threads == 1)
+			base = mean;
+		eff = base > 0 ? mean / (base * threads) : 0;
+
+		applog(LOG_ERR, "\"%s\" %2d thread%s: %12.0f H/s +/- %.1f%%, %.0f H/s per thread, %3.0f%% scaling",
+		       algo_names[algo], threads, threads > 1 ? "s" : " ", mean,
+		       mean > 0 ? sqrt(var) * 100 / mean : 0, mean / threads, eff * 100);
+
+		r = json_object();
+		json_object_set_new(r, "threads", json_integer(threads));
+		json_object_set_new(r, "hashrate", json_real(mean));
+		json_object_set_new(r, "hashrate_min", json_real(min));
+		json_object_set_new(r, "hashrate_max", json_real(max));
+		json_object_set_new(r, "stddev", json_real(sqrt(var)));
+		json_object_set_new(r, "per_thread", json_real(mean / threads));
+		json_object_set_new(r, "efficiency", json_real(eff));
+		json_array_append_new(results, r);
+	}
+	json_object_set_new(res, "results", results);
+	return res;
+}
+
+static FILE *bench_cpu_json_stdout;
+
+/* For --bench-cpu-json - keep stdout for the JSON alone, and send everything
+ * else written there to stderr. Called before anything is logged. */
+void bench_cpu_stdout(void)
+{
+	int fd;
+
+	fflush(stdout);
+	fd = dup(STDOUT_FILENO);
+	if (fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0 ||
+	    !(bench_cpu_json_stdout = fdopen(fd, "w")))
+		quit(1, "Failed to keep stdout for the benchmark results");
+}
+
+void bench_cpu(int max_threads)
+{
+	json_t *root, *algos;
+	enum sha256_algos i;
+	FILE *f = NULL;
+	char *out;
+
+	if (bench_cpu_json_stdout)
+		f = bench_cpu_json_stdout;
+	else if (opt_bench_cpu_json) {
+		f = fopen(opt_bench_cpu_json, "w");
+		if (!f)
+			quit(1, "Failed to open %s for the benchmark results", opt_bench_cpu_json);
+	}
+
+	init_max_name_len();
+	root = json_object();
+	json_object_set_new(root, "version", json_string(VERSION));
+	json_object_set_new(root, "cpus", json_integer(sysconf(_SC_NPROCESSORS_ONLN)));
+	json_object_set_new(root, "runs", json_integer(BENCH_CPU_RUNS));
+	json_object_set_new(root, "hashes_per_thread",
+			    json_integer(opt_scrypt ? BENCH_CPU_SCRYPT_HASHES : BENCH_CPU_NONCES));
+	algos = json_array();
+
+	applog(LOG_ERR, "benchmarking CPU algorithms at 1 to %d threads, %d runs each ...",
+	       max_threads, BENCH_CPU_RUNS);
+	for (i = 0; i < ARRAY_SIZE(sha256_funcs); i++) {
+		if (!sha256_funcs[i] || (i == ALGO_SCRYPT) != opt_scrypt)
+			continue;
+		json_array_append_new(algos, cpu_bench_algo(i, max_threads));
+	}
+	json_object_set_new(root, "algorithms", algos);
+
+	if (f) {
+		out = json_dumps(root, JSON_INDENT(2) | JSON_PRESERVE_ORDER);
+		fprintf(f, "%s\n", out);
+		fclose(f);
+		free(out);
+	}
+	json_decref(root);
+}
+
 /* FIXME: Use asprintf for better errors. */
 char *set_algo(const char *arg, enum sha256_algos *algo)
 {
@@ -712,7 +1075,276 @@ char *force_nthreads_int(const char *arg, int *i)
 }
 #endif
 
+#ifdef WANT_SCRYPT
+#define CPU_MAX_LOOKUP_GAP 4
+
+char *set_cpu_lookup_gap(const char *arg, int *i)
+{
+	if (!strcmp(arg, "auto")) {
+		*i = 0;
+		return NULL;
+	}
+	return set_int_range(arg, i, 1, CPU_MAX_LOOKUP_GAP);
+}
+#endif
+
 #ifdef WANT_CPUMINE
+char *opt_cpu_sysfs = "/sys/devices/system/cpu";
+
+#if defined(__linux)
+static bool read_sysfs_str(const char *path, char *buf, size_t len)
+{
+	FILE *f;
+	bool ret;
+
+	f = fopen(path, "r");
+	if (!f)
+		return false;
+	ret = (fgets(buf, len, f) != NULL);
+	fclose(f);
+	if (ret)
+		buf[strcspn(buf, "\n")] = '\0';
+	return ret;
+}
+
+/* Expand a sysfs cpu list such as "0-3,8-11" into cpus (if not NULL) and
+ * return how many cpus it holds */
+static int cpu_list_parse(const char *list, int *cpus, int max)
+{
+	int count = 0, first, last;
+	const char *p = list;
+
+	while (*p) {
+		if (sscanf(p, "%d-%d", &first, &last) != 2) {
+			if (sscanf(p, "%d", &first) != 1)
+				break;
+			last = first;
+		}
+		for (; first <= last; first++, count++)
+			if (cpus && count < max)
+				cpus[count] = first;
+		p = strchr(p, ',');
+		if (!p)
+			break;
+		p++;
+	}
+	return count;
+}
+
+static int cpu_list_count(const char *list)
+{
+	return cpu_list_parse(list, NULL, 0);
+}
+
+static int cpu_sysfs_int(int cpu, const char *file, int def)
+{
+	char path[PATH_MAX], buf[32];
+
+	snprintf(path, sizeof(path), "%s/cpu%d/%s", opt_cpu_sysfs, cpu, file);
+	if (!read_sysfs_str(path, buf, sizeof(buf)))
+		return def;
+	return atoi(buf);
+}
+#endif
+
+#ifdef WANT_SCRYPT
+/* Bytes of L2 cache per cpu, or 0 if it can't be found */
+static size_t cpu_l2_per_cpu(void)
+{
+#if defined(__linux)
+	char path[PATH_MAX], buf[64];
+	int idx;
+
+	for (idx = 0; idx < 8; idx++) {
+		unsigned long size;
+		char unit = 'B';
+		int sharers;
+
+		snprintf(path, sizeof(path), "%s/cpu0/cache/index%d/level", opt_cpu_sysfs, idx);
+		if (!read_sysfs_str(path, buf, sizeof(buf)))
+			break;
+		if (atoi(buf) != 2)
+			continue;
+		snprintf(path, sizeof(path), "%s/cpu0/cache/index%d/type", opt_cpu_sysfs, idx);
+		if (read_sysfs_str(path, buf, sizeof(buf)) && !strcmp(buf, "Instruction"))
+			continue;
+		snprintf(path, sizeof(path), "%s/cpu0/cache/index%d/size", opt_cpu_sysfs, idx);
+		if (!read_sysfs_str(path, buf, sizeof(buf)) || sscanf(buf, "%lu%c", &size, &unit) < 1)
+			continue;
+		if (unit == 'K')
+			size *= 1024;
+		else if (unit == 'M')
+			size *= 1024 * 1024;
+		snprintf(path, sizeof(path), "%s/cpu0/cache/index%d/shared_cpu_list", opt_cpu_sysfs, idx);
+		sharers = 1;
+		if (read_sysfs_str(path, buf, sizeof(buf)))
+			sharers = cpu_list_count(buf);
+		return size / (sharers > 0 ? sharers : 1);
+	}
+#endif
+#ifdef _SC_LEVEL2_CACHE_SIZE
+	{
+		long size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+
+		if (size > 0)
+			return size;
+	}
+#endif
+	return 0;
+}
+#endif
+
+/* Where each online cpu sits, kept in the order threads are placed on them */
+struct cpu_topology {
+	int cpu;
+	int package;
+	int core;
+	int node;		/* NUMA node, -1 if unknown */
+	int smt;		/* position among the core's SMT siblings */
+	unsigned long max_khz;	/* 0 if unknown */
+};
+
+#define CPU_MAX_NODES 64
+
+static struct cpu_topology *cpu_topo;
+static int cpu_topo_count;
+
+/* One thread per core before doubling up on SMT siblings, which share the
+ * L1/L2 the scrypt scratchpads want to themselves. Then the fastest cores,
+ * so big.LITTLE parts fill their big cores first, and then keep each
+ * node's and package's cpus together. */
+static int cpu_topo_cmp(const void *a, const void *b)
+{
+	const struct cpu_topology *x = a, *y = b;
+
+	if (x->smt != y->smt)
+		return x->smt - y->smt;
+	if (x->max_khz != y->max_khz)
+		return x->max_khz > y->max_khz ? -1 : 1;
+	if (x->node != y->node)
+		return x->node - y->node;
+	if (x->package != y->package)
+		return x->package - y->package;
+	if (x->core != y->core)
+		return x->core - y->core;
+	return x->cpu - y->cpu;
+}
+
+static void cpu_read_topology(void)
+{
+#if defined(__linux)
+	char path[PATH_MAX], buf[256];
+	int *online, *siblings;
+	int i, j, count, nodes = 0, cores = 0;
+
+	snprintf(path, sizeof(path), "%s/online", opt_cpu_sysfs);
+	if (!read_sysfs_str(path, buf, sizeof(buf)))
+		return;
+	count = cpu_list_count(buf);
+	if (count < 1)
+		return;
+	online = calloc(count, sizeof(int));
+	siblings = calloc(count, sizeof(int));
+	cpu_topo = calloc(count, sizeof(struct cpu_topology));
+	if (unlikely(!online || !siblings || !cpu_topo))
+		quit(1, "Failed to calloc in cpu_read_topology");
+	cpu_list_parse(buf, online, count);
+
+	for (i = 0; i < count; i++) {
+		struct cpu_topology *t = &cpu_topo[i];
+		int cpu = online[i];
+
+		t->cpu = cpu;
+		t->package = cpu_sysfs_int(cpu, "topology/physical_package_id", 0);
+		t->core = cpu_sysfs_int(cpu, "topology/core_id", cpu);
+		t->max_khz = cpu_sysfs_int(cpu, "cpufreq/cpuinfo_max_freq", 0);
+		t->node = -1;
+		for (j = 0; j < CPU_MAX_NODES; j++) {
+			snprintf(path, sizeof(path), "%s/cpu%d/node%d", opt_cpu_sysfs, cpu, j);
+			if (!access(path, F_OK)) {
+				t->node = j;
+				if (j + 1 > nodes)
+					nodes = j + 1;
+				break;
+			}
+		}
+		snprintf(path, sizeof(path), "%s/cpu%d/topology/thread_siblings_list",
+			 opt_cpu_sysfs, cpu);
+		if (read_sysfs_str(path, buf, sizeof(buf))) {
+			int n = cpu_list_parse(buf, siblings, count);
+
+			for (j = 0; j < n && j < count; j++)
+				if (siblings[j] == cpu)
+					t->smt = j;
+		}
+		if (!t->smt)
+			cores++;
+	}
+	free(siblings);
+	free(online);
+
+	qsort(cpu_topo, count, sizeof(struct cpu_topology), cpu_topo_cmp);
+	cpu_topo_count = count;
+	applog(LOG_INFO, "CPU topology: %d cpus, %d cores, %d NUMA nodes, %lu-%lu MHz",
+	       count, cores, nodes ? : 1, cpu_topo[count - 1].max_khz / 1000,
+	       cpu_topo[0].max_khz / 1000);
+	for (i = 0; i < count; i++)
+		applog(LOG_DEBUG, "CPU placement %d: cpu %d package %d core %d smt %d node %d %lu MHz",
+		       i, cpu_topo[i].cpu, cpu_topo[i].package, cpu_topo[i].core,
+		       cpu_topo[i].smt, cpu_topo[i].node, cpu_topo[i].max_khz / 1000);
+#endif
+}
+
+/* The cpu the nth mining thread should be bound to */
+static int cpu_place(int n, int *node)
+{
+	*node = -1;
+	if (!cpu_topo_count)
+		return n % num_processors;
+	n %= cpu_topo_count;
+	*node = cpu_topo[n].node;
+	return cpu_topo[n].cpu;
+}
+#endif
+
+#ifdef WANT_SCRYPT
+/* Pick the smallest lookup gap that lets every thread's V[] (128KB with no
+ * gap) fit in its share of L2. Recomputing skipped entries costs an extra
+ * (gap - 1) / 2 salsa rounds per lookup on average, so stop at
+ * CPU_MAX_LOOKUP_GAP where that outweighs the cache misses it saves. */
+static void cpu_auto_lookup_gap(void)
+{
+	size_t share = cpu_l2_per_cpu();
+	int gap = 1;
+
+	if (!share || opt_n_threads < 1) {
+		opt_cpu_lookup_gap = 1;
+		return;
+	}
+	if (opt_n_threads > num_processors)
+		share = share * num_processors / opt_n_threads;
+	while (gap < CPU_MAX_LOOKUP_GAP && (size_t)(131072 / gap) > share)
+		gap *= 2;
+	opt_cpu_lookup_gap = gap;
+	applog(LOG_INFO, "CPU scrypt lookup gap %d for %uKB L2 per thread",
+	       gap, (unsigned int)(share / 1024));
+}
+#endif
+
+#ifdef WANT_CPUMINE
+/* All CPU threads mine the same work item. Each thread hashes a copy of it
+ * and claims nonce ranges from a shared cursor, sized by miner_thread's
+ * max_nonce, so a thread that runs dry simply takes the next range left
+ * instead of fetching a work item of its own. */
+#define CPU_MIN_CHUNK 0x1000
+
+static struct {
+	pthread_mutex_t lock;
+	struct work *base;	/* work being shared, NULL if none */
+	uint64_t cursor;	/* next nonce of base nobody has claimed */
+	struct timeval tv_base;	/* when base was fetched */
+} cpu_share;
+
 static void cpu_detect()
 {
 	int i;
@@ -751,6 +1383,15 @@ static void cpu_detect()
 	if (num_processors < 1)
 		return;
 
+	cpu_read_topology();
+
+#ifdef WANT_SCRYPT
+	if (opt_scrypt && !opt_cpu_lookup_gap)
+		cpu_auto_lookup_gap();
+#endif
+
+	mutex_init(&cpu_share.lock);
+
 	cpus = calloc(opt_n_threads, sizeof(struct cgpu_info));
 	if (unlikely(!cpus))
 		quit(1, "Failed to calloc cpus");
@@ -783,19 +1424,167 @@ static uint64_t cpu_can_limit_work(struct thr_info __maybe_unused *thr)
 	return 0xffff;
 }
 
+static struct work *cpu_get_work(struct thr_info *thr)
+{
+	struct work *work;
+	struct timeval now;
+
+	/* Waiting on the lock is waiting for work as far as the watchdog
+	 * is concerned */
+	thread_reportout(thr);
+	mutex_lock(&cpu_share.lock);
+	while (42) {
+		gettimeofday(&now, NULL);
+		if (cpu_share.base && (cpu_share.cursor > 0xffffffffULL ||
+		    now.tv_sec - cpu_share.tv_base.tv_sec > opt_scantime ||
+		    stale_work(cpu_share.base, false))) {
+			free_work(cpu_share.base);
+			cpu_share.base = NULL;
+		}
+		if (cpu_share.base)
+			break;
+
+		/* get_work can block, and is where the thread is cancelled at
+		 * shutdown, so don't hold the other threads up while in it */
+		mutex_unlock(&cpu_share.lock);
+		work = get_work(thr, thr->id);
+		mutex_lock(&cpu_share.lock);
+
+		/* Another thread may have set new work meanwhile, so only use
+		 * this one if none has, then check again either way */
+		if (cpu_share.base)
+			free_work(work);
+		else {
+			cpu_share.base = work;
+			cpu_share.cursor = 0;
+			gettimeofday(&cpu_share.tv_base, NULL);
+		}
+	}
+	work = copy_work(cpu_share.base);
+	mutex_unlock(&cpu_share.lock);
+	thread_reportin(thr);
+
+	work->thr_id = thr->id;
+	return work;
+}
+
+/* Claim up to chunk nonces of the shared work that work is a copy of. The
+ * tail of the range is handed out in shrinking pieces so all threads finish
+ * it together rather than one thread scanning the last big chunk alone.
+ * Returns false once the range is used up or the work has been replaced. */
+static bool cpu_claim_nonces(struct work *work, uint32_t chunk, uint32_t *first, uint32_t *last)
+{
+	uint64_t left, guided;
+	bool ret = false;
+
+	mutex_lock(&cpu_share.lock);
+	if (!cpu_share.base || cpu_share.base->id != work->id)
+		goto out;
+	left = 0x100000000ULL - cpu_share.cursor;
+	if (!left)
+		goto out;
+	guided = left / (2 * (opt_n_threads ? : 1));
+	if (chunk > guided)
+		chunk = guided;
+	if (chunk < CPU_MIN_CHUNK)
+		chunk = CPU_MIN_CHUNK;
+	if (chunk > left)
+		chunk = left;
+	*first = cpu_share.cursor;
+	cpu_share.cursor += chunk;
+	*last = cpu_share.cursor - 1;
+	ret = true;
+out:
+	mutex_unlock(&cpu_share.lock);
+	return ret;
+}
+
 static bool cpu_thread_init(struct thr_info *thr)
 {
 	const int thr_id = thr->id;
+	struct cpu_thread_data *cpud;
+
+	cpud = calloc(1, sizeof(*cpud));
+	if (unlikely(!cpud)) {
+		applog(LOG_ERR, "Failed to calloc in cpu_thread_init");
+		return false;
+	}
+	cpud->cpu = -1;
+	cpud->node = -1;
+	thr->cgpu_data = cpud;
 
 	/* Set worker threads to nice 19 and then preferentially to SCHED_IDLE
 	 * and if that fails, then SCHED_BATCH. No need for this to be an
 	 * error if it fails */
 	setpriority(PRIO_PROCESS, 0, 19);
 	drop_policy();
-	/* Cpu affinity only makes sense if the number of threads is a multiple
-	 * of the number of CPUs */
-	if (!(opt_n_threads % num_processors))
-		affine_to_cpu(dev_from_id(thr_id), dev_from_id(thr_id) % num_processors);
+	/* Cpu affinity only makes sense if every thread can have a cpu of
+	 * its own or the number of threads is a multiple of the number of
+	 * CPUs */
+	if (opt_n_threads <= num_processors || !(opt_n_threads % num_processors)) {
+		cpud->cpu = cpu_place(dev_from_id(thr_id), &cpud->node);
+		affine_to_cpu(dev_from_id(thr_id), cpud->cpu);
+	}
+
+#ifdef WANT_SCRYPT
+	/* Allocated here, after binding, so the pages are first touched on
+	 * the cpu that will use them, and kept for the life of the thread */
+	if (opt_scrypt) {
+		struct scrypt_scratchpad *sp = &cpud->scratch;
+
+		if (unlikely(!scrypt_alloc_scratchpad(sp, opt_scrypt_hugepages))) {
+			applog(LOG_ERR, "Failed to allocate scrypt scratchpad for CPU %d",
+			       dev_from_id(thr_id));
+			free(cpud);
+			thr->cgpu_data = NULL;
+			return false;
+		}
+		/* Fault it in now so the default first touch policy puts it
+		 * on this cpu's NUMA node */
+		memset(sp->buf, 0, sp->size);
+		applog(LOG_DEBUG, "CPU %d: %uKB %s scrypt scratchpad at %p on node %d, "
+		       "%u KB pages, %u TLB entries to cover",
+		       dev_from_id(thr_id), (unsigned int)(sp->size / 1024),
+		       sp->backing, sp->buf, cpud->node, (unsigned int)(sp->pagesize / 1024),
+		       (unsigned int)((sp->size + sp->pagesize - 1) / sp->pagesize));
+	}
+#endif
+	return true;
+}
+
+static void cpu_thread_shutdown(struct thr_info *thr)
+{
+	struct cpu_thread_data *cpud = thr->cgpu_data;
+
+	if (!cpud)
+		return;
+#ifdef WANT_SCRYPT
+	scrypt_free_scratchpad(&cpud->scratch);
+#endif
+	free(cpud);
+	thr->cgpu_data = NULL;
+}
+
+/* Returns the thread's precalc if it was built for this midstate and block,
+ * otherwise builds one in tmp (the benchmark runs with no thread data) */
+const struct sha256_precalc *cpu_get_precalc(struct thr_info *thr,
+	struct sha256_precalc *tmp, const unsigned char *midstate, const unsigned char *data)
+{
+	struct cpu_thread_data *cpud = thr->cgpu_data;
+
+	if (likely(cpud && !memcmp(cpud->precalc.midstate, midstate, 32) &&
+		   !memcmp(cpud->precalc.W, data + 64, 12)))
+		return &cpud->precalc;
+	sha256_precalc_init(tmp, midstate, data);
+	return tmp;
+}
+
+static bool cpu_prepare_work(struct thr_info *thr, struct work *work)
+{
+	struct cpu_thread_data *cpud = thr->cgpu_data;
+
+	if (!opt_scrypt && cpud)
+		sha256_precalc_init(&cpud->precalc, work->midstate, work->data);
 	return true;
 }
 
@@ -803,10 +1592,19 @@ static int64_t cpu_scanhash(struct thr_info *thr, struct work *work, int64_t max
 {
 	const int thr_id = thr->id;
 	unsigned char hash1[64];
-	uint32_t first_nonce = work->blk.nonce;
+	uint32_t first_nonce, end_nonce;
 	uint32_t last_nonce;
 	bool rc;
 
+	/* miner_thread asks for max_nonce - blk.nonce more nonces */
+	if (!cpu_claim_nonces(work, (uint32_t)max_nonce - work->blk.nonce,
+			      &first_nonce, &end_nonce)) {
+		/* Have miner_thread abandon this work for the next one */
+		work->blk.nonce = 0xfffffffe;
+		return 0;
+	}
+	work->blk.nonce = first_nonce;
+
 	hex2bin(hash1, "00000000000000000000000000000000000000000000000000000000000000000000008000000000000000000000000000000000000000000000000000010000", 64);
 CPUSearch:
 	last_nonce = first_nonce;
@@ -822,7 +1620,7 @@ CPUSearch:
 			hash1,
 			work->hash,
 			work->target,
-			max_nonce,
+			end_nonce,
 			&last_nonce,
 			work->blk.nonce
 		);
@@ -851,7 +1649,10 @@ struct device_drv cpu_drv = {
 	.thread_prepare = cpu_thread_prepare,
 	.can_limit_work = cpu_can_limit_work,
 	.thread_init = cpu_thread_init,
+	.get_work = cpu_get_work,
+	.prepare_work = cpu_prepare_work,
 	.scanhash = cpu_scanhash,
+	.thread_shutdown = cpu_thread_shutdown,
 };
 #endif
 
@@ -38,6 +38,10 @@
 #define WANT_SCRYPT
 #endif
 
+#ifdef WANT_SCRYPT
+#include "scrypt.h"
+#endif
+
 enum sha256_algos {
 	ALGO_C,			/* plain C */
 	ALGO_4WAY,		/* parallel SSE2 */
@@ -51,15 +55,51 @@ enum sha256_algos {
 	ALGO_SCRYPT,		/* scrypt */
 };
 
+/* The nonce independent part of a work item's first sha256 block, built
+ * once per work by cpu_prepare_work and shared by the C backends */
+struct sha256_precalc {
+	uint32_t midstate[8];
+	uint32_t W[18];		/* block words plus W16/W17, W[3] is the nonce */
+	uint32_t W18;		/* W18 without s0(nonce) */
+	uint32_t W19;		/* W19 without the nonce */
+	uint32_t state[8];	/* working vars after rounds 0-2 */
+};
+
+/* Per mining thread state, hung off thr->cgpu_data */
+struct cpu_thread_data {
+	int cpu;		/* cpu the thread is bound to, -1 if unbound */
+	int node;		/* NUMA node of that cpu, -1 if unknown */
+	struct sha256_precalc precalc;
+#ifdef WANT_SCRYPT
+	struct scrypt_scratchpad scratch;
+#endif
+};
+
 extern const char *algo_names[];
 extern bool opt_usecpu;
+extern char *opt_cpu_sysfs;
+extern int opt_bench_cpu;
+extern char *opt_bench_cpu_json;
+#ifdef WANT_SCRYPT
+extern bool opt_scrypt_hugepages;
+extern int opt_bench_scrypt;
+extern int opt_cpu_lookup_gap;
+#endif
 extern struct device_drv cpu_drv;
 
 extern char *set_algo(const char *arg, enum sha256_algos *algo);
 extern void show_algo(char buf[OPT_SHOW_LEN], const enum sha256_algos *algo);
 extern char *force_nthreads_int(const char *arg, int *i);
+extern char *set_cpu_lookup_gap(const char *arg, int *i);
 extern void init_max_name_len();
 extern double bench_algo_stage3(enum sha256_algos algo);
+extern void bench_cpu_stdout(void);
+extern void bench_cpu(int max_threads);
 extern void set_scrypt_algo(enum sha256_algos *algo);
+extern void bench_scrypt_scratchpads(int threads);
+extern void sha256_precalc_init(struct sha256_precalc *pc, const unsigned char *midstate,
+				const unsigned char *data);
+extern const struct sha256_precalc *cpu_get_precalc(struct thr_info *thr,
+	struct sha256_precalc *tmp, const unsigned char *midstate, const unsigned char *data);
 
 #endif /* __DEVICE_CPU_H__ */
@@ -31,7 +31,9 @@
 
 #include "config.h"
 
+#include <errno.h>
 #include <limits.h>
+#include <math.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <sys/time.h>
@@ -41,6 +43,8 @@
 #ifndef WIN32
   #include <termios.h>
   #include <sys/stat.h>
+  #include <sys/resource.h>
+  #include <poll.h>
   #include <fcntl.h>
   #ifndef O_CLOEXEC
     #define O_CLOEXEC 0
@@ -53,6 +57,7 @@
 #include "elist.h"
 #include "miner.h"
 #include "fpgautils.h"
+#include "bench_block.h"
 
 // The serial I/O speed - Linux uses a define 'B115200' in bits/termios.h
 #define ICARUS_IO_SPEED 115200
@@ -167,6 +172,11 @@ struct ICARUS_INFO {
 
 	enum timing_mode timing_mode;
 	bool do_icarus_timing;
+	// The Hs loaded from ICARUS_TIMING_FILE, until it has been checked
+	// against a new data set
+	double loaded_Hs;
+	// The last estimate, waiting for the watchdog to save it
+	json_t *timing_state;
 
 	double fullnonce;
 	int count;
@@ -184,6 +194,20 @@ struct ICARUS_INFO {
 	int work_division;
 	int fpga_count;
 	uint32_t nonce_mask;
+
+	// --icarus-pipeline, the job running on the device and when it
+	// was sent, and the replies read but not yet used
+	struct work *pipe_work;
+	struct timeval pipe_start;
+	unsigned char rbuf[ICARUS_READ_SIZE * 4];
+	int rlen;
+
+#ifndef WIN32
+	// --icarus-events
+	struct serial_ev ev;
+	struct thr_info *thr;
+	struct timeval pipe_finish;
+#endif
 };
 
 #define END_CONDITION 0x0000ffff
@@ -193,20 +217,22 @@ static struct ICARUS_INFO **icarus_info;
 
 // Looking for options in --icarus-timing and --icarus-options:
 //
-// Code increments this each time we start to look at a device
-// However, this means that if other devices are checked by
-// the Icarus code (e.g. BFL) they will count in the option offset
+// serial_detect() tries the --scan-serial devices in parallel, so
+// each device takes the options for its place in the --scan-serial
+// list, i.e. option_offset + detect_index(), not the order in which
+// the tests happen to finish
 //
-// This, however, is deterministic so that's OK
+// That place counts every --scan-serial device tried by the Icarus
+// code, even one that turns out not to be an Icarus, so the option
+// order is deterministic
 //
-// If we were to increment after successfully finding an Icarus
-// that would be random since an Icarus may fail and thus we'd
-// not be able to predict the option order
+// Any --icarus-sim devices are detected first and take the first
+// options, then option_offset is set past them
 //
-// This also assumes that serial_detect() checks them sequentially
-// and in the order specified on the command line
+// Devices found outside detect_parallel() (e.g. by autoscan) have a
+// detect_index() of 0 and take the first option after those
 //
-static int option_offset = -1;
+static int option_offset;
 
 struct device_drv icarus_drv;
 
@@ -277,6 +303,56 @@ static int icarus_gets(unsigned char *buf, int fd, struct timeval *tv_finish, st
 	}
 }
 
+#ifndef WIN32
+// Wait for a whole nonce with poll() until the deadline, reading whatever
+// has arrived into info->rbuf. tv_finish is when the first byte arrived
+static int icarus_poll_gets(struct ICARUS_INFO *info, int fd, struct timeval *deadline, struct timeval *tv_finish, struct thr_info *thr)
+{
+	struct pollfd pfd;
+	struct timeval now, left;
+	ssize_t ret;
+	int ms;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+
+	while (info->rlen < ICARUS_READ_SIZE) {
+		if (thr && thr->work_restart)
+			return ICA_GETS_RESTART;
+
+		gettimeofday(&now, NULL);
+		if (!timercmp(&now, deadline, <))
+			return ICA_GETS_TIMEOUT;
+
+		// Wake at least every 1/TIME_FACTOR s to check for a restart
+		timersub(deadline, &now, &left);
+		ms = left.tv_sec * 1000 + (left.tv_usec + 999) / 1000;
+		if (ms > 1000 / TIME_FACTOR)
+			ms = 1000 / TIME_FACTOR;
+
+		ret = poll(&pfd, 1, ms);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return ICA_GETS_ERROR;
+		}
+		if (ret == 0)
+			continue;
+		if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL))
+			return ICA_GETS_ERROR;
+
+		ret = read(fd, info->rbuf + info->rlen, sizeof(info->rbuf) - info->rlen);
+		if (ret < 0)
+			return ICA_GETS_ERROR;
+		if (ret > 0 && info->rlen == 0)
+			gettimeofday(tv_finish, NULL);
+		info->rlen += ret;
+	}
+
+	return ICA_GETS_OK;
+}
+#endif
+
 static int icarus_write(int fd, const void *buf, size_t bufLen)
 {
 	size_t ret;
@@ -293,8 +369,17 @@ static int icarus_write(int fd, const void *buf, size_t bufLen)
 static void do_icarus_close(struct thr_info *thr)
 {
 	struct cgpu_info *icarus = thr->cgpu;
+	struct ICARUS_INFO *info = icarus_info[icarus->device_id];
+
 	icarus_close(icarus->device_fd);
 	icarus->device_fd = -1;
+
+	// Any job still running is lost with the fd
+	if (info->pipe_work) {
+		free_work(info->pipe_work);
+		info->pipe_work = NULL;
+	}
+	info->rlen = 0;
 }
 
 static const char *timing_mode_str(enum timing_mode timing_mode)
@@ -397,6 +482,163 @@ static void set_timing_mode(int this_option_offset, struct cgpu_info *icarus)
 		icarus->device_id, timing_mode_str(info->timing_mode), info->read_count, info->Hs);
 }
 
+// Short and long mode history is saved after each re-estimate, by device
+// path, and loaded again on detect so the timing is right from the start
+// The file is written by the watchdog, not the thread doing the timing
+#define ICARUS_TIMING_FILE "icarus.json"
+
+// If the first new data set of at least MAX_MIN_DATA_COUNT values has an
+// Hs this far from the loaded Hs, the device has changed, so the loaded
+// history is dropped
+#define ICARUS_TIMING_DRIFT 0.1
+
+static pthread_mutex_t timing_state_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool timing_state_dirty;
+
+static void icarus_timing_load(struct cgpu_info *icarus, struct ICARUS_INFO *info)
+{
+	char *path = alloca(PATH_MAX);
+	struct ICARUS_HISTORY *history;
+	json_t *root, *dev, *sets, *set;
+	double Hs;
+	size_t i;
+
+	if (!info->do_icarus_timing)
+		return;
+
+	mutex_lock(&timing_state_lock);
+	root = state_load(ICARUS_TIMING_FILE, path);
+	mutex_unlock(&timing_state_lock);
+
+	dev = json_object_get(root, icarus->device_path);
+	if (!json_is_object(dev))
+		goto out;
+
+	// The hash time depends on the options as well as the device
+	if (json_integer_value(json_object_get(dev, "baud")) != info->baud
+	||  json_integer_value(json_object_get(dev, "work_division")) != info->work_division
+	||  json_integer_value(json_object_get(dev, "fpga_count")) != info->fpga_count) {
+		applog(LOG_WARNING, "Icarus %d: Ignoring saved timing for %s with different --icarus-options",
+			icarus->device_id, icarus->device_path);
+		goto out;
+	}
+
+	Hs = json_number_value(json_object_get(dev, "Hs"));
+	sets = json_object_get(dev, "history");
+	if (!(Hs > 0.0) || !json_is_array(sets) || json_array_size(sets) == 0)
+		goto out;
+
+	for (i = 0; i < json_array_size(sets) && i < INFO_HISTORY; i++) {
+		set = json_array_get(sets, i);
+		if (!json_is_array(set) || json_array_size(set) != 7)
+			goto out;
+
+		history = &(info->history[i+1]);
+		history->sumXiTi = json_number_value(json_array_get(set, 0));
+		history->sumXi = json_number_value(json_array_get(set, 1));
+		history->sumTi = json_number_value(json_array_get(set, 2));
+		history->sumXi2 = json_number_value(json_array_get(set, 3));
+		history->values = json_integer_value(json_array_get(set, 4));
+		history->hash_count_min = json_integer_value(json_array_get(set, 5));
+		history->hash_count_max = json_integer_value(json_array_get(set, 6));
+	}
+
+	info->Hs = Hs;
+	info->W = json_number_value(json_object_get(dev, "W"));
+	info->fullnonce = info->W + Hs * (((double)0xffffffff) + 1);
+	info->read_count = (int)(info->fullnonce * TIME_FACTOR) - 1;
+	if (unlikely(info->read_count < 1))
+		info->read_count = 1;
+	info->min_data_count = json_integer_value(json_object_get(dev, "min_data_count"));
+	if (info->min_data_count < MIN_DATA_COUNT || info->min_data_count >= MAX_MIN_DATA_COUNT * 2)
+		info->min_data_count = MIN_DATA_COUNT;
+	info->count = i;
+	info->loaded_Hs = Hs;
+
+	applog(LOG_WARNING, "Icarus %d: Loaded saved timing Hs=%e W=%e read_count=%d fullnonce=%.3fs",
+		icarus->device_id, info->Hs, info->W, info->read_count, info->fullnonce);
+out:
+	if (!info->loaded_Hs)
+		memset(&(info->history[1]), 0, sizeof(struct ICARUS_HISTORY) * INFO_HISTORY);
+	json_decref(root);
+}
+
+// Keep the current estimate for icarus_timing_flush() to save
+static void icarus_timing_save(struct ICARUS_INFO *info)
+{
+	struct ICARUS_HISTORY *history;
+	json_t *dev, *sets, *set;
+	int i;
+
+	dev = json_object();
+	json_object_set_new(dev, "baud", json_integer(info->baud));
+	json_object_set_new(dev, "work_division", json_integer(info->work_division));
+	json_object_set_new(dev, "fpga_count", json_integer(info->fpga_count));
+	json_object_set_new(dev, "Hs", json_real(info->Hs));
+	json_object_set_new(dev, "W", json_real(info->W));
+	json_object_set_new(dev, "min_data_count", json_integer(info->min_data_count));
+
+	sets = json_array();
+	for (i = 1; i <= INFO_HISTORY; i++) {
+		history = &(info->history[i]);
+		if (history->values < MIN_DATA_COUNT)
+			continue;
+
+		set = json_array();
+		json_array_append_new(set, json_real(history->sumXiTi));
+		json_array_append_new(set, json_real(history->sumXi));
+		json_array_append_new(set, json_real(history->sumTi));
+		json_array_append_new(set, json_real(history->sumXi2));
+		json_array_append_new(set, json_integer(history->values));
+		json_array_append_new(set, json_integer(history->hash_count_min));
+		json_array_append_new(set, json_integer(history->hash_count_max));
+		json_array_append_new(sets, set);
+	}
+	json_object_set_new(dev, "history", sets);
+
+	mutex_lock(&timing_state_lock);
+	if (info->timing_state)
+		json_decref(info->timing_state);
+	info->timing_state = dev;
+	timing_state_dirty = true;
+	mutex_unlock(&timing_state_lock);
+}
+
+// Write every Icarus estimate waiting to be saved in one go
+static void icarus_timing_flush(void)
+{
+	char *path = alloca(PATH_MAX);
+	struct ICARUS_INFO *info;
+	struct cgpu_info *cgpu;
+	json_t *root;
+	int i;
+
+	mutex_lock(&timing_state_lock);
+	if (timing_state_dirty) {
+		root = state_load(ICARUS_TIMING_FILE, path);
+		for (i = 0; i < total_devices; i++) {
+			cgpu = devices[i];
+			if (cgpu->drv->drv != DRIVER_ICARUS)
+				continue;
+
+			info = icarus_info[cgpu->device_id];
+			if (info->timing_state) {
+				if (root)
+					json_object_set_new(root, cgpu->device_path, info->timing_state);
+				else
+					json_decref(info->timing_state);
+				info->timing_state = NULL;
+			}
+		}
+		if (root) {
+			state_save(root, path);
+			json_decref(root);
+		}
+		timing_state_dirty = false;
+	}
+	mutex_unlock(&timing_state_lock);
+}
+
 static uint32_t mask(int work_division)
 {
 	char err_buf[BUFSIZ+1];
@@ -510,7 +752,7 @@ static void get_options(int this_option_offset, int *baud, int *work_division, i
 
 static bool icarus_detect_one(const char *devpath)
 {
-	int this_option_offset = ++option_offset;
+	int this_option_offset = option_offset + detect_index();
 
 	struct ICARUS_INFO *info;
 	struct timeval tv_start, tv_finish;
@@ -603,12 +845,236 @@ static bool icarus_detect_one(const char *devpath)
 	timersub(&tv_finish, &tv_start, &(info->golden_tv));
 
 	set_timing_mode(this_option_offset, icarus);
+	icarus_timing_load(icarus, info);
 
 	return true;
 }
 
+#ifndef WIN32
+/*
+ * --icarus-sim N
+ * A load test of N virtual Icarus on ptys, all answered by one thread. Each
+ * returns the golden nonce for the detect job. For --benchmark work it
+ * returns the real nonce a two FPGA Icarus at ICARUS_REV3_HASH_TIME would
+ * reach first, after the time it would take to reach it. Any other job never
+ * finds a nonce, so runs until it is aborted. Combine with a short
+ * --icarus-timing abort time to raise the job rate.
+ */
+struct ICARUS_SIM {
+	int master;
+	int slave; // keeps the master from seeing a hangup between opens
+	unsigned char job[64];
+	int len;
+	// The nonce to send at reply, if reply is set
+	unsigned char nonce[ICARUS_READ_SIZE];
+	struct timeval reply;
+};
+
+static struct ICARUS_SIM *icarus_sims;
+
+// The start of the golden job and its nonce, see icarus_detect_one()
+static const unsigned char icarus_sim_golden[4] = { 0x46, 0x79, 0xba, 0x4e };
+static const unsigned char icarus_sim_golden_nonce[ICARUS_READ_SIZE] = { 0x00, 0x01, 0x87, 0xa2 };
+
+// The --benchmark work, and every nonce of it that is a share (of all 2^32)
+static const unsigned char icarus_sim_bench[] = { CGMINER_BENCHMARK_BLOCK };
+static const uint32_t icarus_sim_bench_nonces[] = { 0xef8b187d };
+
+// Keep the simulator's own fds out of the way of select() users
+static int icarus_sim_fd(int fd)
+{
+	int high = fcntl(fd, F_DUPFD, FD_SETSIZE);
+
+	if (high == -1)
+		return fd;
+	close(fd);
+	return high;
+}
+
+// Start the job just read, the way a two FPGA Icarus would scan it
+static void icarus_sim_job(struct ICARUS_SIM *sim)
+{
+	uint32_t nonce = 0, half;
+	double secs;
+	size_t i;
+
+	timerclear(&(sim->reply));
+
+	if (!memcmp(sim->job, icarus_sim_golden, sizeof(icarus_sim_golden))) {
+		write(sim->master, icarus_sim_golden_nonce, sizeof(icarus_sim_golden_nonce));
+		return;
+	}
+
+	// The job ends with the last 12 bytes of the work data reversed
+	for (i = 0; i < 12; i++)
+		if (sim->job[63 - i] != icarus_sim_bench[64 + i])
+			return;
+
+	// Each FPGA scans its half of the nonces from the start
+	half = 0xffffffff;
+	for (i = 0; i < ARRAY_SIZE(icarus_sim_bench_nonces); i++)
+		if ((icarus_sim_bench_nonces[i] & 0x7fffffff) < half) {
+			nonce = icarus_sim_bench_nonces[i];
+			half = nonce & 0x7fffffff;
+		}
+	if (half == 0xffffffff)
+		return;
+
+	sim->nonce[0] = nonce >> 24;
+	sim->nonce[1] = nonce >> 16;
+	sim->nonce[2] = nonce >> 8;
+	sim->nonce[3] = nonce;
+	secs = (double)half * 2 * ICARUS_REV3_HASH_TIME;
+	gettimeofday(&(sim->reply), NULL);
+	sim->reply.tv_sec += (time_t)secs;
+	sim->reply.tv_usec += (secs - (time_t)secs) * 1000000;
+	if (sim->reply.tv_usec >= 1000000) {
+		sim->reply.tv_sec++;
+		sim->reply.tv_usec -= 1000000;
+	}
+}
+
+static void *icarus_sim_thread(__maybe_unused void *userdata)
+{
+	struct pollfd *pfds;
+	struct ICARUS_SIM *sim;
+	struct timeval now;
+	double wait, next;
+	ssize_t ret;
+	int i;
+
+	RenameThread("icarussim");
+
+	pfds = calloc(opt_icarus_sim, sizeof(*pfds));
+	if (unlikely(!pfds))
+		quit(1, "Failed to calloc icarus sim pollfds");
+	for (i = 0; i < opt_icarus_sim; i++) {
+		pfds[i].fd = icarus_sims[i].master;
+		pfds[i].events = POLLIN;
+	}
+
+	while (42) {
+		// Send any nonce that is due, and wait no longer than the next
+		gettimeofday(&now, NULL);
+		next = -1;
+		for (i = 0; i < opt_icarus_sim; i++) {
+			sim = &icarus_sims[i];
+			if (!timerisset(&(sim->reply)))
+				continue;
+
+			wait = tdiff(&(sim->reply), &now);
+			if (wait <= 0) {
+				write(sim->master, sim->nonce, sizeof(sim->nonce));
+				timerclear(&(sim->reply));
+			} else if (next < 0 || wait < next)
+				next = wait;
+		}
+
+		if (poll(pfds, opt_icarus_sim, next < 0 ? -1 : (int)(next * 1000) + 1) <= 0)
+			continue;
+
+		for (i = 0; i < opt_icarus_sim; i++) {
+			if (!(pfds[i].revents & POLLIN))
+				continue;
+
+			sim = &icarus_sims[i];
+			ret = read(sim->master, sim->job + sim->len, sizeof(sim->job) - sim->len);
+			if (ret <= 0)
+				continue;
+			sim->len += ret;
+			if (sim->len < (int)sizeof(sim->job))
+				continue;
+			sim->len = 0;
+
+			icarus_sim_job(sim);
+		}
+	}
+
+	return NULL;
+}
+
+struct icarus_sim_detect {
+	char **paths;
+	bool *found;
+};
+
+static void icarus_sim_detect_one(int i, void *arg)
+{
+	struct icarus_sim_detect *isd = arg;
+
+	isd->found[i] = isd->paths[i] && icarus_detect_one(isd->paths[i]);
+}
+
+static void icarus_sim_detect()
+{
+	struct icarus_sim_detect isd;
+	struct termios tios;
+	struct rlimit rl;
+	pthread_t pth;
+	char *path;
+	int i, found = 0;
+
+	// Each board needs 3 fds
+	if (!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	icarus_sims = calloc(opt_icarus_sim, sizeof(*icarus_sims));
+	if (unlikely(!icarus_sims))
+		quit(1, "Failed to calloc icarus sims");
+
+	for (i = 0; i < opt_icarus_sim; i++) {
+		icarus_sims[i].master = posix_openpt(O_RDWR | O_NOCTTY);
+		if (icarus_sims[i].master == -1
+		||  grantpt(icarus_sims[i].master) || unlockpt(icarus_sims[i].master)
+		||  (icarus_sims[i].slave = open(ptsname(icarus_sims[i].master), O_RDWR | O_NOCTTY)) == -1)
+			quit(1, "Icarus sim: Failed to create pty %d (%d)", i, errno);
+
+		tcgetattr(icarus_sims[i].slave, &tios);
+		cfmakeraw(&tios);
+		tcsetattr(icarus_sims[i].slave, TCSANOW, &tios);
+
+		icarus_sims[i].master = icarus_sim_fd(icarus_sims[i].master);
+		icarus_sims[i].slave = icarus_sim_fd(icarus_sims[i].slave);
+	}
+
+	if (unlikely(pthread_create(&pth, NULL, icarus_sim_thread, NULL)))
+		quit(1, "Failed to create icarus sim thread");
+
+	// ptsname() isn't thread safe
+	isd.paths = calloc(opt_icarus_sim, sizeof(char *));
+	isd.found = calloc(opt_icarus_sim, sizeof(bool));
+	if (unlikely(!isd.paths || !isd.found))
+		quit(1, "Failed to calloc icarus sim detect");
+	for (i = 0; i < opt_icarus_sim; i++) {
+		path = ptsname(icarus_sims[i].master);
+		if (path)
+			isd.paths[i] = strdup(path);
+	}
+
+	detect_parallel(opt_icarus_sim, icarus_sim_detect_one, &isd);
+
+	for (i = 0; i < opt_icarus_sim; i++) {
+		if (isd.found[i])
+			found++;
+		free(isd.paths[i]);
+	}
+	free(isd.found);
+	free(isd.paths);
+
+	option_offset = opt_icarus_sim;
+
+	applog(LOG_WARNING, "Icarus sim: %d of %d virtual Icarus found", found, opt_icarus_sim);
+}
+#endif
+
 static void icarus_detect()
 {
+#ifndef WIN32
+	if (opt_icarus_sim)
+		icarus_sim_detect();
+#endif
 	serial_detect(&icarus_drv, icarus_detect_one);
 }
 
@@ -636,6 +1102,300 @@ static bool icarus_prepare(struct thr_info *thr)
 	return true;
 }
 
+// Add a nonce's time to the hash time history and recalculate the
+// estimate when a history data set is complete
+static void icarus_timing(struct cgpu_info *icarus, struct ICARUS_INFO *info, int64_t hash_count, struct timeval *tv_start, struct timeval *elapsed)
+{
+	struct timeval tv_history_start, tv_history_finish;
+	double Ti, Xi;
+	int i;
+
+	struct ICARUS_HISTORY *history0, *history;
+	int count;
+	double Hs, W, fullnonce;
+	int read_count;
+	uint32_t values;
+	int64_t hash_count_range;
+	bool save = false;
+
+	gettimeofday(&tv_history_start, NULL);
+
+	history0 = &(info->history[0]);
+
+	if (history0->values == 0)
+		timeradd(tv_start, &history_sec, &(history0->finish));
+
+	Ti = (double)(elapsed->tv_sec)
+		+ ((double)(elapsed->tv_usec))/((double)1000000)
+		- ((double)ICARUS_READ_TIME(info->baud));
+	Xi = (double)hash_count;
+	history0->sumXiTi += Xi * Ti;
+	history0->sumXi += Xi;
+	history0->sumTi += Ti;
+	history0->sumXi2 += Xi * Xi;
+
+	history0->values++;
+
+	if (history0->hash_count_max < hash_count)
+		history0->hash_count_max = hash_count;
+	if (history0->hash_count_min > hash_count || history0->hash_count_min == 0)
+		history0->hash_count_min = hash_count;
+
+	if (history0->values >= info->min_data_count
+	&&  timercmp(tv_start, &(history0->finish), >)) {
+		for (i = INFO_HISTORY; i > 0; i--)
+			memcpy(&(info->history[i]),
+				&(info->history[i-1]),
+				sizeof(struct ICARUS_HISTORY));
+
+		// Initialise history0 to zero for summary calculation
+		memset(history0, 0, sizeof(struct ICARUS_HISTORY));
+
+		// Check the loaded history still matches the device
+		history = &(info->history[1]);
+		if (info->loaded_Hs && history->values >= MAX_MIN_DATA_COUNT) {
+			Hs = (history->values*history->sumXiTi - history->sumXi*history->sumTi)
+				/ (history->values*history->sumXi2 - history->sumXi*history->sumXi);
+			if (fabs(Hs - info->loaded_Hs) > info->loaded_Hs * ICARUS_TIMING_DRIFT) {
+				applog(LOG_WARNING, "Icarus %d: Saved timing Hs=%e is out by more than %d%% (Hs=%e), dropping it",
+					icarus->device_id, info->loaded_Hs, (int)(ICARUS_TIMING_DRIFT * 100), Hs);
+				memset(&(info->history[2]), 0, sizeof(struct ICARUS_HISTORY) * (INFO_HISTORY - 1));
+			}
+			info->loaded_Hs = 0;
+		}
+
+		// We just completed a history data set
+		// So now recalc read_count based on the whole history thus we will
+		// initially get more accurate until it completes INFO_HISTORY
+		// total data sets
+		count = 0;
+		for (i = 1 ; i <= INFO_HISTORY; i++) {
+			history = &(info->history[i]);
+			if (history->values >= MIN_DATA_COUNT) {
+				count++;
+
+				history0->sumXiTi += history->sumXiTi;
+				history0->sumXi += history->sumXi;
+				history0->sumTi += history->sumTi;
+				history0->sumXi2 += history->sumXi2;
+				history0->values += history->values;
+
+				if (history0->hash_count_max < history->hash_count_max)
+					history0->hash_count_max = history->hash_count_max;
+				if (history0->hash_count_min > history->hash_count_min || history0->hash_count_min == 0)
+					history0->hash_count_min = history->hash_count_min;
+			}
+		}
+
+		// All history data
+		Hs = (history0->values*history0->sumXiTi - history0->sumXi*history0->sumTi)
+			/ (history0->values*history0->sumXi2 - history0->sumXi*history0->sumXi);
+		W = history0->sumTi/history0->values - Hs*history0->sumXi/history0->values;
+		hash_count_range = history0->hash_count_max - history0->hash_count_min;
+		values = history0->values;
+		
+		// Initialise history0 to zero for next data set
+		memset(history0, 0, sizeof(struct ICARUS_HISTORY));
+
+		fullnonce = W + Hs * (((double)0xffffffff) + 1);
+		read_count = (int)(fullnonce * TIME_FACTOR) - 1;
+
+		info->Hs = Hs;
+		info->read_count = read_count;
+
+		info->fullnonce = fullnonce;
+		info->count = count;
+		info->W = W;
+		info->values = values;
+		info->hash_count_range = hash_count_range;
+
+		if (info->min_data_count < MAX_MIN_DATA_COUNT)
+			info->min_data_count *= 2;
+		else if (info->timing_mode == MODE_SHORT)
+			info->do_icarus_timing = false;
+
+//		applog(LOG_WARNING, "Icarus %d Re-estimate: read_count=%d fullnonce=%fs history count=%d Hs=%e W=%e values=%d hash range=0x%08lx min data count=%u", icarus->device_id, read_count, fullnonce, count, Hs, W, values, hash_count_range, info->min_data_count);
+		applog(LOG_WARNING, "Icarus %d Re-estimate: Hs=%e W=%e read_count=%d fullnonce=%.3fs",
+				icarus->device_id, Hs, W, read_count, fullnonce);
+		save = true;
+	}
+	info->history_count++;
+	gettimeofday(&tv_history_finish, NULL);
+
+	timersub(&tv_history_finish, &tv_history_start, &tv_history_finish);
+	timeradd(&tv_history_finish, &(info->history_time), &(info->history_time));
+
+	// Not counted in history_time since it doesn't affect W
+	if (save)
+		icarus_timing_save(info);
+}
+
+static void icarus_job(unsigned char *ob_bin, struct work *work)
+{
+	memset(ob_bin, 0, 64);
+	memcpy(ob_bin, work->midstate, 32);
+	memcpy(ob_bin + 52, work->data + 64, 12);
+	rev(ob_bin, 32);
+	rev(ob_bin + 52, 12);
+}
+
+// Submit the len / ICARUS_READ_SIZE nonces in buf that the Icarus found
+// on work, and return the hashes it did, up to the first one. Sets
+// *hw_error if any of them was a HW error
+static int64_t icarus_nonces(struct thr_info *thr, struct work *work, unsigned char *buf, int len,
+				struct timeval *tv_start, struct timeval *tv_finish, bool *hw_error)
+{
+	struct cgpu_info *icarus = thr->cgpu;
+	struct ICARUS_INFO *info = icarus_info[icarus->device_id];
+	struct timeval elapsed;
+	uint32_t nonce, first_nonce = 0;
+	int64_t hash_count;
+	int curr_hw_errors, i;
+
+	// Both FPGAs may have found one
+	curr_hw_errors = icarus->hw_errors;
+	for (i = 0; i + ICARUS_READ_SIZE <= len; i += ICARUS_READ_SIZE) {
+		memcpy((char *)&nonce, buf + i, sizeof(nonce));
+#if !defined (__BIG_ENDIAN__) && !defined(MIPSEB)
+		nonce = swab32(nonce);
+#endif
+		if (i == 0)
+			first_nonce = nonce;
+		submit_nonce(thr, work, nonce);
+	}
+	*hw_error = (icarus->hw_errors > curr_hw_errors);
+
+	hash_count = (first_nonce & info->nonce_mask);
+	hash_count++;
+	hash_count *= info->fpga_count;
+
+	timersub(tv_finish, tv_start, &elapsed);
+
+	if (opt_debug) {
+		applog(LOG_DEBUG, "Icarus %d nonce = 0x%08x = 0x%08llx hashes (%ld.%06lds)",
+				icarus->device_id, first_nonce, (unsigned long long)hash_count,
+				elapsed.tv_sec, elapsed.tv_usec);
+	}
+
+	// ignore possible end condition values ... and hw errors
+	if (info->do_icarus_timing
+	&&  !*hw_error
+	&&  ((first_nonce & info->nonce_mask) > END_CONDITION)
+	&&  ((first_nonce & info->nonce_mask) < (info->nonce_mask & ~END_CONDITION)))
+		icarus_timing(icarus, info, hash_count, tv_start, &elapsed);
+
+	return hash_count;
+}
+
+#ifndef WIN32
+/*
+ * --icarus-pipeline
+ * Each call builds the job for the work it is given while the device is
+ * still hashing the previous one, waits for that to find a nonce or reach
+ * its abort time, then sends the new job straight away before dealing with
+ * the old job's result. The hashes returned are those of the previous job,
+ * up to when the new job replaced it, so the device only idles for the
+ * serial transfer of the job itself.
+ */
+static int64_t icarus_scanhash_pipe(struct thr_info *thr, struct work *work)
+{
+	struct cgpu_info *icarus = thr->cgpu;
+	struct ICARUS_INFO *info = icarus_info[icarus->device_id];
+	unsigned char ob_bin[64];
+	struct timeval tv_start, tv_finish, elapsed, deadline, abort_tv;
+	struct work *prev_work;
+	int64_t hash_count = 0;
+	bool was_hw_error;
+	int fd, len, ret = ICA_GETS_TIMEOUT;
+
+	fd = icarus->device_fd;
+
+	icarus_job(ob_bin, work);
+	work->blk.nonce = 0xffffffff;
+
+	if (info->pipe_work) {
+		abort_tv.tv_sec = info->read_count / TIME_FACTOR;
+		abort_tv.tv_usec = (info->read_count % TIME_FACTOR) * (1000000 / TIME_FACTOR);
+		timeradd(&(info->pipe_start), &abort_tv, &deadline);
+
+		ret = icarus_poll_gets(info, fd, &deadline, &tv_finish, thr);
+		if (ret == ICA_GETS_ERROR) {
+			do_icarus_close(thr);
+			applog(LOG_ERR, "ICA%i: Comms error", icarus->device_id);
+			dev_error(icarus, REASON_DEV_COMMS_ERROR);
+			return 0;
+		}
+
+		// The work we were given is stale too, so leave the device
+		// alone until the next work arrives
+		if (ret == ICA_GETS_RESTART) {
+			gettimeofday(&tv_finish, NULL);
+			timersub(&tv_finish, &(info->pipe_start), &elapsed);
+			free_work(info->pipe_work);
+			info->pipe_work = NULL;
+			info->rlen = 0;
+
+			hash_count = ((double)(elapsed.tv_sec)
+					+ ((double)(elapsed.tv_usec))/((double)1000000)) / info->Hs;
+			if (unlikely(hash_count > 0xffffffff))
+				hash_count = 0xffffffff;
+
+			return hash_count;
+		}
+	}
+
+	tcflush(fd, TCOFLUSH);
+	if (icarus_write(fd, ob_bin, sizeof(ob_bin))) {
+		do_icarus_close(thr);
+		applog(LOG_ERR, "ICA%i: Comms error", icarus->device_id);
+		dev_error(icarus, REASON_DEV_COMMS_ERROR);
+		return 0;
+	}
+	gettimeofday(&tv_start, NULL);
+
+	prev_work = info->pipe_work;
+	info->pipe_work = copy_work(work);
+	// Keep the previous start for the result below
+	abort_tv = info->pipe_start;
+	info->pipe_start = tv_start;
+
+	if (!prev_work)
+		return 0;
+
+	if (ret == ICA_GETS_TIMEOUT) {
+		// It hashed until the new job replaced it
+		info->rlen = 0;
+		timersub(&tv_start, &abort_tv, &elapsed);
+
+		hash_count = ((double)(elapsed.tv_sec)
+				+ ((double)(elapsed.tv_usec))/((double)1000000)) / info->Hs;
+		if (unlikely(hash_count > 0xffffffff))
+			hash_count = 0xffffffff;
+
+		if (opt_debug) {
+			applog(LOG_DEBUG, "Icarus %d no nonce = 0x%08llx hashes (%ld.%06lds)",
+					icarus->device_id, (unsigned long long)hash_count,
+					elapsed.tv_sec, elapsed.tv_usec);
+		}
+
+		free_work(prev_work);
+		return hash_count;
+	}
+
+	len = info->rlen - info->rlen % ICARUS_READ_SIZE;
+	hash_count = icarus_nonces(thr, prev_work, info->rbuf, len, &abort_tv, &tv_finish, &was_hw_error);
+	info->rlen -= len;
+	memmove(info->rbuf, info->rbuf + len, info->rlen);
+	free_work(prev_work);
+
+	// Force a USB close/reopen on any hw error
+	if (was_hw_error)
+		do_icarus_close(thr);
+
+	return hash_count;
+}
+#endif
+
 static int64_t icarus_scanhash(struct thr_info *thr, struct work *work,
 				__maybe_unused int64_t max_nonce)
 {
@@ -647,21 +1407,11 @@ static int64_t icarus_scanhash(struct thr_info *thr, struct work *work,
 
 	unsigned char ob_bin[64], nonce_bin[ICARUS_READ_SIZE];
 	char *ob_hex;
-	uint32_t nonce;
 	int64_t hash_count;
 	struct timeval tv_start, tv_finish, elapsed;
-	struct timeval tv_history_start, tv_history_finish;
-	double Ti, Xi;
-	int curr_hw_errors, i;
 	bool was_hw_error;
 
-	struct ICARUS_HISTORY *history0, *history;
-	int count;
-	double Hs, W, fullnonce;
-	int read_count;
 	int64_t estimate_hashes;
-	uint32_t values;
-	int64_t hash_count_range;
 
 	elapsed.tv_sec = elapsed.tv_usec = 0;
 
@@ -675,13 +1425,14 @@ static int64_t icarus_scanhash(struct thr_info *thr, struct work *work,
 			return -1;
 		}
 
+#ifndef WIN32
+	if (opt_icarus_pipeline)
+		return icarus_scanhash_pipe(thr, work);
+#endif
+
 	fd = icarus->device_fd;
 
-	memset(ob_bin, 0, sizeof(ob_bin));
-	memcpy(ob_bin, work->midstate, 32);
-	memcpy(ob_bin + 52, work->data + 64, 12);
-	rev(ob_bin, 32);
-	rev(ob_bin + 52, 12);
+	icarus_job(ob_bin, work);
 #ifndef WIN32
 	tcflush(fd, TCOFLUSH);
 #endif
@@ -738,134 +1489,231 @@ static int64_t icarus_scanhash(struct thr_info *thr, struct work *work,
 		return estimate_hashes;
 	}
 
-	memcpy((char *)&nonce, nonce_bin, sizeof(nonce_bin));
-
-#if !defined (__BIG_ENDIAN__) && !defined(MIPSEB)
-	nonce = swab32(nonce);
-#endif
-
-	curr_hw_errors = icarus->hw_errors;
-	submit_nonce(thr, work, nonce);
-	was_hw_error = (curr_hw_errors > icarus->hw_errors);
+	hash_count = icarus_nonces(thr, work, nonce_bin, sizeof(nonce_bin), &tv_start, &tv_finish, &was_hw_error);
 
 	// Force a USB close/reopen on any hw error
 	if (was_hw_error)
 		do_icarus_close(thr);
 
-	hash_count = (nonce & info->nonce_mask);
-	hash_count++;
-	hash_count *= info->fpga_count;
+	return hash_count;
+}
 
-	if (opt_debug || info->do_icarus_timing)
-		timersub(&tv_finish, &tv_start, &elapsed);
+#ifndef WIN32
+/*
+ * --icarus-events
+ * Every Icarus is run from the shared serial event thread in fpgautils.c
+ * rather than a miner thread of its own. With no job running a device takes
+ * the next work without waiting, sends it and sets the abort time as its
+ * deadline. Then either a nonce arrives, or the deadline or a restart passes
+ * first, and the next job is sent straight away.
+ */
+
+// How soon to look again for work when none was staged
+#define ICARUS_EV_WORK_MS 10
+
+static void icarus_ev_error(struct thr_info *thr, struct ICARUS_INFO *info)
+{
+	struct cgpu_info *icarus = thr->cgpu;
+
+	serial_ev_set_fd(&info->ev, -1);
+	do_icarus_close(thr);
+	applog(LOG_ERR, "ICA%i: Comms error", icarus->device_id);
+	dev_error(icarus, REASON_DEV_COMMS_ERROR);
+}
+
+// Count the hashes of a job that is given up at now, without a nonce
+static void icarus_ev_abandon(struct thr_info *thr, struct ICARUS_INFO *info, struct timeval *now)
+{
+	struct timeval elapsed;
+	int64_t hash_count;
+
+	timersub(now, &(info->pipe_start), &elapsed);
+	hash_count = ((double)(elapsed.tv_sec)
+			+ ((double)(elapsed.tv_usec))/((double)1000000)) / info->Hs;
+	if (unlikely(hash_count > 0xffffffff))
+		hash_count = 0xffffffff;
 
 	if (opt_debug) {
-		applog(LOG_DEBUG, "Icarus %d nonce = 0x%08x = 0x%08llx hashes (%ld.%06lds)",
-				icarus->device_id, nonce, hash_count, elapsed.tv_sec, elapsed.tv_usec);
+		applog(LOG_DEBUG, "Icarus %d no nonce = 0x%08llx hashes (%ld.%06lds)",
+				thr->cgpu->device_id, (unsigned long long)hash_count,
+				elapsed.tv_sec, elapsed.tv_usec);
 	}
 
-	// ignore possible end condition values ... and hw errors
-	if (info->do_icarus_timing
-	&&  !was_hw_error
-	&&  ((nonce & info->nonce_mask) > END_CONDITION)
-	&&  ((nonce & info->nonce_mask) < (info->nonce_mask & ~END_CONDITION))) {
-		gettimeofday(&tv_history_start, NULL);
-
-		history0 = &(info->history[0]);
-
-		if (history0->values == 0)
-			timeradd(&tv_start, &history_sec, &(history0->finish));
-
-		Ti = (double)(elapsed.tv_sec)
-			+ ((double)(elapsed.tv_usec))/((double)1000000)
-			- ((double)ICARUS_READ_TIME(info->baud));
-		Xi = (double)hash_count;
-		history0->sumXiTi += Xi * Ti;
-		history0->sumXi += Xi;
-		history0->sumTi += Ti;
-		history0->sumXi2 += Xi * Xi;
-
-		history0->values++;
-
-		if (history0->hash_count_max < hash_count)
-			history0->hash_count_max = hash_count;
-		if (history0->hash_count_min > hash_count || history0->hash_count_min == 0)
-			history0->hash_count_min = hash_count;
-
-		if (history0->values >= info->min_data_count
-		&&  timercmp(&tv_start, &(history0->finish), >)) {
-			for (i = INFO_HISTORY; i > 0; i--)
-				memcpy(&(info->history[i]),
-					&(info->history[i-1]),
-					sizeof(struct ICARUS_HISTORY));
-
-			// Initialise history0 to zero for summary calculation
-			memset(history0, 0, sizeof(struct ICARUS_HISTORY));
-
-			// We just completed a history data set
-			// So now recalc read_count based on the whole history thus we will
-			// initially get more accurate until it completes INFO_HISTORY
-			// total data sets
-			count = 0;
-			for (i = 1 ; i <= INFO_HISTORY; i++) {
-				history = &(info->history[i]);
-				if (history->values >= MIN_DATA_COUNT) {
-					count++;
-
-					history0->sumXiTi += history->sumXiTi;
-					history0->sumXi += history->sumXi;
-					history0->sumTi += history->sumTi;
-					history0->sumXi2 += history->sumXi2;
-					history0->values += history->values;
-
-					if (history0->hash_count_max < history->hash_count_max)
-						history0->hash_count_max = history->hash_count_max;
-					if (history0->hash_count_min > history->hash_count_min || history0->hash_count_min == 0)
-						history0->hash_count_min = history->hash_count_min;
-				}
-			}
+	free_work(info->pipe_work);
+	info->pipe_work = NULL;
+	info->rlen = 0;
 
-			// All history data
-			Hs = (history0->values*history0->sumXiTi - history0->sumXi*history0->sumTi)
-				/ (history0->values*history0->sumXi2 - history0->sumXi*history0->sumXi);
-			W = history0->sumTi/history0->values - Hs*history0->sumXi/history0->values;
-			hash_count_range = history0->hash_count_max - history0->hash_count_min;
-			values = history0->values;
-			
-			// Initialise history0 to zero for next data set
-			memset(history0, 0, sizeof(struct ICARUS_HISTORY));
+	thread_hashes(thr, hash_count);
+}
 
-			fullnonce = W + Hs * (((double)0xffffffff) + 1);
-			read_count = (int)(fullnonce * TIME_FACTOR) - 1;
+// Send the next job if any work is staged, false if none was sent
+static bool icarus_ev_send(struct thr_info *thr, struct ICARUS_INFO *info)
+{
+	struct cgpu_info *icarus = thr->cgpu;
+	unsigned char ob_bin[64];
+	struct timeval abort_tv;
+	struct work *work;
 
-			info->Hs = Hs;
-			info->read_count = read_count;
+	work = get_work_nowait(thr, thr->id);
+	if (!work)
+		return false;
 
-			info->fullnonce = fullnonce;
-			info->count = count;
-			info->W = W;
-			info->values = values;
-			info->hash_count_range = hash_count_range;
+	icarus_job(ob_bin, work);
+	tcflush(icarus->device_fd, TCOFLUSH);
+	if (icarus_write(icarus->device_fd, ob_bin, sizeof(ob_bin))) {
+		free_work(work);
+		icarus_ev_error(thr, info);
+		return false;
+	}
+	gettimeofday(&(info->pipe_start), NULL);
+	info->pipe_work = work;
+	icarus->new_work = true;
 
-			if (info->min_data_count < MAX_MIN_DATA_COUNT)
-				info->min_data_count *= 2;
-			else if (info->timing_mode == MODE_SHORT)
-				info->do_icarus_timing = false;
+	abort_tv.tv_sec = info->read_count / TIME_FACTOR;
+	abort_tv.tv_usec = (info->read_count % TIME_FACTOR) * (1000000 / TIME_FACTOR);
+	timeradd(&(info->pipe_start), &abort_tv, &(info->ev.deadline));
 
-//			applog(LOG_WARNING, "Icarus %d Re-estimate: read_count=%d fullnonce=%fs history count=%d Hs=%e W=%e values=%d hash range=0x%08lx min data count=%u", icarus->device_id, read_count, fullnonce, count, Hs, W, values, hash_count_range, info->min_data_count);
-			applog(LOG_WARNING, "Icarus %d Re-estimate: Hs=%e W=%e read_count=%d fullnonce=%.3fs",
-					icarus->device_id, Hs, W, read_count, fullnonce);
+	return true;
+}
+
+static void icarus_ev_tick(struct serial_ev *ev)
+{
+	struct ICARUS_INFO *info = ev->data;
+	struct thr_info *thr = info->thr;
+	struct cgpu_info *icarus = thr->cgpu;
+	struct timeval now, wait;
+
+	gettimeofday(&now, NULL);
+
+	if (thr->pause || icarus->deven != DEV_ENABLED) {
+		if (info->pipe_work)
+			icarus_ev_abandon(thr, info, &now);
+		thread_reportout(thr);
+		wait.tv_sec = 0;
+		wait.tv_usec = SERIAL_EV_TICK_MS * 1000;
+		timeradd(&now, &wait, &(ev->deadline));
+		return;
+	}
+
+	if (icarus->device_fd == -1) {
+		if (!icarus_prepare(thr)) {
+			applog(LOG_ERR, "ICA%i: Comms error", icarus->device_id);
+			dev_error(icarus, REASON_DEV_COMMS_ERROR);
+
+			// fail the device if the reopen attempt fails
+			applog(LOG_ERR, "%s %d failure, disabling!", icarus->drv->name, icarus->device_id);
+			icarus->deven = DEV_DISABLED;
+			dev_error(icarus, REASON_THREAD_ZERO_HASH);
+			return;
 		}
-		info->history_count++;
-		gettimeofday(&tv_history_finish, NULL);
+		serial_ev_set_fd(ev, icarus->device_fd);
+	}
 
-		timersub(&tv_history_finish, &tv_history_start, &tv_history_finish);
-		timeradd(&tv_history_finish, &(info->history_time), &(info->history_time));
+	if (thr->work_restart) {
+		thr->work_restart = false;
+		if (info->pipe_work)
+			icarus_ev_abandon(thr, info, &now);
 	}
 
-	return hash_count;
+	if (info->pipe_work) {
+		if (timercmp(&now, &(ev->deadline), <)) {
+			thread_hashes(thr, 0);
+			return;
+		}
+		// It reached the abort time
+		icarus_ev_abandon(thr, info, &now);
+	}
+
+	if (!icarus_ev_send(thr, info)) {
+		wait.tv_sec = 0;
+		wait.tv_usec = ICARUS_EV_WORK_MS * 1000;
+		timeradd(&now, &wait, &(ev->deadline));
+		thread_hashes(thr, 0);
+	}
+}
+
+static void icarus_ev_readable(struct serial_ev *ev)
+{
+	struct ICARUS_INFO *info = ev->data;
+	struct thr_info *thr = info->thr;
+	struct cgpu_info *icarus = thr->cgpu;
+	struct timeval now;
+	int64_t hash_count;
+	bool was_hw_error;
+	ssize_t ret;
+	int len;
+
+	gettimeofday(&now, NULL);
+
+	ret = read(ev->fd, info->rbuf + info->rlen, sizeof(info->rbuf) - info->rlen);
+	if (ret <= 0) {
+		if (ret < 0 && errno == EINTR)
+			return;
+		// Readable with nothing to read is a hangup
+		icarus_ev_error(thr, info);
+		return;
+	}
+	if (info->rlen == 0)
+		info->pipe_finish = now;
+	info->rlen += ret;
+
+	// A late reply to a job that was already given up
+	if (!info->pipe_work) {
+		info->rlen = 0;
+		return;
+	}
+
+	if (info->rlen < ICARUS_READ_SIZE)
+		return;
+
+	thread_reportin(thr);
+
+	len = info->rlen - info->rlen % ICARUS_READ_SIZE;
+	hash_count = icarus_nonces(thr, info->pipe_work, info->rbuf, len,
+				   &(info->pipe_start), &(info->pipe_finish), &was_hw_error);
+	info->rlen -= len;
+	memmove(info->rbuf, info->rbuf + len, info->rlen);
+	free_work(info->pipe_work);
+	info->pipe_work = NULL;
+
+	thread_hashes(thr, hash_count);
+
+	// Force a USB close/reopen on any hw error, tick() reopens it
+	if (was_hw_error) {
+		serial_ev_set_fd(ev, -1);
+		do_icarus_close(thr);
+		timerclear(&(ev->deadline));
+		return;
+	}
+
+	if (!thr->pause && icarus->deven == DEV_ENABLED && !thr->work_restart
+	&&  icarus_ev_send(thr, info))
+		return;
+
+	// Let tick() deal with it
+	timerclear(&(ev->deadline));
 }
 
+static bool icarus_thread_attach(struct thr_info *thr)
+{
+	struct cgpu_info *icarus = thr->cgpu;
+	struct ICARUS_INFO *info = icarus_info[icarus->device_id];
+
+	if (!opt_icarus_events)
+		return false;
+
+	info->thr = thr;
+	info->ev.fd = icarus->device_fd;
+	info->ev.readable = icarus_ev_readable;
+	info->ev.tick = icarus_ev_tick;
+	info->ev.data = info;
+	timerclear(&(info->ev.deadline));
+	serial_ev_add(&(info->ev));
+
+	return true;
+}
+#endif
+
 static struct api_data *icarus_api_stats(struct cgpu_info *cgpu)
 {
 	struct api_data *root = NULL;
@@ -895,9 +1743,17 @@ static struct api_data *icarus_api_stats(struct cgpu_info *cgpu)
 	return root;
 }
 
+// Called by the watchdog for each Icarus
+static bool icarus_get_stats(__maybe_unused struct cgpu_info *icarus)
+{
+	icarus_timing_flush();
+	return true;
+}
+
 static void icarus_shutdown(struct thr_info *thr)
 {
 	do_icarus_close(thr);
+	icarus_timing_flush();
 }
 
 struct device_drv icarus_drv = {
@@ -906,7 +1762,11 @@ struct device_drv icarus_drv = {
 	.name = "ICA",
 	.drv_detect = icarus_detect,
 	.get_api_stats = icarus_api_stats,
+	.get_stats = icarus_get_stats,
 	.thread_prepare = icarus_prepare,
+#ifndef WIN32
+	.thread_attach = icarus_thread_attach,
+#endif
 	.scanhash = icarus_scanhash,
 	.thread_shutdown = icarus_shutdown,
 };
@@ -325,32 +325,41 @@ static bool get_status(struct cgpu_info *modminer, char *msg, enum usb_cmds cmd)
 	return get_status_timeout(modminer, msg, USE_DEFAULT_TIMEOUT, cmd);
 }
 
-static bool modminer_fpga_upload_bitstream(struct cgpu_info *modminer)
+/* The bitstream is parsed once and the data kept in memory for every board,
+ * rather than read from the file each time */
+struct modminer_bitstream {
+	unsigned char *data;
+	unsigned long len;
+};
+
+static struct modminer_bitstream *bitstream;
+static pthread_mutex_t bitstream_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct modminer_bitstream *modminer_load_bitstream(struct cgpu_info *modminer)
 {
 	const char *bsfile = BITSTREAM_FILENAME;
+	struct modminer_bitstream *bs = NULL;
 	char buf[0x100], *p;
-	char devmsg[64];
 	unsigned char *ubuf = (unsigned char *)buf;
-	unsigned long totlen, len;
-	size_t buflen, remaining;
-	float nextmsg, upto;
-	char fpgaid = FPGAID_ALL;
-	int err, amount, tries;
-	char *ptr;
+	unsigned long len;
+	FILE *f;
 
-	FILE *f = open_bitstream("modminer", bsfile);
-	if (!f) {
-		mutex_unlock(modminer->modminer_mutex);
+	mutex_lock(&bitstream_lock);
+
+	if (bitstream) {
+		mutex_unlock(&bitstream_lock);
+		return bitstream;
+	}
 
+	f = open_bitstream("modminer", bsfile);
+	if (!f) {
 		applog(LOG_ERR, "%s%u: Error (%d) opening bitstream file %s",
 			modminer->drv->name, modminer->device_id, errno, bsfile);
 
-		return false;
+		goto out;
 	}
 
 	if (fread(buf, 2, 1, f) != 1) {
-		mutex_unlock(modminer->modminer_mutex);
-
 		applog(LOG_ERR, "%s%u: Error (%d) reading bitstream magic",
 			modminer->drv->name, modminer->device_id, errno);
 
@@ -358,8 +367,6 @@ static bool modminer_fpga_upload_bitstream(struct cgpu_info *modminer)
 	}
 
 	if (buf[0] != BITSTREAM_MAGIC_0 || buf[1] != BITSTREAM_MAGIC_1) {
-		mutex_unlock(modminer->modminer_mutex);
-
 		applog(LOG_ERR, "%s%u: bitstream has incorrect magic (%u,%u) instead of (%u,%u)",
 			modminer->drv->name, modminer->device_id,
 			buf[0], buf[1],
@@ -369,8 +376,6 @@ static bool modminer_fpga_upload_bitstream(struct cgpu_info *modminer)
 	}
 
 	if (fseek(f, 11L, SEEK_CUR)) {
-		mutex_unlock(modminer->modminer_mutex);
-
 		applog(LOG_ERR, "%s%u: Error (%d) bitstream seek failed",
 			modminer->drv->name, modminer->device_id, errno);
 
@@ -378,10 +383,10 @@ static bool modminer_fpga_upload_bitstream(struct cgpu_info *modminer)
 	}
 
 	if (!get_expect(modminer, f, 'a'))
-		goto undame;
+		goto dame;
 
 	if (!get_info(modminer, f, buf, sizeof(buf), "Design name"))
-		goto undame;
+		goto dame;
 
 	applog(LOG_DEBUG, "%s%u: bitstream file '%s' info:",
 		modminer->drv->name, modminer->device_id, bsfile);
@@ -396,8 +401,6 @@ static bool modminer_fpga_upload_bitstream(struct cgpu_info *modminer)
 	unsigned long fwusercode = (unsigned long)strtoll(p, &p, 16);
 
 	if (p[0] != '\0') {
-		mutex_unlock(modminer->modminer_mutex);
-
 		applog(LOG_ERR, "%s%u: Bad usercode in bitstream file",
 			modminer->drv->name, modminer->device_id);
 
@@ -405,8 +408,6 @@ static bool modminer_fpga_upload_bitstream(struct cgpu_info *modminer)
 	}
 
 	if (fwusercode == 0xffffffff) {
-		mutex_unlock(modminer->modminer_mutex);
-
 		applog(LOG_ERR, "%s%u: bitstream doesn't support user code",
 			modminer->drv->name, modminer->device_id);
 
@@ -416,35 +417,33 @@ static bool modminer_fpga_upload_bitstream(struct cgpu_info *modminer)
 	applog(LOG_DEBUG, " Version: %u, build %u", (fwusercode >> 8) & 0xff, fwusercode & 0xff);
 
 	if (!get_expect(modminer, f, 'b'))
-		goto undame;
+		goto dame;
 
 	if (!get_info(modminer, f, buf, sizeof(buf), "Part number"))
-		goto undame;
+		goto dame;
 
 	applog(LOG_DEBUG, " Part number: '%s'", buf);
 
 	if (!get_expect(modminer, f, 'c'))
-		goto undame;
+		goto dame;
 
 	if (!get_info(modminer, f, buf, sizeof(buf), "Build date"))
-		goto undame;
+		goto dame;
 
 	applog(LOG_DEBUG, " Build date: '%s'", buf);
 
 	if (!get_expect(modminer, f, 'd'))
-		goto undame;
+		goto dame;
 
 	if (!get_info(modminer, f, buf, sizeof(buf), "Build time"))
-		goto undame;
+		goto dame;
 
 	applog(LOG_DEBUG, " Build time: '%s'", buf);
 
 	if (!get_expect(modminer, f, 'e'))
-		goto undame;
+		goto dame;
 
 	if (fread(buf, 4, 1, f) != 1) {
-		mutex_unlock(modminer->modminer_mutex);
-
 		applog(LOG_ERR, "%s%u: Error (%d) reading bitstream data len",
 			modminer->drv->name, modminer->device_id, errno);
 
@@ -454,51 +453,66 @@ static bool modminer_fpga_upload_bitstream(struct cgpu_info *modminer)
 	len = ((unsigned long)ubuf[0] << 24) | ((unsigned long)ubuf[1] << 16) | (ubuf[2] << 8) | ubuf[3];
 	applog(LOG_DEBUG, " Bitstream size: %lu", len);
 
-	strcpy(devmsg, modminer->device_path);
-	ptr = strrchr(devmsg, ':');
-	if (ptr)
-		*ptr = '\0';
-
-	applog(LOG_WARNING, "%s%u: Programming all FPGA on %s ... Mining will not start until complete",
-		modminer->drv->name, modminer->device_id, devmsg);
-
-	buf[0] = MODMINER_PROGRAM;
-	buf[1] = fpgaid;
-	buf[2] = (len >>  0) & 0xff;
-	buf[3] = (len >>  8) & 0xff;
-	buf[4] = (len >> 16) & 0xff;
-	buf[5] = (len >> 24) & 0xff;
-
-	if ((err = usb_write(modminer, buf, 6, &amount, C_STARTPROGRAM)) < 0 || amount != 6) {
-		mutex_unlock(modminer->modminer_mutex);
-
-		applog(LOG_ERR, "%s%u: Program init failed (%d:%d)",
-			modminer->drv->name, modminer->device_id, amount, err);
-
+	bs = calloc(1, sizeof(*bs));
+	if (unlikely(!bs))
+		quit(1, "Failed to calloc modminer bitstream");
+	bs->data = malloc(len ? : 1);
+	if (unlikely(!bs->data))
+		quit(1, "Failed to malloc modminer bitstream data");
+	bs->len = len;
+
+	if (len && fread(bs->data, len, 1, f) != 1) {
+		applog(LOG_ERR, "%s%u: bitstream file read error %d (%lu bytes)",
+			modminer->drv->name, modminer->device_id, errno, len);
+
+		free(bs->data);
+		free(bs);
+		bs = NULL;
 		goto dame;
 	}
 
-	if (!get_status(modminer, "initialise", C_STARTPROGRAMSTATUS))
-		goto undame;
+	bitstream = bs;
+dame:
+	fclose(f);
+out:
+	mutex_unlock(&bitstream_lock);
+	return bs;
+}
 
 // It must be 32 bytes according to MCU legacy.c
 #define WRITE_SIZE 32
+// --mmq-pipeline, how many writes can be waiting for their status reply
+#define WRITE_PIPE 16
+// The MCU holds off each write until it has programmed the ones before it
+#define WRITE_TIMEOUT_MS 2000
 
-	totlen = len;
-	nextmsg = 0.1;
-	while (len > 0) {
-		buflen = len < WRITE_SIZE ? len : WRITE_SIZE;
-		if (fread(buf, buflen, 1, f) != 1) {
-			mutex_unlock(modminer->modminer_mutex);
+static void upload_progress(struct cgpu_info *modminer, unsigned long done, unsigned long len, float *nextmsg)
+{
+	float upto = (float)done / (float)len;
 
-			applog(LOG_ERR, "%s%u: bitstream file read error %d (%d bytes left)",
-				modminer->drv->name, modminer->device_id, errno, len);
+	if (upto >= *nextmsg) {
+		applog(LOG_WARNING,
+			"%s%u: Programming %.1f%% (%lu out of %lu)",
+			modminer->drv->name, modminer->device_id, upto*100, done, len);
 
-			goto dame;
-		}
+		*nextmsg += 0.1;
+	}
+}
+
+// mutex must always be locked before calling, it is unlocked if it fails
+static bool upload_serial(struct cgpu_info *modminer, struct modminer_bitstream *bs)
+{
+	unsigned long len = bs->len, off;
+	size_t buflen, remaining;
+	float nextmsg = 0.1;
+	int err, amount, tries;
+	char *ptr;
+
+	for (off = 0; off < len; off += buflen) {
+		buflen = len - off < WRITE_SIZE ? len - off : WRITE_SIZE;
 
 		tries = 0;
-		ptr = buf;
+		ptr = (char *)(bs->data + off);
 		remaining = buflen;
 		while ((err = usb_write(modminer, ptr, remaining, &amount, C_PROGRAM)) < 0 || amount != (int)remaining) {
 			if (err == LIBUSB_ERROR_TIMEOUT && amount > 0 && ++tries < 4) {
@@ -508,53 +522,186 @@ static bool modminer_fpga_upload_bitstream(struct cgpu_info *modminer)
 				if (opt_debug)
 					applog(LOG_DEBUG, "%s%u: Program timeout (%d:%d) sent %d tries %d",
 						modminer->drv->name, modminer->device_id,
-						amount, err, remaining, tries);
+						amount, err, (int)remaining, tries);
 
 				if (!get_status(modminer, "write status", C_PROGRAMSTATUS2))
-					goto dame;
+					return false;
 
 			} else {
 				mutex_unlock(modminer->modminer_mutex);
 
 				applog(LOG_ERR, "%s%u: Program failed (%d:%d) sent %d",
-					modminer->drv->name, modminer->device_id, amount, err, remaining);
+					modminer->drv->name, modminer->device_id, amount, err, (int)remaining);
 
-				goto dame;
+				return false;
 			}
 		}
 
 		if (!get_status(modminer, "write status", C_PROGRAMSTATUS))
+			return false;
+
+		upload_progress(modminer, off + buflen, len, &nextmsg);
+	}
+
+	return true;
+}
+
+/* --mmq-pipeline
+ * Rather than wait for each status reply before sending the next write,
+ * keep up to WRITE_PIPE writes going and read the replies as they arrive.
+ * A write can't be retried once later ones are queued behind it, so any
+ * failure fails the upload */
+// mutex must always be locked before calling, it is unlocked if it fails
+static bool upload_pipe(struct cgpu_info *modminer, struct modminer_bitstream *bs)
+{
+	struct cg_usb_xfer *xfers[WRITE_PIPE];
+	unsigned long len = bs->len, off, chunks, sent, written, acked;
+	char buf[WRITE_PIPE];
+	size_t buflen;
+	float nextmsg = 0.1;
+	int err, amount, i;
+
+	chunks = (len + WRITE_SIZE - 1) / WRITE_SIZE;
+	sent = written = acked = 0;
+	while (acked < chunks) {
+		while (sent < chunks && sent - acked < WRITE_PIPE) {
+			off = sent * WRITE_SIZE;
+			buflen = len - off < WRITE_SIZE ? len - off : WRITE_SIZE;
+			xfers[sent % WRITE_PIPE] = usb_start_write_timeout(modminer, (char *)(bs->data + off),
+								buflen, WRITE_TIMEOUT_MS, C_PROGRAM, &err);
+			if (!xfers[sent % WRITE_PIPE]) {
+				applog(LOG_ERR, "%s%u: Program failed (%d) at %lu",
+					modminer->drv->name, modminer->device_id, err, off);
+
+				goto dame;
+			}
+			sent++;
+		}
+
+		// The writes stay in flight while this waits, so the MCU is never
+		// left unable to send a reply
+		if ((err = usb_read(modminer, buf, sent - acked, &amount, C_PROGRAMSTATUS)) < 0 || amount < 1) {
+			applog(LOG_ERR, "%s%u: Error (%d:%d) getting write status reply",
+				modminer->drv->name, modminer->device_id, amount, err);
+
 			goto dame;
+		}
 
-		len -= buflen;
+		for (i = 0; i < amount; i++)
+			if (buf[i] != 1) {
+				applog(LOG_ERR, "%s%u: Error, invalid write status reply (was %d should be 1)",
+					modminer->drv->name, modminer->device_id, buf[i]);
 
-		upto = (float)(totlen - len) / (float)(totlen);
-		if (upto >= nextmsg) {
-			applog(LOG_WARNING,
-				"%s%u: Programming %.1f%% (%d out of %d)",
-				modminer->drv->name, modminer->device_id, upto*100, (totlen - len), totlen);
+				goto dame;
+			}
+
+		acked += amount;
 
-			nextmsg += 0.1;
+		// Each reply means its write is done
+		while (written < acked) {
+			off = written * WRITE_SIZE;
+			buflen = len - off < WRITE_SIZE ? len - off : WRITE_SIZE;
+			err = usb_finish(xfers[written++ % WRITE_PIPE], &amount);
+			if (err < 0 || amount != (int)buflen) {
+				applog(LOG_ERR, "%s%u: Program failed (%d:%d) at %lu",
+					modminer->drv->name, modminer->device_id, amount, err, off);
+
+				goto dame;
+			}
 		}
+
+		off = acked * WRITE_SIZE;
+		upload_progress(modminer, off < len ? off : len, len, &nextmsg);
 	}
 
-	if (!get_status(modminer, "final status", C_FINALPROGRAMSTATUS))
-		goto undame;
+	return true;
+dame:
+	// Wait for the writes still in flight
+	while (written < sent)
+		usb_finish(xfers[written++ % WRITE_PIPE], &amount);
+
+	mutex_unlock(modminer->modminer_mutex);
+
+	applog(LOG_ERR, "%s%u: Pipelined upload failed, try again without --mmq-pipeline",
+		modminer->drv->name, modminer->device_id);
+
+	return false;
+}
 
-	applog(LOG_WARNING, "%s%u: Programming completed for all FPGA on %s",
+// mutex must always be locked before calling, it is unlocked if it fails
+static bool modminer_fpga_upload_bitstream(struct thr_info *thr)
+{
+	struct cgpu_info *modminer = thr->cgpu;
+	struct modminer_fpga_state *state = thr->cgpu_data;
+	struct modminer_bitstream *bs;
+	struct timeval tv_start, tv_end;
+	char buf[6];
+	char devmsg[64];
+	unsigned long len;
+	char fpgaid = FPGAID_ALL;
+	int err, amount;
+	char *ptr;
+
+	bs = modminer_load_bitstream(modminer);
+	if (!bs) {
+		mutex_unlock(modminer->modminer_mutex);
+		return false;
+	}
+
+	len = bs->len;
+
+	strcpy(devmsg, modminer->device_path);
+	ptr = strrchr(devmsg, ':');
+	if (ptr)
+		*ptr = '\0';
+
+	applog(LOG_WARNING, "%s%u: Programming all FPGA on %s ... Mining will not start until complete",
 		modminer->drv->name, modminer->device_id, devmsg);
 
+	gettimeofday(&tv_start, NULL);
+
+	buf[0] = MODMINER_PROGRAM;
+	buf[1] = fpgaid;
+	buf[2] = (len >>  0) & 0xff;
+	buf[3] = (len >>  8) & 0xff;
+	buf[4] = (len >> 16) & 0xff;
+	buf[5] = (len >> 24) & 0xff;
+
+	if ((err = usb_write(modminer, buf, 6, &amount, C_STARTPROGRAM)) < 0 || amount != 6) {
+		mutex_unlock(modminer->modminer_mutex);
+
+		applog(LOG_ERR, "%s%u: Program init failed (%d:%d)",
+			modminer->drv->name, modminer->device_id, amount, err);
+
+		return false;
+	}
+
+	if (!get_status(modminer, "initialise", C_STARTPROGRAMSTATUS))
+		return false;
+
+	if (opt_mmq_pipeline) {
+		if (!upload_pipe(modminer, bs))
+			return false;
+	} else {
+		if (!upload_serial(modminer, bs))
+			return false;
+	}
+
+	if (!get_status(modminer, "final status", C_FINALPROGRAMSTATUS))
+		return false;
+
+	gettimeofday(&tv_end, NULL);
+	state->upload_time = tdiff(&tv_end, &tv_start);
+	state->upload_rate = state->upload_time > 0 ? (double)len / state->upload_time : 0;
+
+	applog(LOG_WARNING, "%s%u: Programming completed for all FPGA on %s in %.1fs (%.1fKB/s)",
+		modminer->drv->name, modminer->device_id, devmsg,
+		state->upload_time, state->upload_rate / 1024.0);
+
 	// Give it a 2/3s delay after programming
 	nmsleep(666);
 
 	return true;
-undame:
-	;
-	mutex_unlock(modminer->modminer_mutex);
-	;
-dame:
-	fclose(f);
-	return false;
 }
 
 static bool modminer_fpga_prepare(struct thr_info *thr)
@@ -677,9 +824,214 @@ static const char *modminer_delta_clock(struct thr_info *thr, int delta, bool te
 	return NULL;
 }
 
+/*
+ * --mmq-governor clocking, used instead of the share based rules above:
+ *	Each result is counted as good or a HW error at its clock, with the
+ *	counts decayed so they cover about the last MODMINER_GOV_WINDOW
+ *	results at that clock
+ *	The valid hash rate at a clock is the clock times its good fraction
+ *	A clock without MODMINER_GOV_MIN_RESULTS is expected to have the
+ *	same good fraction as the current clock
+ *
+ * After MODMINER_GOV_DWELL results at a clock:
+ *	Clock up if that is expected to be MODMINER_GOV_HYSTERESIS better
+ *		and temp < MODMINER_TEMP_UP_LIMIT and it's not above the
+ *		clock it last overheated at
+ *	Else clock down if that has been MODMINER_GOV_HYSTERESIS better
+ *	Else stay and save the clock as the best for that FPGA on the board,
+ *		and age the counts at every other clock so it will try them
+ *		again later
+ *
+ * Clock down straight away if the error rate reaches MODMINER_GOV_BAD_PERCENT
+ */
+#define MODMINER_GOV_STEPS ((MODMINER_MAX_CLOCK - MODMINER_MIN_CLOCK) / 2 + 1)
+#define MODMINER_GOV_WINDOW 64
+#define MODMINER_GOV_MIN_RESULTS 4.0
+#define MODMINER_GOV_DWELL 16
+#define MODMINER_GOV_HYSTERESIS 0.005
+#define MODMINER_GOV_AGE 0.9
+#define MODMINER_GOV_BAD_PERCENT 10.0
+
+// Best clocks are saved by board serial number and FPGA
+#define MODMINER_GOV_FILE "modminer.json"
+
+struct modminer_governor {
+	double good[MODMINER_GOV_STEPS];
+	double bad[MODMINER_GOV_STEPS];
+	// Results since the clock last changed or was chosen
+	int results;
+	int ceiling;
+	int best;
+};
+
+static pthread_mutex_t governor_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define gov_step(clock) (((clock) - MODMINER_MIN_CLOCK) / 2)
+
+static const char *governor_board(struct cgpu_info *modminer)
+{
+	const char *serial = modminer->usbdev->serial_string;
+
+	if (!serial || !*serial)
+		return NULL;
+
+	return serial;
+}
+
+static int governor_load(struct cgpu_info *modminer)
+{
+	char *path = alloca(PATH_MAX);
+	const char *board;
+	char fpga[8];
+	json_t *root;
+	int clock;
+
+	board = governor_board(modminer);
+	if (!board)
+		return 0;
+
+	sprintf(fpga, "%d", (int)(modminer->fpgaid));
+
+	mutex_lock(&governor_lock);
+	root = state_load(MODMINER_GOV_FILE, path);
+	clock = json_integer_value(json_object_get(json_object_get(root, board), fpga));
+	json_decref(root);
+	mutex_unlock(&governor_lock);
+
+	if (clock != 0 && (clock < MODMINER_MIN_CLOCK || clock > MODMINER_MAX_CLOCK || (clock & 1) != 0)) {
+		applog(LOG_WARNING, "%s%u: Ignoring invalid saved clock %d in %s",
+			modminer->drv->name, modminer->device_id, clock, path);
+
+		return 0;
+	}
+
+	return clock;
+}
+
+static void governor_save(struct cgpu_info *modminer, int clock)
+{
+	char *path = alloca(PATH_MAX);
+	const char *board;
+	char fpga[8];
+	json_t *root, *val;
+
+	board = governor_board(modminer);
+	if (!board)
+		return;
+
+	sprintf(fpga, "%d", (int)(modminer->fpgaid));
+
+	mutex_lock(&governor_lock);
+	root = state_load(MODMINER_GOV_FILE, path);
+	if (!root) {
+		mutex_unlock(&governor_lock);
+		return;
+	}
+	val = json_object_get(root, board);
+	if (!json_is_object(val)) {
+		val = json_object();
+		json_object_set_new(root, board, val);
+	}
+	json_object_set_new(val, fpga, json_integer(clock));
+	state_save(root, path);
+	json_decref(root);
+	mutex_unlock(&governor_lock);
+}
+
+// The valid MH/s expected at clock
+static double governor_rate(struct modminer_governor *gov, int clock, double good_frac)
+{
+	int step = gov_step(clock);
+	double total = gov->good[step] + gov->bad[step];
+
+	if (total < MODMINER_GOV_MIN_RESULTS)
+		return clock * good_frac;
+
+	return clock * gov->good[step] / total;
+}
+
+static void governor_age(struct modminer_governor *gov, int clock)
+{
+	int i;
+
+	gov->results = 0;
+	for (i = 0; i < MODMINER_GOV_STEPS; i++) {
+		if (i != gov_step(clock)) {
+			gov->good[i] *= MODMINER_GOV_AGE;
+			gov->bad[i] *= MODMINER_GOV_AGE;
+		}
+	}
+}
+
+static void modminer_governor(struct thr_info *thr, bool good)
+{
+	struct cgpu_info *modminer = thr->cgpu;
+	struct modminer_fpga_state *state = thr->cgpu_data;
+	struct modminer_governor *gov = state->governor;
+	int clock = modminer->clock;
+	double total, good_frac, rate, up, down;
+	int step, delta;
+
+	if (clock < MODMINER_MIN_CLOCK || clock > MODMINER_MAX_CLOCK)
+		return;
+
+	step = gov_step(clock);
+	gov->good[step] *= 1.0 - 1.0 / MODMINER_GOV_WINDOW;
+	gov->bad[step] *= 1.0 - 1.0 / MODMINER_GOV_WINDOW;
+	if (good)
+		gov->good[step]++;
+	else
+		gov->bad[step]++;
+	gov->results++;
+
+	total = gov->good[step] + gov->bad[step];
+	good_frac = gov->good[step] / total;
+
+	if (total >= MODMINER_GOV_MIN_RESULTS && clock > MODMINER_MIN_CLOCK &&
+	    (1.0 - good_frac) * 100.0 >= MODMINER_GOV_BAD_PERCENT) {
+		delta = MODMINER_CLOCK_DOWN;
+		goto change;
+	}
+
+	if (gov->results < MODMINER_GOV_DWELL)
+		return;
+
+	rate = clock * good_frac;
+
+	up = 0;
+	if (clock < MODMINER_MAX_CLOCK && clock < gov->ceiling &&
+	    modminer->temp < MODMINER_TEMP_UP_LIMIT)
+		up = governor_rate(gov, clock + 2, good_frac);
+
+	down = 0;
+	if (clock > MODMINER_MIN_CLOCK)
+		down = governor_rate(gov, clock - 2, 0);
+
+	if (up > rate * (1.0 + MODMINER_GOV_HYSTERESIS))
+		delta = MODMINER_CLOCK_UP;
+	else if (down > rate * (1.0 + MODMINER_GOV_HYSTERESIS))
+		delta = MODMINER_CLOCK_DOWN;
+	else {
+		governor_age(gov, clock);
+		if (clock != gov->best) {
+			gov->best = clock;
+			applog(LOG_WARNING, "%s%u: Governor chose clock %d (%.1fMH/s valid)",
+				modminer->drv->name, modminer->device_id, clock, rate);
+			governor_save(modminer, clock);
+		}
+		return;
+	}
+
+change:
+	// If it can't change now, it will try again on the next result
+	if (!modminer_delta_clock(thr, delta, false, false))
+		gov->results = 0;
+}
+
 static bool modminer_fpga_init(struct thr_info *thr)
 {
 	struct cgpu_info *modminer = thr->cgpu;
+	struct modminer_fpga_state *state = thr->cgpu_data;
 	unsigned char cmd[2], buf[4];
 	int err, amount;
 
@@ -709,7 +1061,7 @@ static bool modminer_fpga_init(struct thr_info *thr)
 		applog(LOG_ERR, "%s%u: FPGA not programmed",
 			modminer->drv->name, modminer->device_id);
 
-		if (!modminer_fpga_upload_bitstream(modminer))
+		if (!modminer_fpga_upload_bitstream(thr))
 			return false;
 
 		mutex_unlock(modminer->modminer_mutex);
@@ -721,6 +1073,24 @@ static bool modminer_fpga_init(struct thr_info *thr)
 	}
 
 	modminer->clock = MODMINER_DEF_CLOCK;
+	if (opt_mmq_governor) {
+		int clock;
+
+		state->governor = calloc(1, sizeof(*(state->governor)));
+		if (unlikely(!state->governor))
+			quit(1, "Failed to calloc modminer governor");
+		state->governor->ceiling = MODMINER_MAX_CLOCK;
+
+		clock = governor_load(modminer);
+
+		if (clock) {
+			applog(LOG_WARNING, "%s%u: Starting at the governor's saved clock %d",
+				modminer->drv->name, modminer->device_id, clock);
+
+			modminer->clock = clock;
+			state->governor->best = clock;
+		}
+	}
 	modminer_delta_clock(thr, MODMINER_CLOCK_SET, false, false);
 
 	thr->primary_thread = true;
@@ -767,9 +1137,6 @@ static bool modminer_start_work(struct thr_info *thr)
 	mutex_lock(modminer->modminer_mutex);
 
 	if ((err = usb_write(modminer, (char *)(state->next_work_cmd), 46, &amount, C_SENDWORK)) < 0 || amount != 46) {
-// TODO: err = LIBUSB_ERROR_NO_DEVICE means the MMQ disappeared
-// - need to delete it and rescan for it? (after a delay?)
-// but check all (4) disappeared
 		mutex_unlock(modminer->modminer_mutex);
 
 		applog(LOG_ERR, "%s%u: Start work failed (%d:%d)",
@@ -832,6 +1199,10 @@ static void check_temperature(struct thr_info *thr)
 			}
 		}
 		else if (modminer->temp >= MODMINER_OVERHEAT_TEMP) {
+			// The governor won't clock above here again
+			if (state->governor && state->governor->ceiling > modminer->clock)
+				state->governor->ceiling = modminer->clock;
+
 			if (modminer->temp >= MODMINER_CUTOFF_TEMP) {
 				applog(LOG_WARNING, "%s%u: Hit thermal cutoff limit! (%.1f) at %.3f",
 					modminer->drv->name, modminer->device_id,
@@ -896,9 +1267,6 @@ static uint64_t modminer_process_results(struct thr_info *thr)
 	while (1) {
 		mutex_lock(modminer->modminer_mutex);
 		if ((err = usb_write(modminer, cmd, 2, &amount, C_REQUESTWORKSTATUS)) < 0 || amount != 2) {
-// TODO: err = LIBUSB_ERROR_NO_DEVICE means the MMQ disappeared
-// - need to delete it and rescan for it? (after a delay?)
-// but check all (4) disappeared
 			mutex_unlock(modminer->modminer_mutex);
 
 			// timeoutloop never resets so the timeouts can't
@@ -951,7 +1319,9 @@ static uint64_t modminer_process_results(struct thr_info *thr)
 					state->shares = 0;
 					state->shares_last_hw = 0;
 					state->hw_errors = 0;
-				} else {
+				} else if (state->governor)
+					modminer_governor(thr, false);
+				else {
 					state->shares_last_hw = state->shares;
 					if (modminer->clock > MODMINER_DEF_CLOCK || state->hw_errors > 1) {
 						float pct = (state->hw_errors * 100.0 / (state->shares ? : 1.0));
@@ -962,8 +1332,10 @@ static uint64_t modminer_process_results(struct thr_info *thr)
 			} else {
 				gettimeofday(&state->last_nonce, NULL);
 				state->death_stage_one = false;
+				if (state->governor)
+					modminer_governor(thr, true);
 				// If we've reached the required good shares in a row then clock up
-				if (((state->shares - state->shares_last_hw) >= state->shares_to_good) &&
+				else if (((state->shares - state->shares_last_hw) >= state->shares_to_good) &&
 						modminer->temp < MODMINER_TEMP_UP_LIMIT)
 					modminer_delta_clock(thr, MODMINER_CLOCK_UP, false, false);
 			}
@@ -1038,6 +1410,22 @@ tryagain:
 	return hashes;
 }
 
+/* If the MMQ was unplugged, each of its FPGA threads gets here and the
+ * first one gives up the USB device. They are all disabled and end, and
+ * stay listed for --usb-hotplug to start again if it comes back */
+static int64_t modminer_failed(struct thr_info *thr)
+{
+	struct cgpu_info *modminer = thr->cgpu;
+
+	if (usb_nodev(modminer)) {
+		applog(LOG_ERR, "%s%u: Unplugged",
+			modminer->drv->name, modminer->device_id);
+		usb_nodev_release(modminer);
+	}
+
+	return -1;
+}
+
 static int64_t modminer_scanhash(struct thr_info *thr, struct work *work, int64_t __maybe_unused max_nonce)
 {
 	struct modminer_fpga_state *state = thr->cgpu_data;
@@ -1071,7 +1459,7 @@ static int64_t modminer_scanhash(struct thr_info *thr, struct work *work, int64_
 	if (state->work_running) {
 		hashes = modminer_process_results(thr);
 		if (hashes == -1)
-			return hashes;
+			return modminer_failed(thr);
 
 		if (work_restart(thr)) {
 			state->work_running = false;
@@ -1082,7 +1470,7 @@ static int64_t modminer_scanhash(struct thr_info *thr, struct work *work, int64_
 
 	if (startwork) {
 		if (!modminer_start_work(thr))
-			return -1;
+			return modminer_failed(thr);
 		__copy_work(&state->running_work, work);
 	}
 
@@ -1098,8 +1486,28 @@ static void modminer_hw_error(struct thr_info *thr)
 	state->hw_errors++;
 }
 
+static struct api_data *modminer_api_stats(struct cgpu_info *modminer)
+{
+	struct api_data *root = NULL;
+	struct modminer_fpga_state *state;
+
+	if (!modminer->thr || !modminer->thr[0] || !modminer->thr[0]->cgpu_data)
+		return NULL;
+
+	state = modminer->thr[0]->cgpu_data;
+	root = api_add_double(root, "Upload Time", &(state->upload_time), false);
+	root = api_add_double(root, "Upload Rate", &(state->upload_rate), false);
+	if (state->governor)
+		root = api_add_int(root, "Governor Clock", &(state->governor->best), false);
+
+	return root;
+}
+
 static void modminer_fpga_shutdown(struct thr_info *thr)
 {
+	struct modminer_fpga_state *state = thr->cgpu_data;
+
+	free(state->governor);
 	free(thr->cgpu_data);
 }
 
@@ -1146,6 +1554,7 @@ struct device_drv modminer_drv = {
 	.dname = "modminer",
 	.name = "MMQ",
 	.drv_detect = modminer_detect,
+	.get_api_stats = modminer_api_stats,
 	.get_statline_before = get_modminer_statline_before,
 	.set_device = modminer_set_device,
 	.thread_prepare = modminer_fpga_prepare,
@@ -32,6 +32,7 @@
 #include "findnonce.h"
 #include "ocl.h"
 #include "adl.h"
+#include "scrypt.h"
 
 /* TODO: cleanup externals ********************/
 
@@ -43,6 +44,8 @@ extern void enable_curses(void);
 extern int mining_threads;
 extern double total_secs;
 extern int opt_g_threads;
+extern bool opt_gpu_pipeline;
+extern int opt_gpu_autotune;
 extern bool ping;
 extern bool opt_loginput;
 extern char *opt_kernel_path;
@@ -251,6 +254,16 @@ char *set_kernel(char *arg)
 
 	return NULL;
 }
+
+char *set_kernel_cache(char *arg)
+{
+	if (strlen(arg) >= KERNEL_CACHE_DIR_MAX - 1)
+		return "Kernel cache path too long";
+
+	opt_set_charp(arg, &opt_kernel_cache);
+
+	return NULL;
+}
 #endif
 
 #ifdef HAVE_ADL
@@ -908,6 +921,11 @@ static cl_int queue_poclbm_kernel(_clState *clState, dev_blk_ctx *blk, cl_uint t
 	CL_SET_BLKARG(PreVal4addT1);
 	CL_SET_BLKARG(PreVal0);
 
+	CL_SET_BLKARG(merkle);
+	CL_SET_BLKARG(ntime);
+	CL_SET_BLKARG(nbits);
+	CL_SET_BLKARG(target);
+
 	CL_SET_ARG(clState->outputBuffer);
 
 	return status;
@@ -952,6 +970,11 @@ static cl_int queue_phatk_kernel(_clState *clState, dev_blk_ctx *blk,
 	CL_SET_BLKARG(PreW31);
 	CL_SET_BLKARG(PreW32);
 
+	CL_SET_BLKARG(merkle);
+	CL_SET_BLKARG(ntime);
+	CL_SET_BLKARG(nbits);
+	CL_SET_BLKARG(target);
+
 	CL_SET_ARG(clState->outputBuffer);
 
 	return status;
@@ -1013,6 +1036,11 @@ static cl_int queue_diakgcn_kernel(_clState *clState, dev_blk_ctx *blk,
 	CL_SET_BLKARG(sixA);
 	CL_SET_BLKARG(sevenA);
 
+	CL_SET_BLKARG(merkle);
+	CL_SET_BLKARG(ntime);
+	CL_SET_BLKARG(nbits);
+	CL_SET_BLKARG(target);
+
 	CL_SET_ARG(clState->outputBuffer);
 
 	return status;
@@ -1066,6 +1094,11 @@ static cl_int queue_diablo_kernel(_clState *clState, dev_blk_ctx *blk, cl_uint t
 	CL_SET_BLKARG(ctx_g);
 	CL_SET_BLKARG(ctx_h);
 
+	CL_SET_BLKARG(merkle);
+	CL_SET_BLKARG(ntime);
+	CL_SET_BLKARG(nbits);
+	CL_SET_BLKARG(target);
+
 	CL_SET_ARG(clState->outputBuffer);
 
 	return status;
@@ -1295,13 +1328,437 @@ static void get_opencl_statline(char *buf, struct cgpu_info *gpu)
 	tailsprintf(buf, " I:%2d", gpu->intensity);
 }
 
+typedef cl_int (*queue_kernel_func_t)(_clState *, dev_blk_ctx *, cl_uint);
+
+static queue_kernel_func_t queue_kernel_func(enum cl_kernels kernel)
+{
+	switch (kernel) {
+		case KL_POCLBM:
+			return &queue_poclbm_kernel;
+		case KL_PHATK:
+			return &queue_phatk_kernel;
+		case KL_DIAKGCN:
+			return &queue_diakgcn_kernel;
+#ifdef USE_SCRYPT
+		case KL_SCRYPT:
+			return &queue_scrypt_kernel;
+#endif
+		default:
+		case KL_DIABLO:
+			return &queue_diablo_kernel;
+	}
+}
+
+static char *kernel_name(enum cl_kernels kernel)
+{
+	switch (kernel) {
+		case KL_DIABLO:
+			return "diablo";
+		case KL_DIAKGCN:
+			return "diakgcn";
+		case KL_PHATK:
+			return "phatk";
+#ifdef USE_SCRYPT
+		case KL_SCRYPT:
+			return "scrypt";
+#endif
+		case KL_POCLBM:
+			return "poclbm";
+		default:
+			return NULL;
+	}
+}
+
 struct opencl_thread_data {
-	cl_int (*queue_kernel_parameters)(_clState *, dev_blk_ctx *, cl_uint);
+	queue_kernel_func_t queue_kernel_parameters;
 	uint32_t *res;
+
+	/* With --gpu-pipeline the previous launch is still in flight when
+	 * the next one is queued. It wrote to pipe_buf, is being read into
+	 * pipe_res and completes pipe_event. ready_event is the clear of the
+	 * buffer the next launch will write to, if one was queued. */
+	uint32_t *pipe_res;
+	cl_mem pipe_buf;
+	cl_event pipe_event;
+	cl_event ready_event;
+	struct work *pipe_work;
 };
 
 static uint32_t *blank_res;
 
+static void *build_kernel_thread(void *userdata)
+{
+	struct cgpu_info *cgpu = (struct cgpu_info *)userdata;
+	char name[256];
+	_clState *clState;
+
+	clState = initCl(cgpu->virtual_gpu, name, sizeof(name));
+	if (clState)
+		releaseCl(clState);
+
+	return NULL;
+}
+
+/* Kernel builds are slow and were done one GPU at a time as each thread
+ * started. Build every GPU's kernel at once up front instead, so that a
+ * cold start costs about one build and the threads all find their
+ * binaries in the cache. */
+static void build_kernels(void)
+{
+	pthread_t pth[MAX_GPUDEVICES];
+	bool started[MAX_GPUDEVICES];
+	int i;
+
+	for (i = 0; i < nDevs; i++) {
+		started[i] = false;
+		if (gpus[i].deven == DEV_DISABLED)
+			continue;
+		if (pthread_create(&pth[i], NULL, build_kernel_thread, (void *)&gpus[i]))
+			applog(LOG_DEBUG, "Failed to create kernel build thread for GPU %d", i);
+		else
+			started[i] = true;
+	}
+	for (i = 0; i < nDevs; i++) {
+		if (started[i])
+			pthread_join(pth[i], NULL);
+	}
+}
+
+/* Tuned settings are kept with the kernel binaries, keyed on the device,
+ * driver and kernel they were tuned for */
+static void autotune_identity(_clState *clState, const char *name, char *ident)
+{
+	char driver[256];
+
+	if (clGetDeviceInfo(clState->device, CL_DRIVER_VERSION, sizeof(driver), driver, NULL) != CL_SUCCESS)
+		strcpy(driver, "");
+	sprintf(ident, "%.255s %.255s %s", name, driver, kernel_name(clState->chosen_kernel));
+}
+
+static json_t *autotune_load_file(char *path)
+{
+	json_error_t err;
+	json_t *root;
+
+	kernel_cache_dir(path);
+	strcat(path, "autotune.json");
+#if JANSSON_MAJOR_VERSION > 1
+	root = json_load_file(path, 0, &err);
+#else
+	root = json_load_file(path, &err);
+#endif
+	if (root && !json_is_object(root)) {
+		json_decref(root);
+		root = NULL;
+	}
+	return root;
+}
+
+static bool autotune_load(struct cgpu_info *cgpu, const char *ident)
+{
+	char *path = alloca(PATH_MAX);
+	int vectors, worksize, intensity;
+	json_t *root, *val;
+	bool ret = false;
+
+	root = autotune_load_file(path);
+	if (!root)
+		return false;
+	val = json_object_get(root, ident);
+	if (!json_is_object(val))
+		goto out;
+
+	vectors = json_integer_value(json_object_get(val, "vectors"));
+	worksize = json_integer_value(json_object_get(val, "worksize"));
+	intensity = json_integer_value(json_object_get(val, "intensity"));
+	if ((vectors != 1 && vectors != 2 && vectors != 4) || worksize < 1 || worksize > 9999 ||
+	    intensity < MIN_INTENSITY || intensity > MAX_INTENSITY) {
+		applog(LOG_WARNING, "Ignoring invalid tuned settings for %s in %s", ident, path);
+		goto out;
+	}
+	cgpu->vwidth = vectors;
+	cgpu->work_size = worksize;
+	cgpu->intensity = intensity;
+	cgpu->dynamic = false;
+#ifdef USE_SCRYPT
+	if (opt_scrypt)
+		cgpu->opt_lg = json_integer_value(json_object_get(val, "lookup-gap"));
+#endif
+	ret = true;
+out:
+	json_decref(root);
+	return ret;
+}
+
+static void autotune_save(struct cgpu_info *cgpu, const char *ident)
+{
+	char *path = alloca(PATH_MAX), *tmppath = alloca(PATH_MAX + 8);
+	json_t *root, *val;
+
+	root = autotune_load_file(path);
+	if (!root)
+		root = json_object();
+	val = json_object();
+	json_object_set_new(val, "vectors", json_integer(cgpu->vwidth));
+	json_object_set_new(val, "worksize", json_integer(cgpu->work_size));
+	json_object_set_new(val, "intensity", json_integer(cgpu->intensity));
+#ifdef USE_SCRYPT
+	if (opt_scrypt)
+		json_object_set_new(val, "lookup-gap", json_integer(cgpu->opt_lg));
+#endif
+	json_object_set_new(root, ident, val);
+
+	sprintf(tmppath, "%s.tmp", path);
+	if (json_dump_file(root, tmppath, JSON_INDENT(1)) || rename(tmppath, path))
+		applog(LOG_WARNING, "Unable to save tuned settings to %s", path);
+	json_decref(root);
+}
+
+#define AUTOTUNE_RUNS 3
+
+/* Time AUTOTUNE_RUNS kernel launches at an intensity, after one to warm
+ * up, returning the hash rate and the time each launch took in us */
+static double autotune_rate(_clState *clState, queue_kernel_func_t queue_kernel,
+			    dev_blk_ctx *blk, int *intensity, double *launch_us)
+{
+	size_t globalThreads[1];
+	size_t localThreads[1] = { clState->wsize };
+	size_t global_work_offset[1];
+	struct timeval tv_start, tv_end;
+	int64_t hashes;
+	cl_int status;
+	int i;
+
+	set_threads_hashes(clState->vwidth, &hashes, globalThreads, localThreads[0], intensity);
+	for (i = 0; i <= AUTOTUNE_RUNS; i++) {
+		if (i == 1)
+			gettimeofday(&tv_start, NULL);
+		status = queue_kernel(clState, blk, globalThreads[0]);
+		if (unlikely(status != CL_SUCCESS))
+			return -1;
+		global_work_offset[0] = blk->nonce;
+		status = clEnqueueNDRangeKernel(clState->commandQueue, clState->kernel, 1,
+						clState->goffset ? global_work_offset : NULL,
+						globalThreads, localThreads, 0, NULL, NULL);
+		if (unlikely(status != CL_SUCCESS))
+			return -1;
+		clFinish(clState->commandQueue);
+		blk->nonce += hashes;
+	}
+	gettimeofday(&tv_end, NULL);
+
+	*launch_us = us_tdiff(&tv_end, &tv_start) / AUTOTUNE_RUNS;
+	if (*launch_us <= 0)
+		*launch_us = 1;
+	return hashes / *launch_us * 1000000;
+}
+
+// The one nonce of the benchmark block that meets its share target
+#define AUTOTUNE_BENCH_NONCE 0xef8b187d
+#define AUTOTUNE_SCRYPT_LAUNCHES 16
+
+static void autotune_blk(struct work *work)
+{
+#ifdef USE_SCRYPT
+	if (opt_scrypt)
+		work->blk.work = work;
+	else
+#endif
+		precalc_hash(&work->blk, (uint32_t *)(work->midstate), (uint32_t *)(work->data + 64));
+	work->blk.target = *(cl_uint *)(work->target + 24);
+}
+
+/* Check the tuned setting really finds nonces before it is saved. sha256
+ * must find the benchmark block's share in the launch that covers it, and
+ * every scrypt nonce found against an easy target must hash below it. */
+static bool autotune_verify(struct cgpu_info *cgpu, int intensity)
+{
+	size_t globalThreads[1], localThreads[1], global_work_offset[1];
+	queue_kernel_func_t queue_kernel;
+	uint32_t res[MAXBUFFERS];
+	bool found = false, ret = false;
+	_clState *clState;
+	char name[256];
+	struct work work;
+	int64_t hashes;
+	cl_int status;
+	int launch;
+	cl_uint i;
+
+	clState = initCl(cgpu->virtual_gpu, name, sizeof(name));
+	if (!clState)
+		return false;
+
+	get_benchmark_work(&work);
+	if (opt_scrypt)
+		((uint32_t *)work.target)[7] = 0x00ffffff;
+	autotune_blk(&work);
+	localThreads[0] = clState->wsize;
+	set_threads_hashes(clState->vwidth, &hashes, globalThreads, localThreads[0], &intensity);
+	work.blk.nonce = opt_scrypt ? 0 : AUTOTUNE_BENCH_NONCE & ~(uint32_t)(hashes - 1);
+	queue_kernel = queue_kernel_func(clState->chosen_kernel);
+
+	for (launch = 0; launch < (opt_scrypt ? AUTOTUNE_SCRYPT_LAUNCHES : 1) && !found; launch++) {
+		status = clEnqueueWriteBuffer(clState->commandQueue, clState->outputBuffer, CL_TRUE, 0,
+					      BUFFERSIZE, blank_res, 0, NULL, NULL);
+		if (status == CL_SUCCESS)
+			status = queue_kernel(clState, &work.blk, globalThreads[0]);
+		global_work_offset[0] = work.blk.nonce;
+		if (status == CL_SUCCESS)
+			status = clEnqueueNDRangeKernel(clState->commandQueue, clState->kernel, 1,
+							clState->goffset ? global_work_offset : NULL,
+							globalThreads, localThreads, 0, NULL, NULL);
+		if (status == CL_SUCCESS)
+			status = clEnqueueReadBuffer(clState->commandQueue, clState->outputBuffer, CL_TRUE, 0,
+						     BUFFERSIZE, res, 0, NULL, NULL);
+		if (unlikely(status != CL_SUCCESS))
+			goto out;
+		work.blk.nonce += hashes;
+
+		if (res[FOUND] & ~FOUND)
+			goto out;
+		for (i = 0; i < res[FOUND]; i++) {
+			if (opt_scrypt) {
+				if (!scrypt_test(work.data, work.target, res[i]))
+					goto out;
+				found = true;
+			} else if (res[i] == AUTOTUNE_BENCH_NONCE)
+				found = true;
+		}
+	}
+	ret = found;
+out:
+	releaseCl(clState);
+	return ret;
+}
+
+/* Try each vector width and worksize, and lookup gap for scrypt, on the
+ * benchmark block, raising the intensity until a launch takes longer than
+ * --gpu-autotune ms. The fastest setting found is used and saved so the
+ * next start with the same device, driver and kernel skips the sweep. */
+static void opencl_autotune(struct cgpu_info *cgpu)
+{
+	static const int vectors[] = { 1, 2, 4 };
+	static const int worksizes[] = { 64, 128, 256 };
+	const double budget_us = opt_gpu_autotune * 1000;
+	const cl_uint orig_vwidth = cgpu->vwidth;
+	const size_t orig_work_size = cgpu->work_size;
+	int best_v = 0, best_w = 0, best_i = 0, __maybe_unused best_lg = 0;
+	int nvectors = 3, ngaps = 1, candidates, c;
+	char name[256], ident[800];
+	double best_rate = 0;
+	_clState *clState;
+	struct work work;
+#ifdef USE_SCRYPT
+	const int orig_lg = cgpu->opt_lg;
+#endif
+
+	clState = initCl(cgpu->virtual_gpu, name, sizeof(name));
+	if (!clState)
+		return;
+	autotune_identity(clState, name, ident);
+	releaseCl(clState);
+
+	if (autotune_load(cgpu, ident)) {
+		applog(LOG_NOTICE, "GPU %d: using tuned vectors %d worksize %d intensity %d",
+		       cgpu->device_id, (int)cgpu->vwidth, (int)cgpu->work_size, cgpu->intensity);
+		return;
+	}
+
+	applog(LOG_NOTICE, "GPU %d: tuning for %s, this may take a while", cgpu->device_id, ident);
+	get_benchmark_work(&work);
+#ifdef USE_SCRYPT
+	if (opt_scrypt) {
+		nvectors = 1;
+		ngaps = 4;
+	}
+#endif
+
+	candidates = ngaps * nvectors * 3;
+	for (c = 0; c < candidates; c++) {
+		int lg = c / (nvectors * 3) + 1, v = c / 3 % nvectors, w = c % 3;
+		queue_kernel_func_t queue_kernel;
+		double rate, launch_us;
+		int intensity, max_intensity = MAX_INTENSITY;
+
+		cgpu->vwidth = vectors[v];
+		cgpu->work_size = worksizes[w];
+#ifdef USE_SCRYPT
+		if (opt_scrypt)
+			cgpu->opt_lg = lg;
+#endif
+		clState = initCl(cgpu->virtual_gpu, name, sizeof(name));
+		if (!clState)
+			continue;
+		/* Scrypt forces 1 vector and too large a worksize falls back
+		 * to the default, which would repeat another candidate */
+		if (clState->vwidth != (cl_uint)vectors[v] || clState->wsize != (size_t)worksizes[w]) {
+			releaseCl(clState);
+			continue;
+		}
+
+#ifdef USE_SCRYPT
+		/* More threads than thread_concurrency share scratchpads and
+		 * return wrong hashes, however fast they run */
+		if (opt_scrypt) {
+			for (max_intensity = 0; max_intensity < MAX_INTENSITY; max_intensity++) {
+				if ((2U << max_intensity) > cgpu->thread_concurrency)
+					break;
+			}
+		}
+#endif
+		autotune_blk(&work);
+		queue_kernel = queue_kernel_func(clState->chosen_kernel);
+		for (intensity = MIN_INTENSITY; intensity <= max_intensity; intensity++) {
+			rate = autotune_rate(clState, queue_kernel, &work.blk, &intensity, &launch_us);
+			if (rate < 0 || launch_us > budget_us || intensity > max_intensity)
+				break;
+			applog(LOG_DEBUG, "GPU %d: vectors %d worksize %d intensity %d: %.1f Mh/s, %.1f ms",
+			       cgpu->device_id, vectors[v], worksizes[w], intensity, rate / 1000000,
+			       launch_us / 1000);
+			if (rate > best_rate) {
+				best_rate = rate;
+				best_v = vectors[v];
+				best_w = worksizes[w];
+				best_i = intensity;
+				best_lg = lg;
+			}
+		}
+		releaseCl(clState);
+	}
+
+	if (!best_rate) {
+		applog(LOG_WARNING, "GPU %d: nothing ran within %d ms while tuning, keeping the defaults",
+		       cgpu->device_id, opt_gpu_autotune);
+		goto defaults;
+	}
+
+	cgpu->vwidth = best_v;
+	cgpu->work_size = best_w;
+#ifdef USE_SCRYPT
+	if (opt_scrypt)
+		cgpu->opt_lg = best_lg;
+#endif
+	if (!autotune_verify(cgpu, best_i)) {
+		applog(LOG_WARNING, "GPU %d: vectors %d worksize %d intensity %d does not find valid nonces, keeping the defaults",
+		       cgpu->device_id, best_v, best_w, best_i);
+		goto defaults;
+	}
+	cgpu->intensity = best_i;
+	cgpu->dynamic = false;
+	applog(LOG_NOTICE, "GPU %d: tuned to vectors %d worksize %d intensity %d at %.1f Mh/s",
+	       cgpu->device_id, best_v, best_w, best_i, best_rate / 1000000);
+	autotune_save(cgpu, ident);
+	return;
+
+defaults:
+	cgpu->vwidth = orig_vwidth;
+	cgpu->work_size = orig_work_size;
+#ifdef USE_SCRYPT
+	cgpu->opt_lg = orig_lg;
+#endif
+}
+
 static bool opencl_thread_prepare(struct thr_info *thr)
 {
 	char name[256];
@@ -1311,6 +1768,13 @@ static bool opencl_thread_prepare(struct thr_info *thr)
 	int virtual_gpu = cgpu->virtual_gpu;
 	int i = thr->id;
 	static bool failmessage = false;
+	static bool kernels_built = false;
+
+	if (!kernels_built) {
+		kernels_built = true;
+		if (nDevs > 1)
+			build_kernels();
+	}
 
 	if (!blank_res)
 		blank_res = calloc(BUFFERSIZE, 1);
@@ -1319,6 +1783,9 @@ static bool opencl_thread_prepare(struct thr_info *thr)
 		return false;
 	}
 
+	if (opt_gpu_autotune && !thr->device_thread)
+		opencl_autotune(cgpu);
+
 	strcpy(name, "");
 	applog(LOG_INFO, "Init GPU thread %i GPU %i virtual GPU %i", i, gpu, virtual_gpu);
 	clStates[i] = initCl(virtual_gpu, name, sizeof(name));
@@ -1351,29 +1818,7 @@ static bool opencl_thread_prepare(struct thr_info *thr)
 	if (!cgpu->name)
 		cgpu->name = strdup(name);
 	if (!cgpu->kname)
-	{
-		switch (clStates[i]->chosen_kernel) {
-			case KL_DIABLO:
-				cgpu->kname = "diablo";
-				break;
-			case KL_DIAKGCN:
-				cgpu->kname = "diakgcn";
-				break;
-			case KL_PHATK:
-				cgpu->kname = "phatk";
-				break;
-#ifdef USE_SCRYPT
-			case KL_SCRYPT:
-				cgpu->kname = "scrypt";
-				break;
-#endif
-			case KL_POCLBM:
-				cgpu->kname = "poclbm";
-				break;
-			default:
-				break;
-		}
-	}
+		cgpu->kname = kernel_name(clStates[i]->chosen_kernel);
 	applog(LOG_INFO, "initCl() finished. Found %s", name);
 	gettimeofday(&now, NULL);
 	get_datestamp(cgpu->init, &now);
@@ -1398,26 +1843,7 @@ static bool opencl_thread_init(struct thr_info *thr)
 		return false;
 	}
 
-	switch (clState->chosen_kernel) {
-		case KL_POCLBM:
-			thrdata->queue_kernel_parameters = &queue_poclbm_kernel;
-			break;
-		case KL_PHATK:
-			thrdata->queue_kernel_parameters = &queue_phatk_kernel;
-			break;
-		case KL_DIAKGCN:
-			thrdata->queue_kernel_parameters = &queue_diakgcn_kernel;
-			break;
-#ifdef USE_SCRYPT
-		case KL_SCRYPT:
-			thrdata->queue_kernel_parameters = &queue_scrypt_kernel;
-			break;
-#endif
-		default:
-		case KL_DIABLO:
-			thrdata->queue_kernel_parameters = &queue_diablo_kernel;
-			break;
-	}
+	thrdata->queue_kernel_parameters = queue_kernel_func(clState->chosen_kernel);
 
 	thrdata->res = calloc(BUFFERSIZE, 1);
 
@@ -1434,6 +1860,25 @@ static bool opencl_thread_init(struct thr_info *thr)
 		return false;
 	}
 
+	if (opt_gpu_pipeline) {
+		thrdata->pipe_res = calloc(BUFFERSIZE, 1);
+		if (!thrdata->pipe_res) {
+			applog(LOG_ERR, "Failed to calloc in opencl_thread_init");
+			return false;
+		}
+		thrdata->pipe_buf = clCreateBuffer(clState->context, CL_MEM_WRITE_ONLY, BUFFERSIZE, NULL, &status);
+		if (status != CL_SUCCESS) {
+			applog(LOG_ERR, "Error %d: clCreateBuffer (pipe_buf)", status);
+			return false;
+		}
+		status = clEnqueueWriteBuffer(clState->commandQueue, thrdata->pipe_buf, CL_TRUE, 0,
+				BUFFERSIZE, blank_res, 0, NULL, NULL);
+		if (unlikely(status != CL_SUCCESS)) {
+			applog(LOG_ERR, "Error: clEnqueueWriteBuffer failed.");
+			return false;
+		}
+	}
+
 	gpu->status = LIFE_WELL;
 
 	gpu->device_last_well = time(NULL);
@@ -1450,11 +1895,45 @@ static bool opencl_prepare_work(struct thr_info __maybe_unused *thr, struct work
 	else
 #endif
 		precalc_hash(&work->blk, (uint32_t *)(work->midstate), (uint32_t *)(work->data + 64));
+	/* Only nonces meeting the share target are sent back by the kernels */
+	work->blk.target = *(cl_uint *)(work->target + 24);
 	return true;
 }
 
 extern int opt_dynamic_interval;
 
+/* Wait for the launch in flight to be read back and hand on anything it
+ * found. Its buffer gets cleared behind the launch just queued, and the
+ * clear becomes the event the next launch into that buffer waits on. */
+static bool opencl_pipe_collect(struct thr_info *thr, struct opencl_thread_data *thrdata,
+				_clState *clState)
+{
+	cl_int status;
+
+	status = clWaitForEvents(1, &thrdata->pipe_event);
+	clReleaseEvent(thrdata->pipe_event);
+	thrdata->pipe_event = NULL;
+	if (unlikely(status != CL_SUCCESS)) {
+		applog(LOG_ERR, "Error %d: Waiting for GPU results. (clWaitForEvents)", status);
+		return false;
+	}
+
+	if (thrdata->pipe_res[FOUND]) {
+		status = clEnqueueWriteBuffer(clState->commandQueue, thrdata->pipe_buf, CL_FALSE, 0,
+				BUFFERSIZE, blank_res, 0, NULL, &thrdata->ready_event);
+		if (unlikely(status != CL_SUCCESS)) {
+			applog(LOG_ERR, "Error: clEnqueueWriteBuffer failed.");
+			return false;
+		}
+		clFlush(clState->commandQueue);
+		applog(LOG_DEBUG, "GPU %d found something?", thr->cgpu->device_id);
+		postcalc_hash_async(thr, thrdata->pipe_work, thrdata->pipe_res);
+		memset(thrdata->pipe_res, 0, BUFFERSIZE);
+	}
+
+	return true;
+}
+
 static int64_t opencl_scanhash(struct thr_info *thr, struct work *work,
 				int64_t __maybe_unused max_nonce)
 {
@@ -1469,6 +1948,9 @@ static int64_t opencl_scanhash(struct thr_info *thr, struct work *work,
 	size_t globalThreads[1];
 	size_t localThreads[1] = { clState->wsize };
 	int64_t hashes;
+	cl_event ready_event = thrdata->ready_event;
+	cl_event kernel_event = NULL;
+	cl_event read_event = NULL;
 
 	/* Windows' timer resolution is only 15ms so oversample 5x */
 	if (gpu->dynamic && (++gpu->intervals * dynamic_us) > 70000) {
@@ -1503,15 +1985,62 @@ static int64_t opencl_scanhash(struct thr_info *thr, struct work *work,
 
 		global_work_offset[0] = work->blk.nonce;
 		status = clEnqueueNDRangeKernel(clState->commandQueue, *kernel, 1, global_work_offset,
-						globalThreads, localThreads, 0,  NULL, NULL);
+						globalThreads, localThreads, ready_event ? 1 : 0,
+						ready_event ? &ready_event : NULL,
+						thrdata->pipe_buf ? &kernel_event : NULL);
 	} else
 		status = clEnqueueNDRangeKernel(clState->commandQueue, *kernel, 1, NULL,
-						globalThreads, localThreads, 0,  NULL, NULL);
+						globalThreads, localThreads, ready_event ? 1 : 0,
+						ready_event ? &ready_event : NULL,
+						thrdata->pipe_buf ? &kernel_event : NULL);
+	if (ready_event) {
+		clReleaseEvent(ready_event);
+		thrdata->ready_event = NULL;
+	}
 	if (unlikely(status != CL_SUCCESS)) {
 		applog(LOG_ERR, "Error %d: Enqueueing kernel onto command queue. (clEnqueueNDRangeKernel)", status);
 		return -1;
 	}
 
+	if (thrdata->pipe_buf) {
+		uint32_t *res;
+		cl_mem buf;
+
+		/* The command queue may be out of order so the read has to
+		 * wait on the kernel explicitly */
+		status = clEnqueueReadBuffer(clState->commandQueue, clState->outputBuffer, CL_FALSE, 0,
+				BUFFERSIZE, thrdata->res, 1, &kernel_event, &read_event);
+		clReleaseEvent(kernel_event);
+		if (unlikely(status != CL_SUCCESS)) {
+			applog(LOG_ERR, "Error: clEnqueueReadBuffer failed error %d. (clEnqueueReadBuffer)", status);
+			return -1;
+		}
+		clFlush(clState->commandQueue);
+		work->blk.nonce += gpu->max_hashes;
+
+		/* The GPU now has this launch to work on while the results of
+		 * the previous one are checked */
+		if (thrdata->pipe_event && !opencl_pipe_collect(thr, thrdata, clState)) {
+			clReleaseEvent(read_event);
+			return -1;
+		}
+
+		/* This launch is now the one in flight, and the next one goes
+		 * into the buffer just collected */
+		thrdata->pipe_event = read_event;
+		res = thrdata->res;
+		thrdata->res = thrdata->pipe_res;
+		thrdata->pipe_res = res;
+		buf = clState->outputBuffer;
+		clState->outputBuffer = thrdata->pipe_buf;
+		thrdata->pipe_buf = buf;
+		if (thrdata->pipe_work)
+			free_work(thrdata->pipe_work);
+		thrdata->pipe_work = copy_work(work);
+
+		return hashes;
+	}
+
 	status = clEnqueueReadBuffer(clState->commandQueue, clState->outputBuffer, CL_FALSE, 0,
 			BUFFERSIZE, thrdata->res, 0, NULL, NULL);
 	if (unlikely(status != CL_SUCCESS)) {
@@ -1550,7 +2079,20 @@ static void opencl_thread_shutdown(struct thr_info *thr)
 {
 	const int thr_id = thr->id;
 	_clState *clState = clStates[thr_id];
+	struct opencl_thread_data *thrdata = thr->cgpu_data;
 
+	if (thrdata && thrdata->pipe_buf) {
+		if (thrdata->pipe_event) {
+			clWaitForEvents(1, &thrdata->pipe_event);
+			clReleaseEvent(thrdata->pipe_event);
+		}
+		if (thrdata->ready_event)
+			clReleaseEvent(thrdata->ready_event);
+		clReleaseMemObject(thrdata->pipe_buf);
+		if (thrdata->pipe_work)
+			free_work(thrdata->pipe_work);
+		free(thrdata->pipe_res);
+	}
 	clReleaseCommandQueue(clState->commandQueue);
 	clReleaseKernel(clState->kernel);
 	clReleaseProgram(clState->program);
@@ -24,11 +24,14 @@ extern char *set_lookup_gap(char *arg);
 extern char *set_thread_concurrency(char *arg);
 #endif
 extern char *set_kernel(char *arg);
+extern char *set_kernel_cache(char *arg);
 void manage_gpu(void);
 extern void pause_dynamic_threads(int gpu);
 
 extern bool have_opencl;
 extern int opt_platform_id;
+extern char *opt_kernel_cache;
+extern bool opt_opencl_cpu;
 
 extern struct device_drv opencl_drv;
 
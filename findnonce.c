@@ -173,7 +173,7 @@ void precalc_hash(dev_blk_ctx *blk, uint32_t *state, uint32_t *data)
 
 struct pc_data {
 	struct thr_info *thr;
-	struct work work;
+	struct work *work;
 	uint32_t res[MAXBUFFERS];
 	pthread_t pth;
 	int found;
@@ -182,10 +182,10 @@ struct pc_data {
 static void send_scrypt_nonce(struct pc_data *pcd, uint32_t nonce)
 {
 	struct thr_info *thr = pcd->thr;
-	struct work *work = &pcd->work;
+	struct work *work = pcd->work;
 
 	if (scrypt_test(work->data, work->target, nonce))
-		submit_nonce(thr, &pcd->work, nonce);
+		submit_nonce(thr, work, nonce);
 	else {
 		applog(LOG_INFO, "Scrypt error, review settings");
 		thr->cgpu->hw_errors++;
@@ -197,6 +197,8 @@ static void *postcalc_hash(void *userdata)
 	struct pc_data *pcd = (struct pc_data *)userdata;
 	struct thr_info *thr = pcd->thr;
 	unsigned int entry = 0;
+	uint32_t nonces[FOUND];
+	int found = 0;
 
 	pthread_detach(pthread_self());
 
@@ -217,9 +219,15 @@ static void *postcalc_hash(void *userdata)
 		if (opt_scrypt)
 			send_scrypt_nonce(pcd, nonce);
 		else
-			submit_nonce(thr, &pcd->work, nonce);
+			nonces[found++] = nonce;
 	}
+	/* The kernels only return nonces with H6 at or below word 6 of the
+	 * share target, so each one stands for 2^32 / (target + 1) of the
+	 * H7 == 0 nonces counted as diff1 shares */
+	submit_nonces_diff1(thr, pcd->work, nonces, found,
+			    4294967296.0 / ((double)pcd->work->blk.target + 1.0));
 
+	free_work(pcd->work);
 	free(pcd);
 
 	return NULL;
@@ -234,11 +242,15 @@ void postcalc_hash_async(struct thr_info *thr, struct work *work, uint32_t *res)
 	}
 
 	pcd->thr = thr;
-	memcpy(&pcd->work, work, sizeof(struct work));
+	/* The caller may free or reuse its work before this thread is done,
+	 * so the thread gets a deep copy of its own */
+	pcd->work = copy_work(work);
 	memcpy(&pcd->res, res, BUFFERSIZE);
 
 	if (pthread_create(&pcd->pth, NULL, postcalc_hash, (void *)pcd)) {
 		applog(LOG_ERR, "Failed to create postcalc_hash thread");
+		free_work(pcd->work);
+		free(pcd);
 		return;
 	}
 }
@@ -23,6 +23,11 @@
 #ifndef O_CLOEXEC
 #define O_CLOEXEC 0
 #endif
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
 #else
 #include <windows.h>
 #include <io.h>
@@ -104,16 +109,43 @@ int serial_autodetect_devserial(__maybe_unused detectone_func_t detectone, __may
 #endif
 }
 
+struct serial_detect_job {
+	detectone_func_t detectone;
+	struct string_elist **iters;
+	const char **devs;
+	bool *found;
+};
+
+static void serial_detect_one(int i, void *arg)
+{
+	struct serial_detect_job *sdj = arg;
+
+	sdj->found[i] = sdj->detectone(sdj->devs[i]);
+}
+
 int _serial_detect(struct device_drv *drv, detectone_func_t detectone, autoscan_func_t autoscan, bool forceauto)
 {
-	struct string_elist *iter, *tmp;
+	struct serial_detect_job sdj;
+	struct string_elist *iter;
 	const char *dev, *colon;
 	bool inhibitauto = false;
 	char found = 0;
 	size_t namel = strlen(drv->name);
 	size_t dnamel = strlen(drv->dname);
+	int i, count = 0;
+
+	list_for_each_entry(iter, &scan_devices, list)
+		count++;
 
-	list_for_each_entry_safe(iter, tmp, &scan_devices, list) {
+	sdj.detectone = detectone;
+	sdj.iters = calloc(count + 1, sizeof(*sdj.iters));
+	sdj.devs = calloc(count + 1, sizeof(*sdj.devs));
+	sdj.found = calloc(count + 1, sizeof(*sdj.found));
+	if (unlikely(!sdj.iters || !sdj.devs || !sdj.found))
+		quit(1, "Failed to calloc serial detect");
+
+	count = 0;
+	list_for_each_entry(iter, &scan_devices, list) {
 		dev = iter->string;
 		if ((colon = strchr(dev, ':')) && colon[1] != '\0') {
 			size_t idlen = colon - dev;
@@ -129,12 +161,25 @@ int _serial_detect(struct device_drv *drv, detectone_func_t detectone, autoscan_
 			forceauto = true;
 		else if (!strcmp(dev, "noauto"))
 			inhibitauto = true;
-		else if (detectone(dev)) {
-			string_elist_del(iter);
+		else {
+			sdj.iters[count] = iter;
+			sdj.devs[count++] = dev;
+		}
+	}
+
+	// Each device can take seconds to test, so try them all at once
+	detect_parallel(count, serial_detect_one, &sdj);
+
+	for (i = 0; i < count; i++)
+		if (sdj.found[i]) {
+			string_elist_del(sdj.iters[i]);
 			inhibitauto = true;
 			++found;
 		}
-	}
+
+	free(sdj.found);
+	free(sdj.devs);
+	free(sdj.iters);
 
 	if ((forceauto || !inhibitauto) && autoscan)
 		found += autoscan();
@@ -569,4 +614,162 @@ size_t _select_write(int fd, char *buf, size_t siz, struct timeval *timeout)
 	return wrote;
 }
 
+static LIST_HEAD(serial_evs);
+static pthread_mutex_t serial_ev_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t serial_ev_thread;
+static bool serial_ev_running = false;
+
+#ifdef HAVE_SYS_EPOLL_H
+// Most events handled per epoll_wait()
+#define SERIAL_EV_BATCH 64
+
+static int serial_ev_epfd = -1;
+#else
+static int serial_ev_count;
+#endif
+
+// ms until the next sweep or earliest deadline, whichever comes first
+static int serial_ev_wait_ms(struct timeval *next_sweep)
+{
+	struct timeval now, first, left;
+	struct serial_ev *ev;
+
+	first = *next_sweep;
+	mutex_lock(&serial_ev_lock);
+	list_for_each_entry(ev, &serial_evs, list) {
+		if (timercmp(&ev->deadline, &first, <))
+			first = ev->deadline;
+	}
+	mutex_unlock(&serial_ev_lock);
+
+	gettimeofday(&now, NULL);
+	if (!timercmp(&now, &first, <))
+		return 0;
+
+	timersub(&first, &now, &left);
+	return left.tv_sec * 1000 + (left.tv_usec + 999) / 1000;
+}
+
+static void serial_ev_wait(int ms)
+{
+	struct serial_ev *ev;
+	int i, n;
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event events[SERIAL_EV_BATCH];
+
+	n = epoll_wait(serial_ev_epfd, events, SERIAL_EV_BATCH, ms);
+	for (i = 0; i < n; i++) {
+		ev = events[i].data.ptr;
+		if (ev->fd >= 0)
+			ev->readable(ev);
+	}
+#else
+	// Only this thread uses these, so they can grow while nothing polls them
+	static struct pollfd *pfds;
+	static struct serial_ev **polled;
+	static int size;
+
+	mutex_lock(&serial_ev_lock);
+	if (size < serial_ev_count) {
+		size = serial_ev_count;
+		pfds = realloc(pfds, sizeof(*pfds) * size);
+		polled = realloc(polled, sizeof(*polled) * size);
+		if (unlikely(!pfds || !polled))
+			quit(1, "Failed to realloc serial poll list");
+	}
+	n = 0;
+	list_for_each_entry(ev, &serial_evs, list) {
+		if (ev->fd < 0)
+			continue;
+		pfds[n].fd = ev->fd;
+		pfds[n].events = POLLIN;
+		pfds[n].revents = 0;
+		polled[n++] = ev;
+	}
+	mutex_unlock(&serial_ev_lock);
+
+	if (poll(pfds, n, ms) <= 0)
+		return;
+
+	for (i = 0; i < n; i++) {
+		ev = polled[i];
+		if (pfds[i].revents && ev->fd == pfds[i].fd)
+			ev->readable(ev);
+	}
+#endif
+}
+
+static void *serial_ev_loop(__maybe_unused void *userdata)
+{
+	struct timeval now, next_sweep, sweep = { 0, SERIAL_EV_TICK_MS * 1000 };
+	struct serial_ev *ev;
+	bool all;
+
+	RenameThread("serialevents");
+
+	gettimeofday(&next_sweep, NULL);
+	while (42) {
+		serial_ev_wait(serial_ev_wait_ms(&next_sweep));
+
+		gettimeofday(&now, NULL);
+		all = !timercmp(&now, &next_sweep, <);
+		if (all)
+			timeradd(&now, &sweep, &next_sweep);
+
+		mutex_lock(&serial_ev_lock);
+		list_for_each_entry(ev, &serial_evs, list) {
+			if (all || !timercmp(&now, &ev->deadline, <))
+				ev->tick(ev);
+		}
+		mutex_unlock(&serial_ev_lock);
+	}
+
+	return NULL;
+}
+
+// Start running ev from the serial event thread, starting that if needed
+void serial_ev_add(struct serial_ev *ev)
+{
+	int fd = ev->fd;
+
+	mutex_lock(&serial_ev_lock);
+	if (!serial_ev_running) {
+#ifdef HAVE_SYS_EPOLL_H
+		serial_ev_epfd = epoll_create(SERIAL_EV_BATCH);
+		if (unlikely(serial_ev_epfd == -1))
+			quit(1, "Failed to create serial epoll fd");
+#endif
+		if (unlikely(pthread_create(&serial_ev_thread, NULL, serial_ev_loop, NULL)))
+			quit(1, "Failed to create serial events thread");
+		serial_ev_running = true;
+	}
+
+#ifndef HAVE_SYS_EPOLL_H
+	serial_ev_count++;
+#endif
+	ev->fd = -1;
+	serial_ev_set_fd(ev, fd);
+	list_add_tail(&ev->list, &serial_evs);
+	mutex_unlock(&serial_ev_lock);
+}
+
+/* Change the fd watched for ev, -1 for none. Must be called before the old
+ * fd is closed */
+void serial_ev_set_fd(struct serial_ev *ev, int fd)
+{
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event event;
+
+	event.events = EPOLLIN;
+	event.data.ptr = ev;
+	if (ev->fd >= 0)
+		epoll_ctl(serial_ev_epfd, EPOLL_CTL_DEL, ev->fd, &event);
+	if (fd >= 0 && unlikely(epoll_ctl(serial_ev_epfd, EPOLL_CTL_ADD, fd, &event))) {
+		applog(LOG_ERR, "Failed to add serial fd %d to epoll (%d)", fd, errno);
+		fd = -1;
+	}
+#endif
+	ev->fd = fd;
+}
+
 #endif // ! WIN32
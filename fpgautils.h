@@ -13,6 +13,8 @@
 #include <stdbool.h>
 #include <stdio.h>
 
+#include "elist.h"
+
 typedef bool(*detectone_func_t)(const char*);
 typedef int(*autoscan_func_t)();
 
@@ -77,6 +79,27 @@ extern size_t _select_write(int fd, char *buf, size_t siz, struct timeval *timeo
 
 #define select_close(fd)  close(fd)
 
+// How often the serial event thread calls every tick() regardless of deadline
+#define SERIAL_EV_TICK_MS 100
+
+/*
+ * A serial device run from the shared serial event thread rather than a
+ * miner thread of its own. readable() is called when fd has data (or an
+ * error) and tick() once deadline has passed, and otherwise at least every
+ * SERIAL_EV_TICK_MS. Both are only ever called from the event thread.
+ */
+struct serial_ev {
+	struct list_head list;
+	int fd;
+	struct timeval deadline;
+	void (*readable)(struct serial_ev *);
+	void (*tick)(struct serial_ev *);
+	void *data;
+};
+
+extern void serial_ev_add(struct serial_ev *ev);
+extern void serial_ev_set_fd(struct serial_ev *ev, int fd);
+
 #endif // ! WIN32
 
 #endif
@@ -720,9 +720,22 @@ void libztex_destroy_device(struct libztex_device* ztex)
 	free(ztex);
 }
 
+struct libztex_check {
+	libusb_device **list;
+	enum check_result *results;
+};
+
+static void libztex_check_one(int i, void *arg)
+{
+	struct libztex_check *lc = arg;
+
+	lc->results[i] = libztex_checkDevice(lc->list[i]);
+}
+
 int libztex_scanDevices(struct libztex_dev_list*** devs_p)
 {
 	int usbdevices[LIBZTEX_MAX_DESCRIPTORS];
+	struct libztex_check lc;
 	struct libztex_dev_list **devs = NULL;
 	struct libztex_device *ztex = NULL;
 	int found, max_found = 0, pos = 0, err, rescan, ret = 0;
@@ -736,8 +749,17 @@ int libztex_scanDevices(struct libztex_dev_list*** devs_p)
 			goto done;
 		}
 
+		// Uploading the firmware takes a while, so do them all at once
+		lc.list = list;
+		lc.results = calloc(cnt + 1, sizeof(*lc.results));
+		if (unlikely(!lc.results)) {
+			applog(LOG_ERR, "Ztex scan devices: Failed to allocate memory");
+			goto done;
+		}
+		detect_parallel((int)cnt, libztex_check_one, &lc);
+
 		for (found = rescan = i = 0; i < cnt; i++) {
-			err = libztex_checkDevice(list[i]);
+			err = lc.results[i];
 			switch (err) {
 			case CHECK_ERROR:
 				applog(LOG_ERR, "Ztex: Can not check device: %d", err);
@@ -754,6 +776,7 @@ int libztex_scanDevices(struct libztex_dev_list*** devs_p)
 				break;
 			}
 		}
+		free(lc.results);
 
 		if (found < max_found)
 			rescan = 1;
@@ -292,8 +292,10 @@ struct device_drv {
 
 	// Thread-specific functions
 	bool (*thread_prepare)(struct thr_info *);
+	bool (*thread_attach)(struct thr_info *); // true if run without a miner thread
 	uint64_t (*can_limit_work)(struct thr_info *);
 	bool (*thread_init)(struct thr_info *);
+	struct work *(*get_work)(struct thr_info *);
 	bool (*prepare_work)(struct thr_info *, struct work *);
 	int64_t (*scanhash)(struct thr_info *, struct work *, int64_t);
 	void (*hw_error)(struct thr_info *);
@@ -394,6 +396,8 @@ struct cgpu_info {
 	};
 #if defined(USE_MODMINER) || defined(USE_BITFORCE)
 	int usbstat;
+	// Gone, and its threads have ended or are about to
+	bool unplugged;
 #endif
 #ifdef USE_MODMINER
 	char fpgaid;
@@ -410,6 +414,8 @@ struct cgpu_info {
 	bool nonce_range;
 	bool polling;
 	bool flash_led;
+	// Jobs on the device with --bfl-queue, a copy for the API
+	int queued;
 	pthread_mutex_t device_mutex;
 #endif
 	enum dev_enable deven;
@@ -469,6 +475,8 @@ struct cgpu_info {
 	float gpu_vddc;
 #endif
 	int diff1;
+	// The part of a diff1 share not yet counted in diff1
+	double diff1_frac;
 	double diff_accepted;
 	double diff_rejected;
 	int last_share_pool;
@@ -493,6 +501,9 @@ struct cgpu_info {
 };
 
 extern bool add_cgpu(struct cgpu_info*);
+#if defined(USE_MODMINER) || defined(USE_BITFORCE)
+extern void hotplug_process(void);
+#endif
 
 struct thread_q {
 	struct list_head	q;
@@ -520,11 +531,20 @@ struct thr_info {
 	double	rolling;
 
 	bool	work_restart;
+
+	/* Hashes not yet passed to hashmeter() by thread_hashes() */
+	int64_t		hashes_done;
+	struct timeval	tv_lastupdate;
 };
 
 extern int thr_info_create(struct thr_info *thr, pthread_attr_t *attr, void *(*start) (void *), void *arg);
 extern void thr_info_cancel(struct thr_info *thr);
 extern void thr_info_freeze(struct thr_info *thr);
+extern void detect_parallel(int count, void (*job)(int, void *), void *arg);
+extern int detect_index(void);
+extern void detect_ordered(void);
+extern json_t *state_load(const char *name, char *path);
+extern bool state_save(json_t *root, const char *path);
 extern void nmsleep(unsigned int msecs);
 extern double us_tdiff(struct timeval *end, struct timeval *start);
 extern double tdiff(struct timeval *end, struct timeval *start);
@@ -689,12 +709,22 @@ extern bool opt_delaynet;
 extern bool opt_restart;
 extern char *opt_icarus_options;
 extern char *opt_icarus_timing;
+extern bool opt_icarus_pipeline;
+extern bool opt_icarus_events;
+extern int opt_icarus_sim;
 extern bool opt_worktime;
 #ifdef HAVE_LIBUSB
 extern int opt_usbdump;
+extern int opt_usb_latency;
+extern int opt_usb_hotplug;
 #endif
 #ifdef USE_BITFORCE
 extern bool opt_bfl_noncerange;
+extern bool opt_bfl_queue;
+#endif
+#ifdef USE_MODMINER
+extern bool opt_mmq_governor;
+extern bool opt_mmq_pipeline;
 #endif
 extern int swork_id;
 
@@ -706,6 +736,7 @@ extern json_t *json_rpc_call(CURL *curl, const char *url, const char *userpass,
 			     struct pool *pool, bool);
 extern const char *proxytype(curl_proxytype proxytype);
 extern char *get_proxy(char *url, struct pool *pool);
+extern void __bin2hex(char *s, const unsigned char *p, size_t len);
 extern char *bin2hex(const unsigned char *p, size_t len);
 extern bool hex2bin(unsigned char *p, const char *hexstr, size_t len);
 
@@ -722,6 +753,7 @@ extern bool fulltest(const unsigned char *hash, const unsigned char *target);
 extern int opt_queue;
 extern int opt_scantime;
 extern int opt_expiry;
+extern int opt_detect_threads;
 
 #ifdef HAVE_LIBUSB
 extern pthread_mutex_t cgusb_lock;
@@ -735,6 +767,9 @@ extern pthread_mutex_t restart_lock;
 extern pthread_cond_t restart_cond;
 
 extern void thread_reportin(struct thr_info *thr);
+extern void thread_reportout(struct thr_info *thr);
+extern void thread_hashes(struct thr_info *thr, int64_t hashes);
+extern struct work *get_work_nowait(struct thr_info *thr, const int thr_id);
 extern int restart_wait(unsigned int mstime);
 
 extern void kill_work(void);
@@ -818,6 +853,7 @@ typedef struct {
 	cl_uint cty_a; cl_uint cty_b; cl_uint cty_c; cl_uint cty_d;
 	cl_uint cty_e; cl_uint cty_f; cl_uint cty_g; cl_uint cty_h;
 	cl_uint merkle; cl_uint ntime; cl_uint nbits; cl_uint nonce;
+	cl_uint target;
 	cl_uint fW0; cl_uint fW1; cl_uint fW2; cl_uint fW3; cl_uint fW15;
 	cl_uint fW01r; cl_uint fcty_e; cl_uint fcty_e2;
 	cl_uint W16; cl_uint W17; cl_uint W2;
@@ -1059,11 +1095,20 @@ struct modminer_fpga_state {
 	bool death_stage_one;
 	bool tried_two_byte_temp;
 	bool one_byte_temp;
+
+	// Bitstream upload done by this FPGA's thread, in seconds and bytes/s
+	double upload_time;
+	double upload_rate;
+
+	// --mmq-governor results by clock
+	struct modminer_governor *governor;
 };
 #endif
 
 extern void get_datestamp(char *, struct timeval *);
 extern void submit_nonce(struct thr_info *thr, struct work *work, uint32_t nonce);
+extern void submit_nonces(struct thr_info *thr, struct work *work, const uint32_t *nonces, int count);
+extern void submit_nonces_diff1(struct thr_info *thr, struct work *work, const uint32_t *nonces, int count, double diff1);
 extern void tailsprintf(char *f, const char *fmt, ...);
 extern void wlogprint(const char *f, ...);
 extern int curses_int(const char *query);
@@ -1087,6 +1132,7 @@ extern void adl(void);
 extern void app_restart(void);
 extern void clean_work(struct work *work);
 extern void free_work(struct work *work);
+extern void get_benchmark_work(struct work *work);
 extern void __copy_work(struct work *work, struct work *base_work);
 extern struct work *copy_work(struct work *base_work);
 
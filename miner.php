@@ -1661,7 +1661,8 @@ $sectionmap = array(
 	'STATS' => 'stats',
 	'CONFIG' => 'config',
 	'COIN' => 'coin',
-	'USBSTATS' => 'usbstats');
+	'USBSTATS' => 'usbstats',
+	'USBLATENCY' => 'usblatency');
 #
 function joinfields($section1, $section2, $join, $results)
 {
@@ -29,11 +29,24 @@
 #include <pthread.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <dirent.h>
 
 #include "findnonce.h"
 #include "ocl.h"
+#include "sha2.h"
 
 int opt_platform_id = -1;
+char *opt_kernel_cache;
+bool opt_opencl_cpu;
+
+/* CPU devices are only used when asked for, to test on platforms like
+ * POCL without a GPU */
+static cl_device_type opencl_device_type(void)
+{
+	if (opt_opencl_cpu)
+		return CL_DEVICE_TYPE_GPU | CL_DEVICE_TYPE_CPU;
+	return CL_DEVICE_TYPE_GPU;
+}
 
 char *file_contents(const char *filename, int *length)
 {
@@ -115,7 +128,7 @@ int clDevicesNum(void) {
 		status = clGetPlatformInfo(platform, CL_PLATFORM_VERSION, sizeof(pbuff), pbuff, NULL);
 		if (status == CL_SUCCESS)
 			applog(LOG_INFO, "CL Platform %d version: %s", i, pbuff);
-		status = clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 0, NULL, &numDevices);
+		status = clGetDeviceIDs(platform, opencl_device_type(), 0, NULL, &numDevices);
 		if (status != CL_SUCCESS) {
 			applog(LOG_ERR, "Error %d: Getting Device IDs (num)", status);
 			if (i < numPlatforms - 1)
@@ -132,7 +145,7 @@ int clDevicesNum(void) {
 			char pbuff[256];
 			cl_device_id *devices = (cl_device_id *)malloc(numDevices*sizeof(cl_device_id));
 
-			clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, numDevices, devices, NULL);
+			clGetDeviceIDs(platform, opencl_device_type(), numDevices, devices, NULL);
 			for (j = 0; j < numDevices; j++) {
 				clGetDeviceInfo(devices[j], CL_DEVICE_NAME, sizeof(pbuff), pbuff, NULL);
 				applog(LOG_INFO, "\t%i\t%s", j, pbuff);
@@ -204,6 +217,144 @@ void patch_opcodes(char *w, unsigned remaining)
 	applog(LOG_DEBUG, "Patched a total of %i BFI_INT instructions", patched);
 }
 
+/* Compiled kernels are cached in --kernel-cache, ~/.cgminer/kernels by
+ * default, or the working directory where there is no home or it is too
+ * long. path must hold PATH_MAX */
+void kernel_cache_dir(char *path)
+{
+	if (opt_kernel_cache && *opt_kernel_cache) {
+		// set_kernel_cache() has already rejected one too long for this
+		snprintf(path, KERNEL_CACHE_DIR_MAX - 1, "%s", opt_kernel_cache);
+		if (path[strlen(path) - 1] != '/')
+			strcat(path, "/");
+		mkdir(path, 0777);
+		return;
+	}
+
+#if defined(unix)
+	if (getenv("HOME") && *getenv("HOME") &&
+	    strlen(getenv("HOME")) < KERNEL_CACHE_DIR_MAX - sizeof("/.cgminer/kernels/")) {
+		snprintf(path, KERNEL_CACHE_DIR_MAX, "%s/.cgminer/", getenv("HOME"));
+		mkdir(path, 0777);
+		strcat(path, "kernels/");
+		mkdir(path, 0777);
+		return;
+	}
+#endif
+	strcpy(path, "");
+}
+
+static void kernel_cache_hash_info(sha2_context *ctx, cl_int status, char *info)
+{
+	if (status != CL_SUCCESS)
+		*info = '\0';
+	sha2_update(ctx, (unsigned char *)info, strlen(info) + 1);
+}
+
+/* The cached binary is named by the parameters it was built with, as
+ * before, plus a hash of everything else that goes into building it: the
+ * kernel source, the compiler options, the platform and driver versions
+ * and the device. An edited kernel or a driver upgrade then gets a fresh
+ * build instead of loading a stale binary. */
+static void kernel_cache_path(char *path, const char *prefix, const char *source, int sourcelen,
+			      const char *options, cl_platform_id platform, cl_device_id device)
+{
+	unsigned char hash[32];
+	char info[1024], hexhash[17];
+	sha2_context ctx;
+
+	sha2_starts(&ctx);
+	sha2_update(&ctx, (const unsigned char *)source, sourcelen);
+	sha2_update(&ctx, (const unsigned char *)options, strlen(options) + 1);
+	kernel_cache_hash_info(&ctx, clGetPlatformInfo(platform, CL_PLATFORM_VENDOR, sizeof(info), info, NULL), info);
+	kernel_cache_hash_info(&ctx, clGetPlatformInfo(platform, CL_PLATFORM_VERSION, sizeof(info), info, NULL), info);
+	kernel_cache_hash_info(&ctx, clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(info), info, NULL), info);
+	kernel_cache_hash_info(&ctx, clGetDeviceInfo(device, CL_DEVICE_VERSION, sizeof(info), info, NULL), info);
+	kernel_cache_hash_info(&ctx, clGetDeviceInfo(device, CL_DRIVER_VERSION, sizeof(info), info, NULL), info);
+	sha2_finish(&ctx, hash);
+	__bin2hex(hexhash, hash, 8);
+
+	kernel_cache_dir(path);
+	sprintf(path + strlen(path), "%s-%s.bin", prefix, hexhash);
+}
+
+/* Write the binary under a temporary name and rename it into place, so
+ * that a crash or another GPU building the same kernel at the same time
+ * can never leave a partial binary behind */
+static void kernel_cache_save(const char *path, const char *binary, size_t size)
+{
+	char *tmppath = alloca(strlen(path) + 32);
+	FILE *binaryfile;
+
+	sprintf(tmppath, "%s.%d.%lu.tmp", path, (int)getpid(), (unsigned long)pthread_self());
+	binaryfile = fopen(tmppath, "wb");
+	if (!binaryfile) {
+		/* Not a fatal problem, just means we build it again next time */
+		applog(LOG_DEBUG, "Unable to create file %s", tmppath);
+		return;
+	}
+	if (unlikely(fwrite(binary, 1, size, binaryfile) != size)) {
+		applog(LOG_ERR, "Unable to fwrite to binaryfile");
+		fclose(binaryfile);
+		unlink(tmppath);
+		return;
+	}
+	fclose(binaryfile);
+#ifdef WIN32
+	unlink(path);
+#endif
+	if (rename(tmppath, path)) {
+		applog(LOG_DEBUG, "Unable to rename %s to %s", tmppath, path);
+		unlink(tmppath);
+	}
+}
+
+/* Remove binaries built with the same parameters as this one but from a
+ * different source, driver or device, which can never be loaded again */
+static void kernel_cache_evict(const char *path, const char *prefix)
+{
+	char *dirpath = alloca(PATH_MAX), *stale = alloca(PATH_MAX);
+	const char *binname = strrchr(path, '/');
+	size_t plen = strlen(prefix);
+	struct dirent *ent;
+	DIR *dir;
+
+	binname = binname ? binname + 1 : path;
+	kernel_cache_dir(dirpath);
+	dir = opendir(*dirpath ? dirpath : ".");
+	if (!dir)
+		return;
+	while ((ent = readdir(dir)) != NULL) {
+		size_t len = strlen(ent->d_name);
+
+		if (strncmp(ent->d_name, prefix, plen) || ent->d_name[plen] != '-' ||
+		    len != plen + 21 || strcmp(ent->d_name + len - 4, ".bin") ||
+		    !strcmp(ent->d_name, binname))
+			continue;
+		sprintf(stale, "%s%s", dirpath, ent->d_name);
+		applog(LOG_DEBUG, "Removing stale kernel binary %s", stale);
+		unlink(stale);
+	}
+	closedir(dir);
+}
+
+/* Free everything initCl() set up */
+void releaseCl(_clState *clState)
+{
+	clReleaseMemObject(clState->outputBuffer);
+#ifdef USE_SCRYPT
+	if (clState->CLbuffer0)
+		clReleaseMemObject(clState->CLbuffer0);
+	if (clState->padbuffer8)
+		clReleaseMemObject(clState->padbuffer8);
+#endif
+	clReleaseKernel(clState->kernel);
+	clReleaseProgram(clState->program);
+	clReleaseCommandQueue(clState->commandQueue);
+	clReleaseContext(clState->context);
+	free(clState);
+}
+
 _clState *initCl(unsigned int gpu, char *name, size_t nameSize)
 {
 	_clState *clState = calloc(1, sizeof(_clState));
@@ -256,7 +407,7 @@ _clState *initCl(unsigned int gpu, char *name, size_t nameSize)
 	if (status == CL_SUCCESS)
 		applog(LOG_INFO, "CL Platform version: %s", vbuff);
 
-	status = clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 0, NULL, &numDevices);
+	status = clGetDeviceIDs(platform, opencl_device_type(), 0, NULL, &numDevices);
 	if (status != CL_SUCCESS) {
 		applog(LOG_ERR, "Error %d: Getting Device IDs (num)", status);
 		return NULL;
@@ -267,7 +418,7 @@ _clState *initCl(unsigned int gpu, char *name, size_t nameSize)
 
 		/* Now, get the device list data */
 
-		status = clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, numDevices, devices, NULL);
+		status = clGetDeviceIDs(platform, opencl_device_type(), numDevices, devices, NULL);
 		if (status != CL_SUCCESS) {
 			applog(LOG_ERR, "Error %d: Getting Device IDs (list)", status);
 			return NULL;
@@ -302,9 +453,11 @@ _clState *initCl(unsigned int gpu, char *name, size_t nameSize)
 
 	} else return NULL;
 
+	clState->device = devices[gpu];
+
 	cl_context_properties cps[3] = { CL_CONTEXT_PLATFORM, (cl_context_properties)platform, 0 };
 
-	clState->context = clCreateContextFromType(cps, CL_DEVICE_TYPE_GPU, NULL, NULL, &status);
+	clState->context = clCreateContextFromType(cps, opencl_device_type(), NULL, NULL, &status);
 	if (status != CL_SUCCESS) {
 		applog(LOG_ERR, "Error %d: Creating Context. (clCreateContextFromType)", status);
 		return NULL;
@@ -374,11 +527,13 @@ _clState *initCl(unsigned int gpu, char *name, size_t nameSize)
 	/* Create binary filename based on parameters passed to opencl
 	 * compiler to ensure we only load a binary that matches what would
 	 * have otherwise created. The filename is:
-	 * name + kernelname +/- g(offset) + v + vectors + w + work_size + l + sizeof(long) + .bin
+	 * name + kernelname +/- g(offset) + v + vectors + w + work_size + l + sizeof(long) + - + hash + .bin
 	 * For scrypt the filename is:
-	 * name + kernelname + g + lg + lookup_gap + tc + thread_concurrency + w + work_size + l + sizeof(long) + .bin
+	 * name + kernelname + g + lg + lookup_gap + tc + thread_concurrency + w + work_size + l + sizeof(long) + - + hash + .bin
+	 * where the hash is added by kernel_cache_path().
 	 */
 	char binaryfilename[255];
+	char *binarypath = alloca(PATH_MAX);
 	char filename[255];
 	char numbuf[10];
 
@@ -414,7 +569,7 @@ _clState *initCl(unsigned int gpu, char *name, size_t nameSize)
 		     strstr(vbuff, "923.1") || strstr(vbuff, "938.2"))) {
 			applog(LOG_WARNING, "WARNING: You have selected the phatk kernel.");
 			applog(LOG_WARNING, "You are running SDK 2.6+ which performs poorly with this kernel.");
-			applog(LOG_WARNING, "Downgrade your SDK and delete any .bin files before starting again.");
+			applog(LOG_WARNING, "Downgrade your SDK before starting again.");
 			applog(LOG_WARNING, "Or allow cgminer to automatically choose a more suitable kernel.");
 		}
 	}
@@ -552,15 +707,66 @@ _clState *initCl(unsigned int gpu, char *name, size_t nameSize)
 	strcat(binaryfilename, numbuf);
 	sprintf(numbuf, "l%d", (int)sizeof(long));
 	strcat(binaryfilename, numbuf);
-	strcat(binaryfilename, ".bin");
 
-	binaryfile = fopen(binaryfilename, "rb");
+	/* The compiler options are worked out before looking for a cached
+	 * binary since they are part of its key */
+	char *CompilerOptions = calloc(1, 256);
+
+#ifdef USE_SCRYPT
+	if (opt_scrypt)
+		sprintf(CompilerOptions, "-D LOOKUP_GAP=%d -D CONCURRENT_THREADS=%d -D WORKSIZE=%d",
+			cgpu->lookup_gap, (unsigned int)cgpu->thread_concurrency, (int)clState->wsize);
+	else
+#endif
+	{
+		sprintf(CompilerOptions, "-D WORKSIZE=%d -D VECTORS%d -D WORKVEC=%d",
+			(int)clState->wsize, clState->vwidth, (int)clState->wsize * clState->vwidth);
+	}
+	applog(LOG_DEBUG, "Setting worksize to %d", clState->wsize);
+	if (clState->vwidth > 1)
+		applog(LOG_DEBUG, "Patched source to suit %d vectors", clState->vwidth);
+
+	if (clState->hasBitAlign) {
+		strcat(CompilerOptions, " -D BITALIGN");
+		applog(LOG_DEBUG, "cl_amd_media_ops found, setting BITALIGN");
+		if (strstr(name, "Cedar") ||
+		    strstr(name, "Redwood") ||
+		    strstr(name, "Juniper") ||
+		    strstr(name, "Cypress" ) ||
+		    strstr(name, "Hemlock" ) ||
+		    strstr(name, "Caicos" ) ||
+		    strstr(name, "Turks" ) ||
+		    strstr(name, "Barts" ) ||
+		    strstr(name, "Cayman" ) ||
+		    strstr(name, "Antilles" ) ||
+		    strstr(name, "Wrestler" ) ||
+		    strstr(name, "Zacate" ) ||
+		    strstr(name, "WinterPark" ))
+			patchbfi = true;
+	} else
+		applog(LOG_DEBUG, "cl_amd_media_ops not found, will not set BITALIGN");
+
+	if (patchbfi) {
+		strcat(CompilerOptions, " -D BFI_INT");
+		applog(LOG_DEBUG, "BFI_INT patch requiring device found, patched source with BFI_INT");
+	} else
+		applog(LOG_DEBUG, "BFI_INT patch requiring device not found, will not BFI_INT patch");
+
+	if (clState->goffset)
+		strcat(CompilerOptions, " -D GOFFSET");
+
+	if (!clState->hasOpenCL11plus)
+		strcat(CompilerOptions, " -D OCL1");
+
+	kernel_cache_path(binarypath, binaryfilename, source, pl, CompilerOptions, platform, devices[gpu]);
+
+	binaryfile = fopen(binarypath, "rb");
 	if (!binaryfile) {
 		applog(LOG_DEBUG, "No binary found, generating from source");
 	} else {
 		struct stat binary_stat;
 
-		if (unlikely(stat(binaryfilename, &binary_stat))) {
+		if (unlikely(stat(binarypath, &binary_stat))) {
 			applog(LOG_DEBUG, "Unable to stat binary, generating from source");
 			fclose(binaryfile);
 			goto build;
@@ -592,7 +798,7 @@ _clState *initCl(unsigned int gpu, char *name, size_t nameSize)
 		}
 
 		fclose(binaryfile);
-		applog(LOG_DEBUG, "Loaded binary image %s", binaryfilename);
+		applog(LOG_DEBUG, "Loaded binary image %s", binarypath);
 
 		goto built;
 	}
@@ -609,57 +815,8 @@ build:
 	}
 
 	/* create a cl program executable for all the devices specified */
-	char *CompilerOptions = calloc(1, 256);
-
-#ifdef USE_SCRYPT
-	if (opt_scrypt)
-		sprintf(CompilerOptions, "-D LOOKUP_GAP=%d -D CONCURRENT_THREADS=%d -D WORKSIZE=%d",
-			cgpu->lookup_gap, (unsigned int)cgpu->thread_concurrency, (int)clState->wsize);
-	else
-#endif
-	{
-		sprintf(CompilerOptions, "-D WORKSIZE=%d -D VECTORS%d -D WORKVEC=%d",
-			(int)clState->wsize, clState->vwidth, (int)clState->wsize * clState->vwidth);
-	}
-	applog(LOG_DEBUG, "Setting worksize to %d", clState->wsize);
-	if (clState->vwidth > 1)
-		applog(LOG_DEBUG, "Patched source to suit %d vectors", clState->vwidth);
-
-	if (clState->hasBitAlign) {
-		strcat(CompilerOptions, " -D BITALIGN");
-		applog(LOG_DEBUG, "cl_amd_media_ops found, setting BITALIGN");
-		if (strstr(name, "Cedar") ||
-		    strstr(name, "Redwood") ||
-		    strstr(name, "Juniper") ||
-		    strstr(name, "Cypress" ) ||
-		    strstr(name, "Hemlock" ) ||
-		    strstr(name, "Caicos" ) ||
-		    strstr(name, "Turks" ) ||
-		    strstr(name, "Barts" ) ||
-		    strstr(name, "Cayman" ) ||
-		    strstr(name, "Antilles" ) ||
-		    strstr(name, "Wrestler" ) ||
-		    strstr(name, "Zacate" ) ||
-		    strstr(name, "WinterPark" ))
-			patchbfi = true;
-	} else
-		applog(LOG_DEBUG, "cl_amd_media_ops not found, will not set BITALIGN");
-
-	if (patchbfi) {
-		strcat(CompilerOptions, " -D BFI_INT");
-		applog(LOG_DEBUG, "BFI_INT patch requiring device found, patched source with BFI_INT");
-	} else
-		applog(LOG_DEBUG, "BFI_INT patch requiring device not found, will not BFI_INT patch");
-
-	if (clState->goffset)
-		strcat(CompilerOptions, " -D GOFFSET");
-
-	if (!clState->hasOpenCL11plus)
-		strcat(CompilerOptions, " -D OCL1");
-
 	applog(LOG_DEBUG, "CompilerOptions: %s", CompilerOptions);
 	status = clBuildProgram(clState->program, 1, &devices[gpu], CompilerOptions , NULL, NULL);
-	free(CompilerOptions);
 
 	if (status != CL_SUCCESS) {
 		applog(LOG_ERR, "Error %d: Building Program (clBuildProgram)", status);
@@ -756,21 +913,12 @@ build:
 		prog_built = false;
 	}
 
-	free(source);
-
 	/* Save the binary to be loaded next time */
-	binaryfile = fopen(binaryfilename, "wb");
-	if (!binaryfile) {
-		/* Not a fatal problem, just means we build it again next time */
-		applog(LOG_DEBUG, "Unable to create file %s", binaryfilename);
-	} else {
-		if (unlikely(fwrite(binaries[slot], 1, binary_sizes[slot], binaryfile) != binary_sizes[slot])) {
-			applog(LOG_ERR, "Unable to fwrite to binaryfile");
-			return NULL;
-		}
-		fclose(binaryfile);
-	}
+	kernel_cache_save(binarypath, binaries[slot], binary_sizes[slot]);
+	kernel_cache_evict(binarypath, binaryfilename);
 built:
+	free(source);
+	free(CompilerOptions);
 	if (binaries[slot])
 		free(binaries[slot]);
 	free(binaries);
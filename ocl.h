@@ -15,6 +15,7 @@
 
 typedef struct {
 	cl_context context;
+	cl_device_id device;
 	cl_kernel kernel;
 	cl_command_queue commandQueue;
 	cl_program program;
@@ -37,5 +38,11 @@ typedef struct {
 extern char *file_contents(const char *filename, int *length);
 extern int clDevicesNum(void);
 extern _clState *initCl(unsigned int gpu, char *name, size_t nameSize);
+extern void releaseCl(_clState *clState);
+/* The longest kernel cache directory, leaving room in a PATH_MAX buffer
+ * for the file names added to it */
+#define KERNEL_CACHE_DIR_MAX (PATH_MAX / 2)
+
+extern void kernel_cache_dir(char *path);
 #endif /* HAVE_OPENCL */
 #endif /* __OCL_H__ */
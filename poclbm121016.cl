@@ -66,6 +66,70 @@ __constant uint K[64] = {
 #endif
 
 
+void target_block(uint *hs, uint *tw)
+{
+	uint tv[8], x, y, i;
+
+	for (i = 0; i < 8; i++)
+		tv[i] = hs[i];
+	for (i = 0; i < 64; i++) {
+		if (i >= 16) {
+			x = tw[(i + 14) & 15];
+			y = tw[(i + 1) & 15];
+			tw[i & 15] += (rotate(x, 15U) ^ rotate(x, 13U) ^ (x >> 10U)) + tw[(i + 9) & 15] +
+				      (rotate(y, 25U) ^ rotate(y, 14U) ^ (y >> 3U));
+		}
+		x = tv[7] + K[i] + tw[i & 15] + bitselect(tv[6], tv[5], tv[4]) +
+		    (rotate(tv[4], 26U) ^ rotate(tv[4], 21U) ^ rotate(tv[4], 7U));
+		y = bitselect(tv[0], tv[1], tv[2] ^ tv[0]) +
+		    (rotate(tv[0], 30U) ^ rotate(tv[0], 19U) ^ rotate(tv[0], 10U));
+		tv[7] = tv[6];
+		tv[6] = tv[5];
+		tv[5] = tv[4];
+		tv[4] = tv[3] + x;
+		tv[3] = tv[2];
+		tv[2] = tv[1];
+		tv[1] = tv[0];
+		tv[0] = x + y;
+	}
+	for (i = 0; i < 8; i++)
+		hs[i] += tv[i];
+}
+
+// Redo the double hash of a nonce that passed the H7 test and check H6 against the share target
+bool meets_target(const uint state0, const uint state1, const uint state2, const uint state3,
+		  const uint state4, const uint state5, const uint state6, const uint state7,
+		  const uint merkle, const uint ntime, const uint nbits, const uint nonce,
+		  const uint target)
+{
+	uint hs[8], tw[16], i;
+
+	hs[0] = state0; hs[1] = state1; hs[2] = state2; hs[3] = state3;
+	hs[4] = state4; hs[5] = state5; hs[6] = state6; hs[7] = state7;
+	tw[0] = merkle; tw[1] = ntime; tw[2] = nbits; tw[3] = nonce;
+	tw[4] = 0x80000000U;
+	for (i = 5; i < 15; i++)
+		tw[i] = 0;
+	tw[15] = 0x280U;
+	target_block(hs, tw);
+
+	for (i = 0; i < 8; i++)
+		tw[i] = hs[i];
+	tw[8] = 0x80000000U;
+	for (i = 9; i < 15; i++)
+		tw[i] = 0;
+	tw[15] = 0x100U;
+	hs[0] = 0x6a09e667U; hs[1] = 0xbb67ae85U; hs[2] = 0x3c6ef372U; hs[3] = 0xa54ff53aU;
+	hs[4] = 0x510e527fU; hs[5] = 0x9b05688cU; hs[6] = 0x1f83d9abU; hs[7] = 0x5be0cd19U;
+	target_block(hs, tw);
+
+	if (hs[7])
+		return false;
+	// The target is little endian
+	hs[6] = (rotate(hs[6], 8U) & 0x00ff00ffU) | (rotate(hs[6], 24U) & 0xff00ff00U);
+	return hs[6] <= target;
+}
+
 __kernel
 __attribute__((vec_type_hint(u)))
 __attribute__((reqd_work_group_size(WORKSIZE, 1, 1)))
@@ -80,6 +144,7 @@ void search(const uint state0, const uint state1, const uint state2, const uint
 	const uint D1A, const uint C1addK5, const uint B1addK6,
 	const uint W16addK16, const uint W17addK17,
 	const uint PreVal4addT1, const uint Preval0,
+	const uint merkle, const uint ntime, const uint nbits, const uint target,
 	volatile __global uint * output)
 {
 	u Vals[24];
@@ -1322,7 +1387,11 @@ Vals[2]+=(rotr(Vals[1],6)^rotr(Vals[1],11)^rotr(Vals[1],25));
 Vals[2]+=ch(Vals[1],Vals[4],Vals[3]);
 
 #define FOUND (0x0F)
-#define SETFOUND(Xnonce) output[output[FOUND]++] = Xnonce
+#define SETFOUND(Xnonce) do { \
+	if (meets_target(state0, state1, state2, state3, state4, state5, state6, state7, \
+			 merkle, ntime, nbits, Xnonce, target)) \
+		output[output[FOUND]++] = Xnonce; \
+} while (0)
 
 #if defined(VECTORS2) || defined(VECTORS4)
 	if (any(Vals[2] == 0x136032edU)) {
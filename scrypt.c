@@ -29,10 +29,16 @@
 
 #include "config.h"
 #include "miner.h"
+#include "scrypt.h"
+#include "driver-cpu.h"
 
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <unistd.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
 
 typedef struct SHA256Context {
 	uint32_t state[8];
@@ -191,16 +197,48 @@ SHA256_InitState(uint32_t * state)
 static const uint32_t passwdpad[12] = {0x00000080, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x80020000};
 static const uint32_t outerpad[8] = {0x80000000, 0, 0, 0, 0, 0, 0, 0x00000300};
 
+/* Nonce independent part of the 80 byte password: the SHA256 midstate of
+ * its first block, and both blocks already byte swapped. Only word 3 of
+ * tail (the nonce) changes per hash. */
+struct scrypt_prehash {
+	uint32_t midstate[8];
+	uint32_t block0[16];
+	uint32_t tail[16];
+};
+
+/* HMAC inner and outer states after the key pads. The key is the whole
+ * 80 byte header, hashed since it is longer than 64 bytes, so these depend
+ * on the nonce, but they are the same for both PBKDF2 passes of a hash. */
+struct scrypt_hmac {
+	uint32_t istate[8];
+	uint32_t ostate[8];
+};
+
+static void scrypt_prehash_init(struct scrypt_prehash *ph, const uint32_t *passwd)
+{
+	int i;
+
+	for (i = 0; i < 16; i++)
+		ph->block0[i] = htobe32(passwd[i]);
+	SHA256_InitState(ph->midstate);
+	SHA256_Transform(ph->midstate, ph->block0, 0);
+
+	be32enc_vect(ph->tail, passwd + 16, 4);
+	be32enc_vect(ph->tail + 4, passwdpad, 12);
+}
+
 /**
  * PBKDF2_SHA256(passwd, passwdlen, salt, saltlen, c, buf, dkLen):
  * Compute PBKDF2(passwd, salt, c, dkLen) using HMAC-SHA256 as the PRF, and
  * write the output to buf.  The value dkLen must be at most 32 * (2^32 - 1).
+ * Here passwd == salt is the 80 byte header given as its precomputed first
+ * block and the swapped tail block with the nonce in place.
  */
 static inline void
-PBKDF2_SHA256_80_128(const uint32_t * passwd, uint32_t * buf)
+PBKDF2_SHA256_80_128(const struct scrypt_prehash *ph, const uint32_t *tail,
+		     struct scrypt_hmac *hmac, uint32_t * buf)
 {
 	SHA256_CTX PShictx, PShoctx;
-	uint32_t tstate[8];
 	uint32_t ihash[8];
 	uint32_t i;
 	uint32_t pad[16];
@@ -208,29 +246,29 @@ PBKDF2_SHA256_80_128(const uint32_t * passwd, uint32_t * buf)
 	static const uint32_t innerpad[11] = {0x00000080, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xa0040000};
 
 	/* If Klen > 64, the key is really SHA256(K). */
-	SHA256_InitState(tstate);
-	SHA256_Transform(tstate, passwd, 1);
-	memcpy(pad, passwd+16, 16);
-	memcpy(pad+4, passwdpad, 48);
-	SHA256_Transform(tstate, pad, 1);
-	memcpy(ihash, tstate, 32);
-
-	SHA256_InitState(PShictx.state);
+	memcpy(ihash, ph->midstate, 32);
+	SHA256_Transform(ihash, tail, 0);
+
+	SHA256_InitState(hmac->istate);
 	for (i = 0; i < 8; i++)
 		pad[i] = ihash[i] ^ 0x36363636;
 	for (; i < 16; i++)
 		pad[i] = 0x36363636;
-	SHA256_Transform(PShictx.state, pad, 0);
-	SHA256_Transform(PShictx.state, passwd, 1);
-	be32enc_vect(PShictx.buf, passwd+16, 4);
-	be32enc_vect(PShictx.buf+5, innerpad, 11);
+	SHA256_Transform(hmac->istate, pad, 0);
 
-	SHA256_InitState(PShoctx.state);
+	SHA256_InitState(hmac->ostate);
 	for (i = 0; i < 8; i++)
 		pad[i] = ihash[i] ^ 0x5c5c5c5c;
 	for (; i < 16; i++)
 		pad[i] = 0x5c5c5c5c;
-	SHA256_Transform(PShoctx.state, pad, 0);
+	SHA256_Transform(hmac->ostate, pad, 0);
+
+	memcpy(PShictx.state, hmac->istate, 32);
+	SHA256_Transform(PShictx.state, ph->block0, 0);
+	memcpy(PShictx.buf, tail, 16);
+	be32enc_vect(PShictx.buf+5, innerpad, 11);
+
+	memcpy(PShoctx.state, hmac->ostate, 32);
 	memcpy(PShoctx.buf+8, outerpad, 32);
 
 	/* Iterate through the blocks. */
@@ -250,39 +288,18 @@ PBKDF2_SHA256_80_128(const uint32_t * passwd, uint32_t * buf)
 }
 
 
+/* Final PBKDF2 pass, reusing the HMAC states of the first one */
 static inline void
-PBKDF2_SHA256_80_128_32(const uint32_t * passwd, const uint32_t * salt, uint32_t *ostate)
+PBKDF2_SHA256_80_128_32(const struct scrypt_hmac *hmac, const uint32_t * salt, uint32_t *ostate)
 {
 	uint32_t tstate[8];
-	uint32_t ihash[8];
-	uint32_t i;
 
 	/* Compute HMAC state after processing P and S. */
 	uint32_t pad[16];
 	
 	static const uint32_t ihash_finalblk[16] = {0x00000001,0x80000000,0,0, 0,0,0,0, 0,0,0,0, 0,0,0,0x00000620};
 
-	/* If Klen > 64, the key is really SHA256(K). */
-	SHA256_InitState(tstate);
-	SHA256_Transform(tstate, passwd, 1);
-	memcpy(pad, passwd+16, 16);
-	memcpy(pad+4, passwdpad, 48);
-	SHA256_Transform(tstate, pad, 1);
-	memcpy(ihash, tstate, 32);
-
-	SHA256_InitState(ostate);
-	for (i = 0; i < 8; i++)
-		pad[i] = ihash[i] ^ 0x5c5c5c5c;
-	for (; i < 16; i++)
-		pad[i] = 0x5c5c5c5c;
-	SHA256_Transform(ostate, pad, 0);
-
-	SHA256_InitState(tstate);
-	for (i = 0; i < 8; i++)
-		pad[i] = ihash[i] ^ 0x36363636;
-	for (; i < 16; i++)
-		pad[i] = 0x36363636;
-	SHA256_Transform(tstate, pad, 0);
+	memcpy(tstate, hmac->istate, 32);
 	SHA256_Transform(tstate, salt, 1);
 	SHA256_Transform(tstate, salt+16, 1);
 	SHA256_Transform(tstate, ihash_finalblk, 0);
@@ -290,6 +307,7 @@ PBKDF2_SHA256_80_128_32(const uint32_t * passwd, const uint32_t * salt, uint32_t
 	memcpy(pad+8, outerpad, 32);
 
 	/* Feed the inner hash to the outer SHA256 operation. */
+	memcpy(ostate, hmac->ostate, 32);
 	SHA256_Transform(ostate, pad, 0);
 }
 
@@ -356,8 +374,11 @@ salsa20_8(uint32_t B[16], const uint32_t Bx[16])
 /* cpu and memory intensive function to transform a 80 byte buffer into a 32 byte output
    scratchpad size needs to be at least 63 + (128 * r * p) + (256 * r + 64) + (128 * r * N) bytes
  */
-static void scrypt_1024_1_1_256_sp(const uint32_t* input, char* scratchpad, uint32_t *ostate)
+static void scrypt_1024_1_1_256_sp(const struct scrypt_prehash *ph, uint32_t nonce,
+				   char* scratchpad, uint32_t *ostate)
 {
+	struct scrypt_hmac hmac;
+	uint32_t tail[16];
 	uint32_t * V;
 	uint32_t X[32];
 	uint32_t i;
@@ -368,7 +389,9 @@ static void scrypt_1024_1_1_256_sp(const uint32_t* input, char* scratchpad, uint
 	p1 = (uint64_t *)X;
 	V = (uint32_t *)(((uintptr_t)(scratchpad) + 63) & ~ (uintptr_t)(63));
 
-	PBKDF2_SHA256_80_128(input, X);
+	memcpy(tail, ph->tail, 64);
+	tail[3] = htobe32(nonce);
+	PBKDF2_SHA256_80_128(ph, tail, &hmac, X);
 
 	for (i = 0; i < 1024; i += 2) {
 		memcpy(&V[i * 32], X, 128);
@@ -399,14 +422,135 @@ static void scrypt_1024_1_1_256_sp(const uint32_t* input, char* scratchpad, uint
 		salsa20_8(&X[16], &X[0]);
 	}
 
-	PBKDF2_SHA256_80_128_32(input, X, ostate);
+	PBKDF2_SHA256_80_128_32(&hmac, X, ostate);
+}
+
+/* Lookup gap variant for CPUs short on cache: only every gap'th V entry is
+ * stored, and the ones in between are recomputed from the nearest stored
+ * entry below them when the second loop asks for them */
+static void scrypt_1024_1_1_256_sp_lg(const struct scrypt_prehash *ph, uint32_t nonce,
+				      char* scratchpad, uint32_t *ostate, uint32_t gap)
+{
+	struct scrypt_hmac hmac;
+	uint32_t tail[16];
+	uint32_t * V;
+	uint32_t X[32], Y[32];
+	uint32_t i;
+	uint32_t j;
+	uint32_t k;
+	uint64_t *p1, *p2;
+
+	p1 = (uint64_t *)X;
+	p2 = (uint64_t *)Y;
+	V = (uint32_t *)(((uintptr_t)(scratchpad) + 63) & ~ (uintptr_t)(63));
+
+	memcpy(tail, ph->tail, 64);
+	tail[3] = htobe32(nonce);
+	PBKDF2_SHA256_80_128(ph, tail, &hmac, X);
+
+	for (i = 0; i < 1024; i++) {
+		if (!(i % gap))
+			memcpy(&V[(i / gap) * 32], X, 128);
+
+		salsa20_8(&X[0], &X[16]);
+		salsa20_8(&X[16], &X[0]);
+	}
+	for (i = 0; i < 1024; i++) {
+		j = X[16] & 1023;
+		memcpy(Y, &V[(j / gap) * 32], 128);
+		for (k = j % gap; k; k--) {
+			salsa20_8(&Y[0], &Y[16]);
+			salsa20_8(&Y[16], &Y[0]);
+		}
+		for(k = 0; k < 16; k++)
+			p1[k] ^= p2[k];
+
+		salsa20_8(&X[0], &X[16]);
+		salsa20_8(&X[16], &X[0]);
+	}
+
+	PBKDF2_SHA256_80_128_32(&hmac, X, ostate);
 }
 
 /* 131583 rounded up to 4 byte alignment */
 #define SCRATCHBUF_SIZE	(131584)
 
+#define SCRATCHBUF_HUGEPAGE	(2 * 1024 * 1024)
+
+/* Allocate a long lived scratchpad for one mining thread. With hugepages
+ * set, try an explicit MAP_HUGETLB mapping first, then fall back to a
+ * hugepage aligned block with transparent hugepages requested, so the whole
+ * V[] array sits behind a single TLB entry. Otherwise (or if all of that
+ * fails) use a plain cache line aligned allocation. */
+bool scrypt_alloc_scratchpad(struct scrypt_scratchpad *sp, bool hugepages)
+{
+	void *buf = NULL;
+
+	memset(sp, 0, sizeof(*sp));
+
+#ifndef WIN32
+	if (hugepages) {
+#ifdef MAP_HUGETLB
+		buf = mmap(NULL, SCRATCHBUF_HUGEPAGE, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (buf != MAP_FAILED) {
+			sp->buf = buf;
+			sp->size = SCRATCHBUF_HUGEPAGE;
+			sp->pagesize = SCRATCHBUF_HUGEPAGE;
+			sp->mapped = true;
+			sp->backing = "hugetlb";
+			return true;
+		}
+		buf = NULL;
+#endif
+		if (!posix_memalign(&buf, SCRATCHBUF_HUGEPAGE, SCRATCHBUF_HUGEPAGE)) {
+#ifdef MADV_HUGEPAGE
+			if (!madvise(buf, SCRATCHBUF_HUGEPAGE, MADV_HUGEPAGE)) {
+				sp->buf = buf;
+				sp->size = SCRATCHBUF_HUGEPAGE;
+				sp->pagesize = SCRATCHBUF_HUGEPAGE;
+				sp->backing = "thp";
+				return true;
+			}
+#endif
+			free(buf);
+			buf = NULL;
+		}
+		applog(LOG_INFO, "Huge pages unavailable for scrypt scratchpad, using normal pages");
+	}
+
+	if (posix_memalign(&buf, 64, SCRATCHBUF_SIZE))
+		buf = NULL;
+	sp->pagesize = sysconf(_SC_PAGESIZE);
+#else
+	buf = malloc(SCRATCHBUF_SIZE);
+	sp->pagesize = 4096;
+#endif
+	if (unlikely(!buf))
+		return false;
+
+	sp->buf = buf;
+	sp->size = SCRATCHBUF_SIZE;
+	sp->backing = "normal";
+	return true;
+}
+
+void scrypt_free_scratchpad(struct scrypt_scratchpad *sp)
+{
+	if (!sp->buf)
+		return;
+#ifndef WIN32
+	if (sp->mapped)
+		munmap(sp->buf, sp->size);
+	else
+#endif
+		free(sp->buf);
+	sp->buf = NULL;
+}
+
 void scrypt_outputhash(struct work *work)
 {
+	struct scrypt_prehash ph;
 	uint32_t data[20];
 	char *scratchbuf;
 	uint32_t *nonce = (uint32_t *)(work->data + 76);
@@ -414,8 +558,9 @@ void scrypt_outputhash(struct work *work)
 
 	be32enc_vect(data, (const uint32_t *)work->data, 19);
 	data[19] = htobe32(*nonce);
+	scrypt_prehash_init(&ph, data);
 	scratchbuf = alloca(SCRATCHBUF_SIZE);
-	scrypt_1024_1_1_256_sp(data, scratchbuf, ohash);
+	scrypt_1024_1_1_256_sp(&ph, data[19], scratchbuf, ohash);
 	flip32(ohash, ohash);
 }
 
@@ -424,12 +569,14 @@ bool scrypt_test(unsigned char *pdata, const unsigned char *ptarget, uint32_t no
 {
 	uint32_t tmp_hash7, Htarg = ((const uint32_t *)ptarget)[7];
 	uint32_t data[20], ohash[8];
+	struct scrypt_prehash ph;
 	char *scratchbuf;
 
 	be32enc_vect(data, (const uint32_t *)pdata, 19);
 	data[19] = htobe32(nonce);
+	scrypt_prehash_init(&ph, data);
 	scratchbuf = alloca(SCRATCHBUF_SIZE);
-	scrypt_1024_1_1_256_sp(data, scratchbuf, ohash);
+	scrypt_1024_1_1_256_sp(&ph, data[19], scratchbuf, ohash);
 	tmp_hash7 = be32toh(ohash[7]);
 
 	return (tmp_hash7 <= Htarg);
@@ -440,27 +587,40 @@ bool scanhash_scrypt(struct thr_info *thr, const unsigned char __maybe_unused *p
 		     unsigned char __maybe_unused *phash, const unsigned char *ptarget,
 		     uint32_t max_nonce, uint32_t *last_nonce, uint32_t n)
 {
+	struct cpu_thread_data *cpud = thr->cgpu_data;
 	uint32_t *nonce = (uint32_t *)(pdata + 76);
+	struct scrypt_prehash ph;
 	char *scratchbuf;
 	uint32_t data[20];
 	uint32_t tmp_hash7;
 	uint32_t Htarg = ((const uint32_t *)ptarget)[7];
+	const uint32_t gap = opt_cpu_lookup_gap > 1 ? opt_cpu_lookup_gap : 1;
 	bool ret = false;
 
 	be32enc_vect(data, (const uint32_t *)pdata, 19);
-
-	scratchbuf = malloc(SCRATCHBUF_SIZE);
-	if (unlikely(!scratchbuf)) {
-		applog(LOG_ERR, "Failed to malloc scratchbuf in scanhash_scrypt");
-		return ret;
+	data[19] = 0;
+	scrypt_prehash_init(&ph, data);
+
+	/* Mining threads own a persistent scratchpad, only the benchmark's
+	 * dummy thread falls back to a temporary one */
+	if (likely(cpud && cpud->scratch.buf))
+		scratchbuf = cpud->scratch.buf;
+	else {
+		scratchbuf = malloc(SCRATCHBUF_SIZE);
+		if (unlikely(!scratchbuf)) {
+			applog(LOG_ERR, "Failed to malloc scratchbuf in scanhash_scrypt");
+			return ret;
+		}
 	}
 
 	while(1) {
 		uint32_t ostate[8];
 
 		*nonce = ++n;
-		data[19] = n;
-		scrypt_1024_1_1_256_sp(data, scratchbuf, ostate);
+		if (gap == 1)
+			scrypt_1024_1_1_256_sp(&ph, n, scratchbuf, ostate);
+		else
+			scrypt_1024_1_1_256_sp_lg(&ph, n, scratchbuf, ostate, gap);
 		tmp_hash7 = be32toh(ostate[7]);
 
 		if (unlikely(tmp_hash7 <= Htarg)) {
@@ -476,6 +636,7 @@ bool scanhash_scrypt(struct thr_info *thr, const unsigned char __maybe_unused *p
 		}
 	}
 
-	free(scratchbuf);;
+	if (!cpud || scratchbuf != cpud->scratch.buf)
+		free(scratchbuf);
 	return ret;
 }
@@ -4,6 +4,20 @@
 #include "miner.h"
 
 #ifdef USE_SCRYPT
+struct scrypt_scratchpad {
+	char *buf;
+	size_t size;
+	size_t pagesize;
+	bool mapped;
+	const char *backing;
+};
+
+extern bool scrypt_alloc_scratchpad(struct scrypt_scratchpad *sp, bool hugepages);
+extern void scrypt_free_scratchpad(struct scrypt_scratchpad *sp);
+extern bool scanhash_scrypt(struct thr_info *thr, const unsigned char *pmidstate,
+			    unsigned char *pdata, unsigned char *phash1,
+			    unsigned char *phash, const unsigned char *ptarget,
+			    uint32_t max_nonce, uint32_t *last_nonce, uint32_t n);
 extern bool scrypt_test(unsigned char *pdata, const unsigned char *ptarget,
 			uint32_t nonce);
 extern void scrypt_outputhash(struct work *work);
@@ -34,6 +34,27 @@
 #include <string.h>
 #include <stdio.h>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9) || defined(__clang__))
+#define SHA2_X86_SHANI
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+/*
+ * The ARMv8 path needs the compiler to allow the crypto extension, e.g.
+ * -march=armv8-a+crypto, and is still only used if the cpu reports it.
+ */
+#if defined(__aarch64__) && defined(__linux__) && \
+    (defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_SHA2))
+#define SHA2_ARMV8
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_SHA2
+#define HWCAP_SHA2 (1 << 6)
+#endif
+#endif
+
 /*
  * 32-bit integer manipulation macros (big endian)
  */
@@ -75,7 +96,7 @@ void sha2_starts( sha2_context *ctx )
     ctx->state[7] = 0x5BE0CD19;
 }
 
-static void sha2_process( sha2_context *ctx, const unsigned char data[64] )
+static void sha2_process_generic( uint32_t state[8], const unsigned char data[64] )
 {
     uint32_t temp1, temp2, W[64];
     uint32_t A, B, C, D, E, F, G, H;
@@ -122,14 +143,14 @@ static void sha2_process( sha2_context *ctx, const unsigned char data[64] )
     d += temp1; h = temp1 + temp2;              \
 }
 
-    A = ctx->state[0];
-    B = ctx->state[1];
-    C = ctx->state[2];
-    D = ctx->state[3];
-    E = ctx->state[4];
-    F = ctx->state[5];
-    G = ctx->state[6];
-    H = ctx->state[7];
+    A = state[0];
+    B = state[1];
+    C = state[2];
+    D = state[3];
+    E = state[4];
+    F = state[5];
+    G = state[6];
+    H = state[7];
 
     P( A, B, C, D, E, F, G, H, W[ 0], 0x428A2F98 );
     P( H, A, B, C, D, E, F, G, W[ 1], 0x71374491 );
@@ -196,14 +217,187 @@ static void sha2_process( sha2_context *ctx, const unsigned char data[64] )
     P( C, D, E, F, G, H, A, B, R(62), 0xBEF9A3F7 );
     P( B, C, D, E, F, G, H, A, R(63), 0xC67178F2 );
 
-    ctx->state[0] += A;
-    ctx->state[1] += B;
-    ctx->state[2] += C;
-    ctx->state[3] += D;
-    ctx->state[4] += E;
-    ctx->state[5] += F;
-    ctx->state[6] += G;
-    ctx->state[7] += H;
+    state[0] += A;
+    state[1] += B;
+    state[2] += C;
+    state[3] += D;
+    state[4] += E;
+    state[5] += F;
+    state[6] += G;
+    state[7] += H;
+}
+
+static const uint32_t sha2_k[64] =
+{
+    0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5,
+    0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+    0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3,
+    0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+    0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC,
+    0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+    0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7,
+    0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+    0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13,
+    0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+    0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3,
+    0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+    0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5,
+    0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+    0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208,
+    0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2
+};
+
+#ifdef SHA2_X86_SHANI
+/*
+ * x86 SHA extensions. The state is kept as ABEF/CDGH pairs, the order
+ * sha256rnds2 works on, and each loop does four rounds.
+ */
+__attribute__((target("sha,sse4.1")))
+static void sha2_process_shani( uint32_t state[8], const unsigned char data[64] )
+{
+    const __m128i mask = _mm_set_epi64x( 0x0c0d0e0f08090a0bULL,
+                                         0x0405060700010203ULL );
+    __m128i state0, state1, abef, cdgh, msg, tmp, m[4];
+    int g;
+
+    tmp    = _mm_loadu_si128( (const __m128i *) &state[0] );
+    state1 = _mm_loadu_si128( (const __m128i *) &state[4] );
+    tmp    = _mm_shuffle_epi32( tmp, 0xB1 );            /* CDAB */
+    state1 = _mm_shuffle_epi32( state1, 0x1B );         /* EFGH */
+    state0 = _mm_alignr_epi8( tmp, state1, 8 );         /* ABEF */
+    state1 = _mm_blend_epi16( state1, tmp, 0xF0 );      /* CDGH */
+    abef = state0;
+    cdgh = state1;
+
+    for( g = 0; g < 4; g++ )
+        m[g] = _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i *) ( data + g * 16 ) ), mask );
+
+    for( g = 0; g < 16; g++ )
+    {
+        if( g >= 4 )
+        {
+            tmp = _mm_sha256msg1_epu32( m[g & 3], m[( g + 1 ) & 3] );
+            tmp = _mm_add_epi32( tmp, _mm_alignr_epi8( m[( g + 3 ) & 3], m[( g + 2 ) & 3], 4 ) );
+            m[g & 3] = _mm_sha256msg2_epu32( tmp, m[( g + 3 ) & 3] );
+        }
+        msg = _mm_add_epi32( m[g & 3], _mm_loadu_si128( (const __m128i *) &sha2_k[g * 4] ) );
+        state1 = _mm_sha256rnds2_epu32( state1, state0, msg );
+        msg = _mm_shuffle_epi32( msg, 0x0E );
+        state0 = _mm_sha256rnds2_epu32( state0, state1, msg );
+    }
+
+    state0 = _mm_add_epi32( state0, abef );
+    state1 = _mm_add_epi32( state1, cdgh );
+
+    tmp    = _mm_shuffle_epi32( state0, 0x1B );         /* FEBA */
+    state1 = _mm_shuffle_epi32( state1, 0xB1 );         /* DCHG */
+    state0 = _mm_blend_epi16( tmp, state1, 0xF0 );      /* DCBA */
+    state1 = _mm_alignr_epi8( state1, tmp, 8 );         /* HGFE */
+
+    _mm_storeu_si128( (__m128i *) &state[0], state0 );
+    _mm_storeu_si128( (__m128i *) &state[4], state1 );
+}
+
+static int sha2_have_shani( void )
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    if( !__get_cpuid( 1, &eax, &ebx, &ecx, &edx ) )
+        return 0;
+    /* SSSE3 and SSE4.1 for the shuffles and blends */
+    if( !( ecx & ( 1 << 9 ) ) || !( ecx & ( 1 << 19 ) ) )
+        return 0;
+    if( __get_cpuid_max( 0, NULL ) < 7 )
+        return 0;
+    __cpuid_count( 7, 0, eax, ebx, ecx, edx );
+    return ( ebx >> 29 ) & 1;
+}
+#endif
+
+#ifdef SHA2_ARMV8
+/*
+ * ARMv8 SHA-256 instructions, four rounds per loop.
+ */
+static void sha2_process_armv8( uint32_t state[8], const unsigned char data[64] )
+{
+    uint32x4_t state0, state1, abcd, efgh, wk, tmp, m[4];
+    int g;
+
+    state0 = vld1q_u32( &state[0] );
+    state1 = vld1q_u32( &state[4] );
+    abcd = state0;
+    efgh = state1;
+
+    for( g = 0; g < 4; g++ )
+        m[g] = vreinterpretq_u32_u8( vrev32q_u8( vld1q_u8( data + g * 16 ) ) );
+
+    for( g = 0; g < 16; g++ )
+    {
+        wk = vaddq_u32( m[g & 3], vld1q_u32( &sha2_k[g * 4] ) );
+        if( g < 12 )
+            m[g & 3] = vsha256su1q_u32( vsha256su0q_u32( m[g & 3], m[( g + 1 ) & 3] ),
+                                        m[( g + 2 ) & 3], m[( g + 3 ) & 3] );
+        tmp = state0;
+        state0 = vsha256hq_u32( state0, state1, wk );
+        state1 = vsha256h2q_u32( state1, tmp, wk );
+    }
+
+    vst1q_u32( &state[0], vaddq_u32( state0, abcd ) );
+    vst1q_u32( &state[4], vaddq_u32( state1, efgh ) );
+}
+#endif
+
+static void sha2_process_detect( uint32_t state[8], const unsigned char data[64] );
+
+static void (*sha2_transform)( uint32_t state[8], const unsigned char data[64] ) =
+    sha2_process_detect;
+static const char *sha2_backend_name = "generic";
+
+/*
+ * Picks the fastest transform the cpu supports on first use. Threads racing
+ * through here all pick the same one.
+ */
+static void sha2_process_detect( uint32_t state[8], const unsigned char data[64] )
+{
+    void (*transform)( uint32_t state[8], const unsigned char data[64] ) =
+        sha2_process_generic;
+
+#ifdef SHA2_X86_SHANI
+    if( sha2_have_shani() )
+    {
+        transform = sha2_process_shani;
+        sha2_backend_name = "shani";
+    }
+#endif
+#ifdef SHA2_ARMV8
+    if( getauxval( AT_HWCAP ) & HWCAP_SHA2 )
+    {
+        transform = sha2_process_armv8;
+        sha2_backend_name = "armv8";
+    }
+#endif
+    sha2_transform = transform;
+    transform( state, data );
+}
+
+static void sha2_process( sha2_context *ctx, const unsigned char data[64] )
+{
+    sha2_transform( ctx->state, data );
+}
+
+/*
+ * Name of the transform in use
+ */
+const char *sha2_backend( void )
+{
+    if( sha2_transform == sha2_process_detect )
+    {
+        uint32_t state[8] = { 0 };
+        unsigned char data[64] = { 0 };
+
+        sha2_process_detect( state, data );
+    }
+    return( sha2_backend_name );
 }
 
 /*
@@ -305,3 +499,45 @@ void sha2( const unsigned char *input, int ilen,
 
     memset( &ctx, 0, sizeof( sha2_context ) );
 }
+
+static const uint32_t sha2_init_state[8] =
+{
+    0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+    0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+};
+
+/* The second block of any 64 byte message: padding and a 512 bit length */
+static const unsigned char sha2_pad64[64] =
+{
+ 0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x02, 0
+};
+
+/*
+ * output = SHA-256( SHA-256( 64 byte input ) ), as for merkle tree nodes,
+ * in three transforms with no context or padding bookkeeping
+ */
+void sha2_double64( const unsigned char input[64], unsigned char output[32] )
+{
+    uint32_t state[8];
+    unsigned char block[64];
+    int i;
+
+    memcpy( state, sha2_init_state, sizeof( state ) );
+    sha2_transform( state, input );
+    sha2_transform( state, sha2_pad64 );
+
+    for( i = 0; i < 8; i++ )
+        PUT_ULONG_BE( state[i], block, i * 4 );
+    memset( block + 32, 0, 32 );
+    block[32] = 0x80;
+    block[62] = 0x01;   /* 256 bit length */
+
+    memcpy( state, sha2_init_state, sizeof( state ) );
+    sha2_transform( state, block );
+
+    for( i = 0; i < 8; i++ )
+        PUT_ULONG_BE( state[i], output, i * 4 );
+}
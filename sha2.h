@@ -80,6 +80,19 @@ void sha2_finish( sha2_context *ctx, unsigned char output[32] );
 void sha2( const unsigned char *input, int ilen,
            unsigned char output[32]);
 
+/**
+ * \brief          Output = SHA-256( SHA-256( 64 byte input ) )
+ *
+ * \param input    buffer holding the 64 bytes, e.g. two merkle hashes
+ * \param output   double SHA-256 result
+ */
+void sha2_double64( const unsigned char input[64], unsigned char output[32] );
+
+/**
+ * \brief          Name of the transform picked for this cpu
+ */
+const char *sha2_backend( void );
+
 #ifdef __cplusplus
 }
 #endif
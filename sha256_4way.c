@@ -17,7 +17,7 @@
 
 #define NPAR 32
 
-static void DoubleBlockSHA256(const void* pin, void* pout, const void* pinit, unsigned int hash[8][NPAR], const void* init2);
+static void DoubleBlockSHA256(const void* pin, void* pout, const struct sha256_precalc *pc, unsigned int hash[8][NPAR], const void* init2);
 
 static const unsigned int sha256_consts[] = {
     0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, /*  0 */
@@ -108,6 +108,8 @@ bool ScanHash_4WaySSE2(struct thr_info*thr, const unsigned char *pmidstate,
 	uint32_t nonce)
 {
     unsigned int *nNonce_p = (unsigned int*)(pdata + 76);
+    struct sha256_precalc tmp;
+    const struct sha256_precalc *pc = cpu_get_precalc(thr, &tmp, pmidstate, pdata);
 
 	pdata += 64;
 
@@ -119,7 +121,7 @@ bool ScanHash_4WaySSE2(struct thr_info*thr, const unsigned char *pmidstate,
 	nonce += NPAR;
 	*nNonce_p = nonce;
 
-        DoubleBlockSHA256(pdata, phash1, pmidstate, thash, pSHA256InitState);
+        DoubleBlockSHA256(pdata, phash1, pc, thash, pSHA256InitState);
 
         for (j = 0; j < NPAR; j++)
         {
@@ -148,11 +150,12 @@ bool ScanHash_4WaySSE2(struct thr_info*thr, const unsigned char *pmidstate,
 }
 
 
-static void DoubleBlockSHA256(const void* pin, void* pad, const void *pre, unsigned int thash[9][NPAR], const void *init)
+static void DoubleBlockSHA256(const void* pin, void* pad, const struct sha256_precalc *pc, unsigned int thash[9][NPAR], const void *init)
 {
     unsigned int* In = (unsigned int*)pin;
     unsigned int* Pad = (unsigned int*)pad;
-    unsigned int* hPre = (unsigned int*)pre;
+    const unsigned int* hPre = pc->midstate;
+    const unsigned int* hPc = pc->state;
     unsigned int* hInit = (unsigned int*)init;
     unsigned int /* i, j, */ k;
 
@@ -191,18 +194,16 @@ static void DoubleBlockSHA256(const void* pin, void* pad, const void *pre, unsig
 	nonce = _mm_add_epi32(preNonce, _mm_set1_epi32(k));
         w3 = nonce;
 
-        a = _mm_set1_epi32(hPre[0]);
-        b = _mm_set1_epi32(hPre[1]);
-        c = _mm_set1_epi32(hPre[2]);
-        d = _mm_set1_epi32(hPre[3]);
-        e = _mm_set1_epi32(hPre[4]);
-        f = _mm_set1_epi32(hPre[5]);
-        g = _mm_set1_epi32(hPre[6]);
-        h = _mm_set1_epi32(hPre[7]);
+        /* rounds 0-2 don't depend on the nonce, resume from the precalc */
+        a = _mm_set1_epi32(hPc[0]);
+        b = _mm_set1_epi32(hPc[1]);
+        c = _mm_set1_epi32(hPc[2]);
+        d = _mm_set1_epi32(hPc[3]);
+        e = _mm_set1_epi32(hPc[4]);
+        f = _mm_set1_epi32(hPc[5]);
+        g = _mm_set1_epi32(hPc[6]);
+        h = _mm_set1_epi32(hPc[7]);
 
-        SHA256ROUND(a, b, c, d, e, f, g, h, 0, w0);
-        SHA256ROUND(h, a, b, c, d, e, f, g, 1, w1);
-        SHA256ROUND(g, h, a, b, c, d, e, f, 2, w2);
         SHA256ROUND(f, g, h, a, b, c, d, e, 3, w3);
         SHA256ROUND(e, f, g, h, a, b, c, d, 4, w4);
         SHA256ROUND(d, e, f, g, h, a, b, c, 5, w5);
@@ -217,9 +218,9 @@ static void DoubleBlockSHA256(const void* pin, void* pad, const void *pre, unsig
         SHA256ROUND(c, d, e, f, g, h, a, b, 14, w14);
         SHA256ROUND(b, c, d, e, f, g, h, a, 15, w15);
 
-        w0 = add4(SIGMA1_256(w14), w9, SIGMA0_256(w1), w0);
+        w0 = _mm_set1_epi32(pc->W[16]);
         SHA256ROUND(a, b, c, d, e, f, g, h, 16, w0);
-        w1 = add4(SIGMA1_256(w15), w10, SIGMA0_256(w2), w1);
+        w1 = _mm_set1_epi32(pc->W[17]);
         SHA256ROUND(h, a, b, c, d, e, f, g, 17, w1);
         w2 = add4(SIGMA1_256(w0), w11, SIGMA0_256(w3), w2);
         SHA256ROUND(g, h, a, b, c, d, e, f, 18, w2);
@@ -7,6 +7,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include "miner.h"
+#include "driver-cpu.h"
 
 typedef uint32_t word32;
 
@@ -92,6 +93,44 @@ static void runhash(void *state, const void *input, const void *init)
 	SHA256_Transform(state, input);
 }
 
+/* First block of the header with nonce n, resuming from the working vars
+ * the precalc left after round 2 */
+static void SHA256_Transform_precalc(word32 *state, const struct sha256_precalc *pc,
+				     word32 n)
+{
+	word32 data[16];
+	word32 W[16];
+	word32 T[8];
+	unsigned int j = 0;
+
+	memcpy(data, pc->W, sizeof(data));
+	data[3] = n;
+	W[0] = data[0];
+	W[1] = data[1];
+	W[2] = data[2];
+	memcpy(T, pc->state, sizeof(T));
+	R( 3);
+	R( 4); R( 5); R( 6); R( 7);
+	R( 8); R( 9); R(10); R(11);
+	R(12); R(13); R(14); R(15);
+	for (j=16; j<64; j+=16)
+	{
+		R( 0); R( 1); R( 2); R( 3);
+		R( 4); R( 5); R( 6); R( 7);
+		R( 8); R( 9); R(10); R(11);
+		R(12); R(13); R(14); R(15);
+	}
+	memcpy(state, pc->midstate, 32);
+	state[0] += a(0);
+	state[1] += b(0);
+	state[2] += c(0);
+	state[3] += d(0);
+	state[4] += e(0);
+	state[5] += f(0);
+	state[6] += g(0);
+	state[7] += h(0);
+}
+
 /* suspiciously similar to ScanHash* from bitcoin */
 bool scanhash_cryptopp(struct thr_info*thr, const unsigned char *midstate,
 		unsigned char *data,
@@ -102,14 +141,16 @@ bool scanhash_cryptopp(struct thr_info*thr, const unsigned char *midstate,
 {
 	uint32_t *hash32 = (uint32_t *) hash;
 	uint32_t *nonce = (uint32_t *)(data + 76);
+	struct sha256_precalc tmp;
+	const struct sha256_precalc *pc;
 
-	data += 64;
+	pc = cpu_get_precalc(thr, &tmp, midstate, data);
 
 	while (1) {
 		n++;
 		*nonce = n;
 
-		runhash(hash1, data, midstate);
+		SHA256_Transform_precalc((word32 *)hash1, pc, n);
 		runhash(hash, hash1, sha256_init_state);
 
 		if (unlikely((hash32[7] == 0) && fulltest(hash, target))) {
@@ -25,6 +25,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include "miner.h"
+#include "driver-cpu.h"
 
 typedef uint32_t u32;
 typedef uint8_t u8;
@@ -238,6 +239,124 @@ const uint32_t sha256_init_state[8] = {
 	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
 };
 
+static const u32 sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+/* One round with the working vars passed rotated, as in sha256_transform */
+#define RND(a, b, c, d, e, f, g, h, i) do { \
+	t1 = h + e1(e) + Ch(e,f,g) + sha256_k[i] + W[i]; \
+	d += t1; \
+	h = t1 + e0(a) + Maj(a,b,c); \
+} while (0)
+
+#define RND8(i) do { \
+	RND(a, b, c, d, e, f, g, h, i); \
+	RND(h, a, b, c, d, e, f, g, i + 1); \
+	RND(g, h, a, b, c, d, e, f, i + 2); \
+	RND(f, g, h, a, b, c, d, e, i + 3); \
+	RND(e, f, g, h, a, b, c, d, i + 4); \
+	RND(d, e, f, g, h, a, b, c, i + 5); \
+	RND(c, d, e, f, g, h, a, b, i + 6); \
+	RND(b, c, d, e, f, g, h, a, i + 7); \
+} while (0)
+
+/* Everything in the second block of the header that does not depend on the
+ * nonce: the first three rounds, W16 and W17, and most of W18 and W19 */
+void sha256_precalc_init(struct sha256_precalc *pc, const unsigned char *midstate,
+			 const unsigned char *data)
+{
+	const u32 *in = (const u32 *)(data + 64);
+	u32 a, b, c, d, e, f, g, h, t1;
+	u32 *W = pc->W;
+	int i;
+
+	memcpy(pc->midstate, midstate, 32);
+	for (i = 0; i < 16; i++)
+		W[i] = in[i];
+	W[16] = s1(W[14]) + W[9] + s0(W[1]) + W[0];
+	W[17] = s1(W[15]) + W[10] + s0(W[2]) + W[1];
+	pc->W18 = s1(W[16]) + W[11] + W[2];
+	pc->W19 = s1(W[17]) + W[12] + s0(W[4]);
+
+	a = pc->midstate[0]; b = pc->midstate[1];
+	c = pc->midstate[2]; d = pc->midstate[3];
+	e = pc->midstate[4]; f = pc->midstate[5];
+	g = pc->midstate[6]; h = pc->midstate[7];
+	RND(a, b, c, d, e, f, g, h, 0);
+	RND(h, a, b, c, d, e, f, g, 1);
+	RND(g, h, a, b, c, d, e, f, 2);
+	pc->state[0] = a; pc->state[1] = b; pc->state[2] = c; pc->state[3] = d;
+	pc->state[4] = e; pc->state[5] = f; pc->state[6] = g; pc->state[7] = h;
+}
+
+/* Double sha256 of the header with nonce n, starting from round 3 of the
+ * first block and stopping after round 60 of the second, which is as far as
+ * is needed to know H7. Returns true if H7 is zero. */
+static bool sha256_precalc_h7(const struct sha256_precalc *pc, u32 n)
+{
+	u32 a, b, c, d, e, f, g, h, t1;
+	u32 W[64];
+	int i;
+
+	memcpy(W, pc->W, sizeof(pc->W));
+	W[3] = n;
+	W[18] = pc->W18 + s0(n);
+	W[19] = pc->W19 + n;
+	for (i = 20; i < 64; i++)
+		BLEND_OP(i, W);
+
+	a = pc->state[0]; b = pc->state[1]; c = pc->state[2]; d = pc->state[3];
+	e = pc->state[4]; f = pc->state[5]; g = pc->state[6]; h = pc->state[7];
+	RND(f, g, h, a, b, c, d, e, 3);
+	RND(e, f, g, h, a, b, c, d, 4);
+	RND(d, e, f, g, h, a, b, c, 5);
+	RND(c, d, e, f, g, h, a, b, 6);
+	RND(b, c, d, e, f, g, h, a, 7);
+	for (i = 8; i < 64; i += 8)
+		RND8(i);
+
+	W[0] = pc->midstate[0] + a; W[1] = pc->midstate[1] + b;
+	W[2] = pc->midstate[2] + c; W[3] = pc->midstate[3] + d;
+	W[4] = pc->midstate[4] + e; W[5] = pc->midstate[5] + f;
+	W[6] = pc->midstate[6] + g; W[7] = pc->midstate[7] + h;
+	W[8] = 0x80000000;
+	W[9] = W[10] = W[11] = W[12] = W[13] = W[14] = 0;
+	W[15] = 0x100;
+	for (i = 16; i < 61; i++)
+		BLEND_OP(i, W);
+
+	a = sha256_init_state[0]; b = sha256_init_state[1];
+	c = sha256_init_state[2]; d = sha256_init_state[3];
+	e = sha256_init_state[4]; f = sha256_init_state[5];
+	g = sha256_init_state[6]; h = sha256_init_state[7];
+	for (i = 0; i < 56; i += 8)
+		RND8(i);
+	RND(a, b, c, d, e, f, g, h, 56);
+	RND(h, a, b, c, d, e, f, g, 57);
+	RND(g, h, a, b, c, d, e, f, 58);
+	RND(f, g, h, a, b, c, d, e, 59);
+	RND(e, f, g, h, a, b, c, d, 60);
+
+	/* rounds 61-63 only shift this into the h position */
+	return h + sha256_init_state[7] == 0;
+}
+
 /* suspiciously similar to ScanHash* from bitcoin */
 bool scanhash_c(struct thr_info*thr, const unsigned char *midstate, unsigned char *data,
 	        unsigned char *hash1, unsigned char *hash,
@@ -245,30 +364,34 @@ bool scanhash_c(struct thr_info*thr, const unsigned char *midstate, unsigned cha
 	        uint32_t max_nonce, uint32_t *last_nonce,
 		uint32_t n)
 {
-	uint32_t *hash32 = (uint32_t *) hash;
 	uint32_t *nonce = (uint32_t *)(data + 76);
+	struct sha256_precalc tmp;
+	const struct sha256_precalc *pc;
 	unsigned long stat_ctr = 0;
 
+	pc = cpu_get_precalc(thr, &tmp, midstate, data);
 	data += 64;
 
 	while (1) {
 		n++;
-		*nonce = n;
-
-		runhash(hash1, data, midstate);
-		runhash(hash, hash1, sha256_init_state);
 
 		stat_ctr++;
 
-		if (unlikely((hash32[7] == 0) && fulltest(hash, target))) {
-			*last_nonce = n;
-			return true;
+		if (unlikely(sha256_precalc_h7(pc, n))) {
+			/* Only candidates get the full hash for fulltest */
+			*nonce = n;
+			runhash(hash1, data, midstate);
+			runhash(hash, hash1, sha256_init_state);
+			if (fulltest(hash, target)) {
+				*last_nonce = n;
+				return true;
+			}
 		}
 
 		if ((n >= max_nonce) || thr->work_restart) {
+			*nonce = n;
 			*last_nonce = n;
 			return false;
 		}
 	}
 }
-
@@ -142,9 +142,26 @@ struct cg_usb_stats_item {
 #define CMD_TIMEOUT 1
 #define CMD_ERROR 2
 
+/* Latency buckets are a quarter of a power of 2 wide, so a percentile is
+ * accurate to within about 10%, and run from 1us to a minute */
+#define HIST_SUB 4
+#define HIST_OCTAVES 25
+#define HIST_BUCKETS (HIST_OCTAVES * HIST_SUB)
+// Transfer size buckets are powers of 2 from 0 bytes to 64KB
+#define HIST_SIZES 18
+#define HIST_STRLEN (HIST_BUCKETS * 20)
+
+struct cg_usb_hist {
+	uint32_t latency[HIST_BUCKETS];
+	uint32_t size[HIST_SIZES];
+	uint64_t bytes;
+};
+
 struct cg_usb_stats_details {
 	int seq;
 	struct cg_usb_stats_item item[CMD_ERROR+1];
+	// Only allocated once the command has completed successfully
+	struct cg_usb_hist *hist;
 };
 
 struct cg_usb_stats {
@@ -158,6 +175,57 @@ struct cg_usb_stats {
 
 static struct cg_usb_stats *usb_stats = NULL;
 static int next_stat = 0;
+static int usb_stats_size = 0;
+static pthread_mutex_t usb_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * All transfers are asynchronous and are completed by the one thread
+ * handling libusb events, the blocking reads and writes just wait for
+ * their own transfer
+ */
+static pthread_t usb_events_thread;
+static bool usb_events_running = false;
+static volatile bool usb_events_stop = false;
+
+// How long each pass of the event thread waits in libusb
+#define USB_EVENTS_MS 100
+
+/*
+ * --usb-hotplug: usb_detect() remembers each driver's detect function to
+ * give it the devices plugged in later. The libusb hotplug callback only
+ * queues them for the hotplug thread, since it runs in the USB events
+ * thread which the detect needs for its own transfers. If libusb has no
+ * hotplug support the bus is listed again every USB_HOTPLUG_RESCAN_S
+ */
+struct usb_hotplug_drv {
+	struct device_drv *drv;
+	bool (*device_detect)(struct libusb_device *, struct usb_find_devices *);
+};
+
+#define USB_HOTPLUG_DRIVERS 8
+#define USB_HOTPLUG_QUEUE 64
+#define USB_HOTPLUG_RESCAN_S 2
+
+static struct usb_hotplug_drv hotplug_drvs[USB_HOTPLUG_DRIVERS];
+static int hotplug_ndrvs;
+
+static pthread_t usb_hotplug_thread;
+static bool usb_hotplug_running = false;
+static volatile bool usb_hotplug_stop = false;
+static pthread_mutex_t hotplug_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t hotplug_cond = PTHREAD_COND_INITIALIZER;
+static libusb_device *hotplug_queue[USB_HOTPLUG_QUEUE];
+static int hotplug_queued;
+static bool hotplug_rescan;
+static bool hotplug_callback;
+#ifdef LIBUSB_HOTPLUG_MATCH_ANY
+static libusb_hotplug_callback_handle hotplug_handle;
+#endif
+
+/* Devices seen on a rescan that no driver wanted, not retried until they
+ * are unplugged, as bus_number << 8 | device_address */
+static uint16_t hotplug_ignore[USB_HOTPLUG_QUEUE];
+static int hotplug_nignore;
 
 static const char **usb_commands;
 
@@ -188,6 +256,14 @@ static const char *C_GETIDENTIFY_S = "GetIdentify";
 static const char *C_REQUESTFLASH_S = "RequestFlash";
 static const char *C_REQUESTSENDWORK_S = "RequestSendWork";
 static const char *C_REQUESTSENDWORKSTATUS_S = "RequestSendWorkStatus";
+static const char *C_REQUESTQUEUEWORK_S = "RequestQueueWork";
+static const char *C_REQUESTQUEUEWORKSTATUS_S = "RequestQueueWorkStatus";
+static const char *C_QUEUEWORK_S = "QueueWork";
+static const char *C_QUEUEWORKSTATUS_S = "QueueWorkStatus";
+static const char *C_REQUESTQUEUERESULTS_S = "RequestQueueResults";
+static const char *C_GETQUEUERESULTS_S = "GetQueueResults";
+static const char *C_REQUESTQUEUEFLUSH_S = "RequestQueueFlush";
+static const char *C_QUEUEFLUSHSTATUS_S = "QueueFlushStatus";
 static const char *C_RESET_S = "Reset";
 static const char *C_SETBAUD_S = "SetBaud";
 static const char *C_SETDATA_S = "SetDataCtrl";
@@ -532,6 +608,21 @@ static void usb_all()
 	libusb_free_device_list(list, 1);
 }
 
+static void *usb_events(__maybe_unused void *userdata)
+{
+	struct timeval tv;
+
+	RenameThread("usbevents");
+
+	while (!usb_events_stop) {
+		tv.tv_sec = 0;
+		tv.tv_usec = USB_EVENTS_MS * 1000;
+		libusb_handle_events_timeout(NULL, &tv);
+	}
+
+	return NULL;
+}
+
 static void cgusb_check_init()
 {
 	mutex_lock(&cgusb_lock);
@@ -578,6 +669,14 @@ static void cgusb_check_init()
 		usb_commands[C_REQUESTFLASH] = C_REQUESTFLASH_S;
 		usb_commands[C_REQUESTSENDWORK] = C_REQUESTSENDWORK_S;
 		usb_commands[C_REQUESTSENDWORKSTATUS] = C_REQUESTSENDWORKSTATUS_S;
+		usb_commands[C_REQUESTQUEUEWORK] = C_REQUESTQUEUEWORK_S;
+		usb_commands[C_REQUESTQUEUEWORKSTATUS] = C_REQUESTQUEUEWORKSTATUS_S;
+		usb_commands[C_QUEUEWORK] = C_QUEUEWORK_S;
+		usb_commands[C_QUEUEWORKSTATUS] = C_QUEUEWORKSTATUS_S;
+		usb_commands[C_REQUESTQUEUERESULTS] = C_REQUESTQUEUERESULTS_S;
+		usb_commands[C_GETQUEUERESULTS] = C_GETQUEUERESULTS_S;
+		usb_commands[C_REQUESTQUEUEFLUSH] = C_REQUESTQUEUEFLUSH_S;
+		usb_commands[C_QUEUEFLUSHSTATUS] = C_QUEUEFLUSHSTATUS_S;
 		usb_commands[C_RESET] = C_RESET_S;
 		usb_commands[C_SETBAUD] = C_SETBAUD_S;
 		usb_commands[C_SETDATA] = C_SETDATA_S;
@@ -585,6 +684,10 @@ static void cgusb_check_init()
 		usb_commands[C_SETMODEM] = C_SETMODEM_S;
 		usb_commands[C_PURGERX] = C_PURGERX_S;
 		usb_commands[C_PURGETX] = C_PURGETX_S;
+
+		if (unlikely(pthread_create(&usb_events_thread, NULL, usb_events, NULL)))
+			quit(1, "Failed to create USB events thread");
+		usb_events_running = true;
 	}
 
 	mutex_unlock(&cgusb_lock);
@@ -698,6 +801,8 @@ static void release(uint8_t bus_number, uint8_t device_address, bool lock)
 	if (usb_tmp->next == usb_tmp) {
 		usb_head = NULL;
 	} else {
+		if (usb_head == usb_tmp)
+			usb_head = usb_tmp->next;
 		usb_tmp->next->prev = usb_tmp->prev;
 		usb_tmp->prev->next = usb_tmp->next;
 	}
@@ -739,6 +844,9 @@ static struct cg_usb_device *free_cgusb(struct cg_usb_device *cgusb)
 
 	free(cgusb->descriptor);
 
+	pthread_cond_destroy(&cgusb->xfer_cond);
+	pthread_mutex_destroy(&cgusb->xfer_lock);
+
 	free(cgusb);
 
 	return NULL;
@@ -746,6 +854,7 @@ static struct cg_usb_device *free_cgusb(struct cg_usb_device *cgusb)
 
 void usb_uninit(struct cgpu_info *cgpu)
 {
+	usb_drain(cgpu);
 	libusb_release_interface(cgpu->usbdev->handle, cgpu->usbdev->found->interface);
 	libusb_close(cgpu->usbdev->handle);
 	cgpu->usbdev = free_cgusb(cgpu->usbdev);
@@ -763,8 +872,18 @@ bool usb_init(struct cgpu_info *cgpu, struct libusb_device *dev, struct usb_find
 	cgusb = calloc(1, sizeof(*cgusb));
 	cgusb->found = found;
 
+	mutex_init(&cgusb->xfer_lock);
+	if (unlikely(pthread_cond_init(&cgusb->xfer_cond, NULL)))
+		quit(1, "USB init failed to pthread_cond_init xfer_cond");
+	INIT_LIST_HEAD(&cgusb->xfers);
+
 	cgusb->bus_number = libusb_get_bus_number(dev);
 	cgusb->device_address = libusb_get_device_address(dev);
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000102
+	err = libusb_get_port_numbers(dev, cgusb->port_numbers, sizeof(cgusb->port_numbers));
+	if (err > 0)
+		cgusb->port_count = err;
+#endif
 
 	cgusb->descriptor = calloc(1, sizeof(*(cgusb->descriptor)));
 
@@ -968,14 +1087,58 @@ static struct usb_find_devices *usb_check(__maybe_unused struct device_drv *drv,
 	return NULL;
 }
 
+static void usb_detect_dev(struct device_drv *drv, bool (*device_detect)(struct libusb_device *, struct usb_find_devices *), libusb_device *dev)
+{
+	struct usb_find_devices *found;
+
+	mutex_lock(list_lock);
+
+	if (in_use(dev, false))
+		mutex_unlock(list_lock);
+	else {
+		add_used(dev, false);
+
+		mutex_unlock(list_lock);
+
+		found = usb_check(drv, dev);
+		if (!found)
+			release_dev(dev, true);
+		else
+			if (!device_detect(dev, found))
+				release_dev(dev, true);
+	}
+}
+
+struct usb_detect_job {
+	struct device_drv *drv;
+	bool (*device_detect)(struct libusb_device *, struct usb_find_devices *);
+	libusb_device **list;
+};
+
+static void usb_detect_one(int i, void *arg)
+{
+	struct usb_detect_job *udj = arg;
+
+	usb_detect_dev(udj->drv, udj->device_detect, udj->list[i]);
+}
+
 void usb_detect(struct device_drv *drv, bool (*device_detect)(struct libusb_device *, struct usb_find_devices *))
 {
+	struct usb_detect_job udj;
 	libusb_device **list;
 	ssize_t count, i;
-	struct usb_find_devices *found;
 
 	cgusb_check_init();
 
+	for (i = 0; i < hotplug_ndrvs; i++)
+		if (hotplug_drvs[i].drv == drv)
+			break;
+	if (i == hotplug_ndrvs && hotplug_ndrvs < USB_HOTPLUG_DRIVERS) {
+		hotplug_drvs[hotplug_ndrvs].drv = drv;
+		hotplug_drvs[hotplug_ndrvs].device_detect = device_detect;
+		hotplug_ndrvs++;
+	}
+
 	count = libusb_get_device_list(NULL, &list);
 	if (count < 0) {
 		applog(LOG_DEBUG, "USB scan devices: failed, err %d", count);
@@ -985,24 +1148,10 @@ void usb_detect(struct device_drv *drv, bool (*device_detect)(struct libusb_devi
 	if (count == 0)
 		applog(LOG_DEBUG, "USB scan devices: found no devices");
 
-	for (i = 0; i < count; i++) {
-		mutex_lock(list_lock);
-
-		if (in_use(list[i], false))
-			mutex_unlock(list_lock);
-		else {
-			add_used(list[i], false);
-
-			mutex_unlock(list_lock);
-
-			found = usb_check(drv, list[i]);
-			if (!found)
-				release_dev(list[i], true);
-			else
-				if (!device_detect(list[i], found))
-					release_dev(list[i], true);
-		}
-	}
+	udj.drv = drv;
+	udj.device_detect = device_detect;
+	udj.list = list;
+	detect_parallel((int)count, usb_detect_one, &udj);
 
 	libusb_free_device_list(list, 1);
 }
@@ -1011,10 +1160,10 @@ void usb_detect(struct device_drv *drv, bool (*device_detect)(struct libusb_devi
 #define DO_USB_STATS 1
 
 #if DO_USB_STATS
-#define USB_STATS(sgpu, sta, fin, err, cmd, seq) stats(cgpu, sta, fin, err, cmd, seq)
+#define USB_STATS(sgpu, sta, fin, err, cmd, seq, siz) stats(cgpu, sta, fin, err, cmd, seq, siz)
 #define STATS_TIMEVAL(tv) gettimeofday(tv, NULL)
 #else
-#define USB_STATS(sgpu, sta, fin, err, cmd, seq)
+#define USB_STATS(sgpu, sta, fin, err, cmd, seq, siz)
 #define STATS_TIMEVAL(tv)
 #endif
 
@@ -1099,18 +1248,233 @@ struct api_data *api_usb_stats(__maybe_unused int *count)
 }
 
 #if DO_USB_STATS
+static int hist_bucket(uint64_t us)
+{
+	int octave = 0;
+	uint64_t v;
+
+	if (us < HIST_SUB)
+		return (int)us;
+
+	for (v = us; v >= HIST_SUB * 2; v >>= 1)
+		octave++;
+
+	if (octave >= HIST_OCTAVES - 1)
+		return HIST_BUCKETS - 1;
+
+	return (octave + 1) * HIST_SUB + (int)(v - HIST_SUB);
+}
+
+// The smallest latency in us that falls in bucket
+static uint64_t hist_floor(int bucket)
+{
+	if (bucket < HIST_SUB)
+		return bucket;
+
+	return (uint64_t)(HIST_SUB + bucket % HIST_SUB) << (bucket / HIST_SUB - 1);
+}
+
+static int hist_size_bucket(int size)
+{
+	int bucket = 0;
+
+	while (size > 0 && bucket < HIST_SIZES - 1) {
+		size >>= 1;
+		bucket++;
+	}
+
+	return bucket;
+}
+
+/* The latency in seconds that pct of the transfers completed within,
+ * taken as the top of the bucket it falls in but no more than the max */
+static double hist_percentile(struct cg_usb_stats_details *details, double pct)
+{
+	struct cg_usb_hist *hist = details->hist;
+	uint64_t count = details->item[CMD_CMD].count;
+	uint64_t want, seen = 0;
+	double delay;
+	int i;
+
+	want = (uint64_t)(count * pct / 100.0 + 0.5);
+	if (want < 1)
+		want = 1;
+
+	for (i = 0; i < HIST_BUCKETS - 1; i++) {
+		seen += hist->latency[i];
+		if (seen >= want)
+			break;
+	}
+
+	delay = (double)hist_floor(i + 1) / 1000000.0;
+	if (delay > details->item[CMD_CMD].max_delay)
+		delay = details->item[CMD_CMD].max_delay;
+
+	return delay;
+}
+
+// Non empty buckets as "floor:count ..." with the floor in us or bytes
+static void hist_str(char *buf, uint32_t *bucket, int buckets, bool size)
+{
+	uint64_t floor;
+	int i;
+
+	*buf = '\0';
+	for (i = 0; i < buckets; i++) {
+		if (!bucket[i])
+			continue;
+		if (size)
+			floor = i ? (1 << (i - 1)) : 0;
+		else
+			floor = hist_floor(i);
+		sprintf(buf + strlen(buf), "%s%"PRIu64":%u",
+			*buf ? " " : "", floor, bucket[i]);
+	}
+}
+#endif
+
+// Same caveat as api_usb_stats() about not locking the stat data
+struct api_data *api_usb_latency(__maybe_unused int *count)
+{
+#if DO_USB_STATS
+	struct cg_usb_stats_details *details;
+	struct cg_usb_stats *sta;
+	struct api_data *root = NULL;
+	struct cg_usb_hist *hist;
+	char buf[HIST_STRLEN];
+	uint64_t ok;
+	double delay;
+	int device;
+	int cmdseq;
+
+	cgusb_check_init();
+
+	if (next_stat == 0)
+		return NULL;
+
+	while (*count < next_stat * C_MAX * 2) {
+		device = *count / (C_MAX * 2);
+		cmdseq = *count % (C_MAX * 2);
+
+		(*count)++;
+
+		sta = &(usb_stats[device]);
+		details = &(sta->details[cmdseq]);
+		hist = details->hist;
+
+		if (!hist &&
+		    details->item[CMD_TIMEOUT].count == 0 &&
+		    details->item[CMD_ERROR].count == 0)
+			continue;
+
+		ok = details->item[CMD_CMD].count;
+
+		root = api_add_string(root, "Name", sta->name, false);
+		root = api_add_int(root, "ID", &(sta->device_id), false);
+		root = api_add_const(root, "Stat", usb_commands[cmdseq/2], false);
+		root = api_add_int(root, "Seq", &(details->seq), true);
+		root = api_add_uint64(root, "Count", &ok, true);
+		root = api_add_uint64(root, "Timeout Count",
+					&(details->item[CMD_TIMEOUT].count), true);
+		root = api_add_uint64(root, "Error Count",
+					&(details->item[CMD_ERROR].count), true);
+
+		if (hist && ok) {
+			delay = hist_percentile(details, 50.0);
+			root = api_add_double(root, "P50 Delay", &delay, true);
+			delay = hist_percentile(details, 90.0);
+			root = api_add_double(root, "P90 Delay", &delay, true);
+			delay = hist_percentile(details, 99.0);
+			root = api_add_double(root, "P99 Delay", &delay, true);
+			delay = hist_percentile(details, 99.9);
+			root = api_add_double(root, "P999 Delay", &delay, true);
+			root = api_add_double(root, "Max Delay",
+						&(details->item[CMD_CMD].max_delay), true);
+			root = api_add_uint64(root, "Bytes", &(hist->bytes), true);
+			hist_str(buf, hist->latency, HIST_BUCKETS, false);
+			root = api_add_string(root, "Latency Histogram", buf, true);
+			hist_str(buf, hist->size, HIST_SIZES, true);
+			root = api_add_string(root, "Size Histogram", buf, true);
+		}
+
+		return root;
+	}
+#endif
+	return NULL;
+}
+
+// Log the latency percentiles of every command each device has used
+void usb_latency_dump()
+{
+#if DO_USB_STATS
+	struct cg_usb_stats_details *details;
+	struct cg_usb_stats *sta;
+	struct cg_usb_hist *hist;
+	uint64_t ok;
+	int device;
+	int cmdseq;
+
+	cgusb_check_init();
+
+	for (device = 0; device < next_stat; device++) {
+		sta = &(usb_stats[device]);
+		for (cmdseq = 0; cmdseq < C_MAX * 2; cmdseq++) {
+			details = &(sta->details[cmdseq]);
+			hist = details->hist;
+			ok = details->item[CMD_CMD].count;
+			if (!hist || !ok)
+				continue;
+
+			applog(LOG_WARNING, "USB %s%d %s%s: %"PRIu64" p50 %.3fms p90 %.3fms p99 %.3fms p99.9 %.3fms max %.3fms, %"PRIu64" timeouts, %"PRIu64" errors, avg %"PRIu64" bytes",
+				sta->name, sta->device_id, usb_commands[cmdseq/2],
+				details->seq ? " seq 1" : "", ok,
+				hist_percentile(details, 50.0) * 1000.0,
+				hist_percentile(details, 90.0) * 1000.0,
+				hist_percentile(details, 99.0) * 1000.0,
+				hist_percentile(details, 99.9) * 1000.0,
+				details->item[CMD_CMD].max_delay * 1000.0,
+				details->item[CMD_TIMEOUT].count,
+				details->item[CMD_ERROR].count,
+				hist->bytes / ok);
+		}
+	}
+#endif
+}
+
+#if DO_USB_STATS
+/* Hotplug adds devices while the USB events thread is using usb_stats,
+ * so it grows into a new copy and the old one is never freed */
 static void newstats(struct cgpu_info *cgpu)
 {
+	struct cg_usb_stats *stats;
 	int i;
 
-	cgpu->usbstat = ++next_stat;
+	mutex_lock(&usb_stats_lock);
+
+	if (cgpu->usbstat > 0) {
+		mutex_unlock(&usb_stats_lock);
+		return;
+	}
 
-	usb_stats = realloc(usb_stats, sizeof(*usb_stats) * next_stat);
-	usb_stats[next_stat-1].name = cgpu->drv->name;
-	usb_stats[next_stat-1].device_id = -1;
-	usb_stats[next_stat-1].details = calloc(1, sizeof(struct cg_usb_stats_details) * C_MAX * 2);
+	if (next_stat == usb_stats_size) {
+		usb_stats_size = usb_stats_size ? usb_stats_size * 2 : 16;
+		stats = calloc(usb_stats_size, sizeof(*stats));
+		if (unlikely(!stats))
+			quit(1, "USB failed to calloc usb_stats");
+		if (next_stat)
+			memcpy(stats, usb_stats, sizeof(*stats) * next_stat);
+		usb_stats = stats;
+	}
+
+	usb_stats[next_stat].name = cgpu->drv->name;
+	usb_stats[next_stat].device_id = -1;
+	usb_stats[next_stat].details = calloc(1, sizeof(struct cg_usb_stats_details) * C_MAX * 2);
 	for (i = 1; i < C_MAX * 2; i += 2)
-		usb_stats[next_stat-1].details[i].seq = 1;
+		usb_stats[next_stat].details[i].seq = 1;
+
+	cgpu->usbstat = ++next_stat;
+
+	mutex_unlock(&usb_stats_lock);
 }
 #endif
 
@@ -1126,9 +1490,10 @@ void update_usb_stats(__maybe_unused struct cgpu_info *cgpu)
 }
 
 #if DO_USB_STATS
-static void stats(struct cgpu_info *cgpu, struct timeval *tv_start, struct timeval *tv_finish, int err, enum usb_cmds cmd, int seq)
+static void stats(struct cgpu_info *cgpu, struct timeval *tv_start, struct timeval *tv_finish, int err, enum usb_cmds cmd, int seq, int size)
 {
 	struct cg_usb_stats_details *details;
+	struct cg_usb_hist *hist;
 	double diff;
 	int item;
 
@@ -1163,15 +1528,227 @@ static void stats(struct cgpu_info *cgpu, struct timeval *tv_start, struct timev
 	details->item[item].total_delay += diff;
 	memcpy(&(details->item[item].last), tv_start, sizeof(tv_start));
 	details->item[item].count++;
+
+	if (item != CMD_CMD)
+		return;
+
+	// All completions are in the USB events thread so this needs no lock
+	hist = details->hist;
+	if (unlikely(!hist)) {
+		hist = calloc(1, sizeof(*hist));
+		if (unlikely(!hist))
+			return;
+		details->hist = hist;
+	}
+
+	hist->latency[hist_bucket((uint64_t)(diff * 1000000.0))]++;
+	hist->size[hist_size_bucket(size)]++;
+	hist->bytes += size;
 }
 #endif
 
-int _usb_read(struct cgpu_info *cgpu, int ep, char *buf, size_t bufsiz, int *processed, unsigned int timeout, int eol, enum usb_cmds cmd, bool ftdi)
+static int usb_xfer_err(enum libusb_transfer_status status)
 {
+	switch (status) {
+		case LIBUSB_TRANSFER_COMPLETED:
+			return LIBUSB_SUCCESS;
+		case LIBUSB_TRANSFER_TIMED_OUT:
+			return LIBUSB_ERROR_TIMEOUT;
+		case LIBUSB_TRANSFER_STALL:
+			return LIBUSB_ERROR_PIPE;
+		case LIBUSB_TRANSFER_NO_DEVICE:
+			return LIBUSB_ERROR_NO_DEVICE;
+		case LIBUSB_TRANSFER_OVERFLOW:
+			return LIBUSB_ERROR_OVERFLOW;
+		default:
+			return LIBUSB_ERROR_IO;
+	}
+}
+
+static void usb_xfer_free(struct cg_usb_xfer *xfer)
+{
+	libusb_free_transfer(xfer->transfer);
+	free(xfer);
+}
+
+// Runs in the USB events thread
+static void LIBUSB_CALL usb_xfer_complete(struct libusb_transfer *transfer)
+{
+	struct cg_usb_xfer *xfer = (struct cg_usb_xfer *)(transfer->user_data);
+	struct cgpu_info *cgpu = xfer->cgpu;
 	struct cg_usb_device *usbdev = cgpu->usbdev;
 #if DO_USB_STATS
-	struct timeval tv_start;
+	struct timeval tv_finish;
 #endif
+	char *buf = (char *)(transfer->buffer);
+	bool detached;
+	int got;
+
+	STATS_TIMEVAL(&tv_finish);
+	xfer->err = usb_xfer_err(transfer->status);
+	USB_STATS(cgpu, &(xfer->tv_start), &tv_finish, xfer->err, xfer->cmd, xfer->seq, transfer->actual_length);
+
+	got = transfer->actual_length;
+	if (xfer->ftdi) {
+		// first 2 bytes returned are an FTDI status
+		if (got > 2) {
+			got -= 2;
+			memmove(buf, buf+2, got+1);
+		} else {
+			got = 0;
+			*buf = '\0';
+		}
+	}
+	xfer->processed = got;
+
+	if (xfer->callback)
+		xfer->callback(cgpu, xfer);
+
+	mutex_lock(&usbdev->xfer_lock);
+	list_del(&xfer->list);
+	usbdev->in_flight--;
+	if (unlikely(xfer->err == LIBUSB_ERROR_NO_DEVICE))
+		usbdev->nodev = true;
+	xfer->done = true;
+	detached = xfer->detached;
+	pthread_cond_broadcast(&usbdev->xfer_cond);
+	mutex_unlock(&usbdev->xfer_lock);
+
+	if (detached)
+		usb_xfer_free(xfer);
+}
+
+static struct cg_usb_xfer *usb_xfer_alloc(struct cgpu_info *cgpu, enum usb_cmds cmd, int seq, bool ftdi, usb_callback_t callback, void *data)
+{
+	struct cg_usb_xfer *xfer;
+
+	xfer = calloc(1, sizeof(*xfer));
+	if (unlikely(!xfer))
+		quit(1, "USB failed to calloc xfer");
+
+	xfer->transfer = libusb_alloc_transfer(0);
+	if (unlikely(!xfer->transfer))
+		quit(1, "USB failed to libusb_alloc_transfer");
+
+	xfer->cgpu = cgpu;
+	xfer->cmd = cmd;
+	xfer->seq = seq;
+	xfer->ftdi = ftdi;
+	xfer->callback = callback;
+	xfer->data = data;
+
+	return xfer;
+}
+
+// The transfer is on the device's in flight list before it is submitted
+// since it can complete before libusb_submit_transfer() returns
+static int usb_xfer_submit(struct cg_usb_xfer *xfer, bool detached)
+{
+	struct cg_usb_device *usbdev = xfer->cgpu->usbdev;
+	int err;
+
+	mutex_lock(&usbdev->xfer_lock);
+	// Once it's gone the handle may already be closed
+	if (unlikely(usbdev->nodev)) {
+		mutex_unlock(&usbdev->xfer_lock);
+		usb_xfer_free(xfer);
+		return LIBUSB_ERROR_NO_DEVICE;
+	}
+	list_add_tail(&xfer->list, &usbdev->xfers);
+	usbdev->in_flight++;
+	xfer->detached = detached;
+	mutex_unlock(&usbdev->xfer_lock);
+
+	STATS_TIMEVAL(&(xfer->tv_start));
+	err = libusb_submit_transfer(xfer->transfer);
+	if (unlikely(err)) {
+		mutex_lock(&usbdev->xfer_lock);
+		list_del(&xfer->list);
+		usbdev->in_flight--;
+		if (err == LIBUSB_ERROR_NO_DEVICE)
+			usbdev->nodev = true;
+		pthread_cond_broadcast(&usbdev->xfer_cond);
+		mutex_unlock(&usbdev->xfer_lock);
+
+		usb_xfer_free(xfer);
+	}
+
+	return err;
+}
+
+static struct cg_usb_xfer *usb_start_bulk(struct cgpu_info *cgpu, int ep, char *buf, size_t bufsiz, unsigned int timeout, enum usb_cmds cmd, int seq, bool ftdi, usb_callback_t callback, void *data, bool detached, int *err)
+{
+	struct cg_usb_device *usbdev = cgpu->usbdev;
+	struct cg_usb_xfer *xfer;
+
+	if (timeout == DEVTIMEOUT)
+		timeout = usbdev->found->timeout;
+
+	xfer = usb_xfer_alloc(cgpu, cmd, seq, ftdi, callback, data);
+	libusb_fill_bulk_transfer(xfer->transfer, usbdev->handle,
+			usbdev->found->eps[ep].ep,
+			(unsigned char *)buf, bufsiz,
+			usb_xfer_complete, xfer, timeout);
+
+	*err = usb_xfer_submit(xfer, detached);
+	if (*err)
+		return NULL;
+
+	return xfer;
+}
+
+struct cg_usb_xfer *_usb_start(struct cgpu_info *cgpu, int ep, char *buf, size_t bufsiz, unsigned int timeout, enum usb_cmds cmd, bool ftdi, usb_callback_t callback, void *data, int *err)
+{
+	return usb_start_bulk(cgpu, ep, buf, bufsiz, timeout, cmd, SEQ0, ftdi, callback, data, false, err);
+}
+
+int _usb_submit(struct cgpu_info *cgpu, int ep, char *buf, size_t bufsiz, unsigned int timeout, enum usb_cmds cmd, bool ftdi, usb_callback_t callback, void *data)
+{
+	int err;
+
+	usb_start_bulk(cgpu, ep, buf, bufsiz, timeout, cmd, SEQ0, ftdi, callback, data, true, &err);
+
+	return err;
+}
+
+// Wait for a transfer from usb_start_*() to complete and free it
+int usb_finish(struct cg_usb_xfer *xfer, int *processed)
+{
+	struct cg_usb_device *usbdev = xfer->cgpu->usbdev;
+	int err;
+
+	mutex_lock(&usbdev->xfer_lock);
+	while (!xfer->done)
+		pthread_cond_wait(&usbdev->xfer_cond, &usbdev->xfer_lock);
+	mutex_unlock(&usbdev->xfer_lock);
+
+	if (processed)
+		*processed = xfer->processed;
+	err = xfer->err;
+
+	usb_xfer_free(xfer);
+
+	return err;
+}
+
+// Cancel everything the device has in flight and wait for it to complete
+void usb_drain(struct cgpu_info *cgpu)
+{
+	struct cg_usb_device *usbdev = cgpu->usbdev;
+	struct cg_usb_xfer *xfer;
+
+	mutex_lock(&usbdev->xfer_lock);
+	list_for_each_entry(xfer, &usbdev->xfers, list)
+		libusb_cancel_transfer(xfer->transfer);
+	while (usbdev->in_flight)
+		pthread_cond_wait(&usbdev->xfer_cond, &usbdev->xfer_lock);
+	mutex_unlock(&usbdev->xfer_lock);
+}
+
+int _usb_read(struct cgpu_info *cgpu, int ep, char *buf, size_t bufsiz, int *processed, unsigned int timeout, int eol, enum usb_cmds cmd, bool ftdi)
+{
+	struct cg_usb_device *usbdev = cgpu->usbdev;
+	struct cg_usb_xfer *xfer;
 	struct timeval read_start, tv_finish;
 	unsigned int initial_timeout;
 	double max, done;
@@ -1183,24 +1760,9 @@ int _usb_read(struct cgpu_info *cgpu, int ep, char *buf, size_t bufsiz, int *pro
 
 	if (eol == -1) {
 		got = 0;
-		STATS_TIMEVAL(&tv_start);
-		err = libusb_bulk_transfer(usbdev->handle,
-				usbdev->found->eps[ep].ep,
-				(unsigned char *)buf,
-				bufsiz, &got, timeout);
-		STATS_TIMEVAL(&tv_finish);
-		USB_STATS(cgpu, &tv_start, &tv_finish, err, cmd, SEQ0);
-
-		if (ftdi) {
-			// first 2 bytes returned are an FTDI status
-			if (got > 2) {
-				got -= 2;
-				memmove(buf, buf+2, got+1);
-			} else {
-				got = 0;
-				*buf = '\0';
-			}
-		}
+		xfer = usb_start_bulk(cgpu, ep, buf, bufsiz, timeout, cmd, SEQ0, ftdi, NULL, NULL, false, &err);
+		if (xfer)
+			err = usb_finish(xfer, &got);
 
 		*processed = got;
 
@@ -1214,24 +1776,10 @@ int _usb_read(struct cgpu_info *cgpu, int ep, char *buf, size_t bufsiz, int *pro
 	gettimeofday(&read_start, NULL);
 	while (bufsiz) {
 		got = 0;
-		STATS_TIMEVAL(&tv_start);
-		err = libusb_bulk_transfer(usbdev->handle,
-				usbdev->found->eps[ep].ep,
-				(unsigned char *)buf,
-				bufsiz, &got, timeout);
+		xfer = usb_start_bulk(cgpu, ep, buf, bufsiz, timeout, cmd, first ? SEQ0 : SEQ1, ftdi, NULL, NULL, false, &err);
+		if (xfer)
+			err = usb_finish(xfer, &got);
 		gettimeofday(&tv_finish, NULL);
-		USB_STATS(cgpu, &tv_start, &tv_finish, err, cmd, first ? SEQ0 : SEQ1);
-
-		if (ftdi) {
-			// first 2 bytes returned are an FTDI status
-			if (got > 2) {
-				got -= 2;
-				memmove(buf, buf+2, got+1);
-			} else {
-				got = 0;
-				*buf = '\0';
-			}
-		}
 
 		tot += got;
 
@@ -1265,21 +1813,13 @@ goteol:
 
 int _usb_write(struct cgpu_info *cgpu, int ep, char *buf, size_t bufsiz, int *processed, unsigned int timeout, enum usb_cmds cmd)
 {
-	struct cg_usb_device *usbdev = cgpu->usbdev;
-#if DO_USB_STATS
-	struct timeval tv_start, tv_finish;
-#endif
+	struct cg_usb_xfer *xfer;
 	int err, sent;
 
 	sent = 0;
-	STATS_TIMEVAL(&tv_start);
-	err = libusb_bulk_transfer(usbdev->handle,
-			usbdev->found->eps[ep].ep,
-			(unsigned char *)buf,
-			bufsiz, &sent,
-			timeout == DEVTIMEOUT ? usbdev->found->timeout : timeout);
-	STATS_TIMEVAL(&tv_finish);
-	USB_STATS(cgpu, &tv_start, &tv_finish, err, cmd, SEQ0);
+	xfer = usb_start_bulk(cgpu, ep, buf, bufsiz, timeout, cmd, SEQ0, false, NULL, NULL, false, &err);
+	if (xfer)
+		err = usb_finish(xfer, &sent);
 
 	*processed = sent;
 
@@ -1289,22 +1829,235 @@ int _usb_write(struct cgpu_info *cgpu, int ep, char *buf, size_t bufsiz, int *pr
 int _usb_transfer(struct cgpu_info *cgpu, uint8_t request_type, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, unsigned int timeout, enum usb_cmds cmd)
 {
 	struct cg_usb_device *usbdev = cgpu->usbdev;
-#if DO_USB_STATS
-	struct timeval tv_start, tv_finish;
-#endif
+	struct cg_usb_xfer *xfer;
 	int err;
 
-	STATS_TIMEVAL(&tv_start);
-	err = libusb_control_transfer(usbdev->handle, request_type,
-		bRequest, wValue, wIndex, NULL, 0,
+	xfer = usb_xfer_alloc(cgpu, cmd, SEQ0, false, NULL, NULL);
+	libusb_fill_control_setup(xfer->setup, request_type, bRequest, wValue, wIndex, 0);
+	libusb_fill_control_transfer(xfer->transfer, usbdev->handle, xfer->setup,
+		usb_xfer_complete, xfer,
 		timeout == DEVTIMEOUT ? usbdev->found->timeout : timeout);
-	STATS_TIMEVAL(&tv_finish);
-	USB_STATS(cgpu, &tv_start, &tv_finish, err, cmd, SEQ0);
+
+	err = usb_xfer_submit(xfer, false);
+	if (!err)
+		err = usb_finish(xfer, NULL);
 
 	return err;
 }
 
+bool usb_nodev(struct cgpu_info *cgpu)
+{
+	return cgpu->usbdev->nodev;
+}
+
+/* Once a device is unplugged give up its handle and address, though the
+ * cg_usb_device is kept since every cgpu sharing it still points to it */
+void usb_nodev_release(struct cgpu_info *cgpu)
+{
+	struct cg_usb_device *usbdev = cgpu->usbdev;
+	bool first;
+
+	cgpu->unplugged = true;
+	usb_drain(cgpu);
+
+	mutex_lock(&usbdev->xfer_lock);
+	first = !usbdev->released;
+	usbdev->released = true;
+	mutex_unlock(&usbdev->xfer_lock);
+
+	if (!first)
+		return;
+
+	libusb_release_interface(usbdev->handle, usbdev->found->interface);
+	libusb_close(usbdev->handle);
+	release(usbdev->bus_number, usbdev->device_address, true);
+
+	applog(LOG_WARNING, "%s%i: USB device %d:%d unplugged",
+		cgpu->drv->name, cgpu->device_id,
+		(int)(usbdev->bus_number), (int)(usbdev->device_address));
+}
+
+/* Whether cgpu, just detected, is the unplugged old come back. The
+ * address changes each time it is plugged in, so it is known by its serial
+ * number or, if it has none, by the bus and port it is plugged into */
+bool usb_same_device(struct cgpu_info *old, struct cgpu_info *cgpu)
+{
+	struct cg_usb_device *was = old->usbdev, *now = cgpu->usbdev;
+
+#ifdef USE_MODMINER
+	// Each FPGA of a board is a separate device with the same serial
+	if (old->fpgaid != cgpu->fpgaid)
+		return false;
+#endif
+	if (was->serial_string != BLANK || now->serial_string != BLANK)
+		return !strcmp(was->serial_string, now->serial_string);
+
+	return was->bus_number == now->bus_number
+	&&     was->port_count == now->port_count
+	&&     !memcmp(was->port_numbers, now->port_numbers, was->port_count);
+}
+
+static void usb_hotplug_detect(libusb_device *dev)
+{
+	int i;
+
+	for (i = 0; i < hotplug_ndrvs; i++)
+		usb_detect_dev(hotplug_drvs[i].drv, hotplug_drvs[i].device_detect, dev);
+}
+
+static uint16_t usb_hotplug_key(libusb_device *dev)
+{
+	return (uint16_t)libusb_get_bus_number(dev) << 8 | libusb_get_device_address(dev);
+}
+
+/* List the bus and try every device not in use or already ignored, then
+ * ignore whatever is still unused. With init, only do the ignoring */
+static void usb_hotplug_scan(bool init)
+{
+	uint16_t ignore[USB_HOTPLUG_QUEUE];
+	libusb_device **list;
+	ssize_t count, i;
+	int j, nignore = 0;
+	uint16_t key;
+
+	count = libusb_get_device_list(NULL, &list);
+	if (count < 0) {
+		applog(LOG_DEBUG, "USB hotplug scan: failed, err %d", (int)count);
+		return;
+	}
+
+	for (i = 0; i < count; i++) {
+		key = usb_hotplug_key(list[i]);
+		for (j = 0; j < hotplug_nignore; j++)
+			if (hotplug_ignore[j] == key)
+				break;
+
+		if (j == hotplug_nignore && !init)
+			usb_hotplug_detect(list[i]);
+
+		// Keep only the ignored devices that are still there
+		if (!in_use(list[i], true) && nignore < USB_HOTPLUG_QUEUE)
+			ignore[nignore++] = key;
+	}
+
+	memcpy(hotplug_ignore, ignore, sizeof(*ignore) * nignore);
+	hotplug_nignore = nignore;
+
+	libusb_free_device_list(list, 1);
+}
+
+#ifdef LIBUSB_HOTPLUG_MATCH_ANY
+// Runs in the USB events thread
+static int LIBUSB_CALL usb_hotplug_arrived(__maybe_unused libusb_context *ctx, libusb_device *dev, __maybe_unused libusb_hotplug_event event, __maybe_unused void *user_data)
+{
+	mutex_lock(&hotplug_lock);
+	if (hotplug_queued < USB_HOTPLUG_QUEUE)
+		hotplug_queue[hotplug_queued++] = libusb_ref_device(dev);
+	else
+		hotplug_rescan = true;
+	pthread_cond_signal(&hotplug_cond);
+	mutex_unlock(&hotplug_lock);
+
+	return 0;
+}
+#endif
+
+static void *usb_hotplug(__maybe_unused void *userdata)
+{
+	libusb_device *queue[USB_HOTPLUG_QUEUE];
+	struct timespec abstime;
+	struct timeval now;
+	int i, queued;
+	bool rescan;
+
+	RenameThread("usbhotplug");
+
+	while (!usb_hotplug_stop) {
+		mutex_lock(&hotplug_lock);
+		if (!hotplug_queued && !hotplug_rescan) {
+			gettimeofday(&now, NULL);
+			abstime.tv_sec = now.tv_sec + USB_HOTPLUG_RESCAN_S;
+			abstime.tv_nsec = now.tv_usec * 1000;
+			pthread_cond_timedwait(&hotplug_cond, &hotplug_lock, &abstime);
+		}
+		queued = hotplug_queued;
+		memcpy(queue, hotplug_queue, sizeof(*queue) * queued);
+		hotplug_queued = 0;
+		rescan = hotplug_rescan || !hotplug_callback;
+		hotplug_rescan = false;
+		mutex_unlock(&hotplug_lock);
+
+		if (usb_hotplug_stop) {
+			for (i = 0; i < queued; i++)
+				libusb_unref_device(queue[i]);
+			break;
+		}
+
+		for (i = 0; i < queued; i++) {
+			usb_hotplug_detect(queue[i]);
+			libusb_unref_device(queue[i]);
+		}
+
+		if (rescan)
+			usb_hotplug_scan(false);
+
+		hotplug_process();
+	}
+
+	return NULL;
+}
+
+void usb_hotplug_init()
+{
+	cgusb_check_init();
+
+	// Only look at what arrives from now on
+	usb_hotplug_scan(true);
+
+#ifdef LIBUSB_HOTPLUG_MATCH_ANY
+	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+		int err;
+
+		err = libusb_hotplug_register_callback(NULL, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
+				LIBUSB_HOTPLUG_NO_FLAGS, LIBUSB_HOTPLUG_MATCH_ANY,
+				LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+				usb_hotplug_arrived, NULL, &hotplug_handle);
+		if (err)
+			applog(LOG_DEBUG, "USB hotplug: register callback failed, err %d", err);
+		else
+			hotplug_callback = true;
+	}
+#endif
+
+	if (hotplug_callback)
+		applog(LOG_NOTICE, "USB hotplug: waiting for new devices");
+	else
+		applog(LOG_NOTICE, "USB hotplug: not supported by libusb, checking for new devices every %ds",
+			USB_HOTPLUG_RESCAN_S);
+
+	if (unlikely(pthread_create(&usb_hotplug_thread, NULL, usb_hotplug, NULL)))
+		quit(1, "Failed to create USB hotplug thread");
+	usb_hotplug_running = true;
+}
+
 void usb_cleanup()
 {
-	// TODO:
+	if (usb_hotplug_running) {
+#ifdef LIBUSB_HOTPLUG_MATCH_ANY
+		if (hotplug_callback)
+			libusb_hotplug_deregister_callback(NULL, hotplug_handle);
+#endif
+		mutex_lock(&hotplug_lock);
+		usb_hotplug_stop = true;
+		pthread_cond_signal(&hotplug_cond);
+		mutex_unlock(&hotplug_lock);
+		pthread_join(usb_hotplug_thread, NULL);
+		usb_hotplug_running = false;
+	}
+
+	if (usb_events_running) {
+		usb_events_stop = true;
+		pthread_join(usb_events_thread, NULL);
+		usb_events_running = false;
+	}
 }
@@ -12,6 +12,8 @@
 
 #include <libusb.h>
 
+#include "elist.h"
+
 // for 0x0403/0x6014 FT232H (and possibly others?)
 #define FTDI_TYPE_OUT (LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_OUT)
 
@@ -76,6 +78,15 @@ struct cg_usb_device {
 	char *serial_string;
 	unsigned char fwVersion;	// ??
 	unsigned char interfaceVersion;	// ??
+	pthread_mutex_t xfer_lock;
+	pthread_cond_t xfer_cond;
+	struct list_head xfers;		// in flight, oldest first
+	int in_flight;
+	bool nodev;			// unplugged, no more transfers
+	bool released;
+	// Where it is plugged in, for --usb-hotplug to know it again
+	uint8_t port_numbers[8];
+	int port_count;
 };
 
 enum usb_cmds {
@@ -106,6 +117,14 @@ enum usb_cmds {
 	C_REQUESTFLASH,
 	C_REQUESTSENDWORK,
 	C_REQUESTSENDWORKSTATUS,
+	C_REQUESTQUEUEWORK,
+	C_REQUESTQUEUEWORKSTATUS,
+	C_QUEUEWORK,
+	C_QUEUEWORKSTATUS,
+	C_REQUESTQUEUERESULTS,
+	C_GETQUEUERESULTS,
+	C_REQUESTQUEUEFLUSH,
+	C_QUEUEFLUSHSTATUS,
 	C_RESET,
 	C_SETBAUD,
 	C_SETDATA,
@@ -118,15 +137,48 @@ enum usb_cmds {
 
 struct device_drv;
 struct cgpu_info;
+struct cg_usb_xfer;
+
+// Called from the USB event thread when a transfer completes, so it must
+// not block or start a transfer it then waits on
+typedef void (*usb_callback_t)(struct cgpu_info *cgpu, struct cg_usb_xfer *xfer);
+
+struct cg_usb_xfer {
+	struct list_head list;
+	struct libusb_transfer *transfer;
+	struct cgpu_info *cgpu;
+	enum usb_cmds cmd;
+	int seq;
+	bool ftdi;
+	bool detached;
+	bool done;
+	// Completion results, valid in the callback and after usb_finish()
+	int err;
+	int processed;
+	usb_callback_t callback;
+	void *data;
+	struct timeval tv_start;
+	unsigned char setup[LIBUSB_CONTROL_SETUP_SIZE];
+};
 
 void usb_uninit(struct cgpu_info *cgpu);
 bool usb_init(struct cgpu_info *cgpu, struct libusb_device *dev, struct usb_find_devices *found);
 void usb_detect(struct device_drv *drv, bool (*device_detect)(struct libusb_device *, struct usb_find_devices *));
 struct api_data *api_usb_stats(int *count);
+struct api_data *api_usb_latency(int *count);
+void usb_latency_dump();
+bool usb_nodev(struct cgpu_info *cgpu);
+void usb_nodev_release(struct cgpu_info *cgpu);
+bool usb_same_device(struct cgpu_info *old, struct cgpu_info *cgpu);
+void usb_hotplug_init();
 void update_usb_stats(struct cgpu_info *cgpu);
 int _usb_read(struct cgpu_info *cgpu, int ep, char *buf, size_t bufsiz, int *processed, unsigned int timeout, int eol, enum usb_cmds, bool ftdi);
 int _usb_write(struct cgpu_info *cgpu, int ep, char *buf, size_t bufsiz, int *processed, unsigned int timeout, enum usb_cmds);
 int _usb_transfer(struct cgpu_info *cgpu, uint8_t request_type, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, unsigned int timeout, enum usb_cmds cmd);
+struct cg_usb_xfer *_usb_start(struct cgpu_info *cgpu, int ep, char *buf, size_t bufsiz, unsigned int timeout, enum usb_cmds cmd, bool ftdi, usb_callback_t callback, void *data, int *err);
+int _usb_submit(struct cgpu_info *cgpu, int ep, char *buf, size_t bufsiz, unsigned int timeout, enum usb_cmds cmd, bool ftdi, usb_callback_t callback, void *data);
+int usb_finish(struct cg_usb_xfer *xfer, int *processed);
+void usb_drain(struct cgpu_info *cgpu);
 void usb_cleanup();
 
 #define usb_read(cgpu, buf, bufsiz, read, cmd) \
@@ -162,4 +214,36 @@ void usb_cleanup();
 #define usb_transfer(cgpu, typ, req, val, idx, cmd) \
 	_usb_transfer(cgpu, typ, req, val, idx, DEVTIMEOUT, cmd)
 
+/*
+ * Asynchronous transfers. usb_start_*() queue the transfer on the device and
+ * return a handle that must be passed to usb_finish() to wait for it and get
+ * the result, so a driver can e.g. start reading the reply to one command
+ * while it writes the next. usb_submit_*() are fire and forget, the transfer
+ * is freed once the (optional) callback returns. The buffer must stay valid
+ * until the transfer completes.
+ */
+#define usb_start_read(cgpu, buf, bufsiz, cmd, err) \
+	_usb_start(cgpu, DEFAULT_EP_IN, buf, bufsiz, DEVTIMEOUT, cmd, false, NULL, NULL, err)
+
+#define usb_start_read_timeout(cgpu, buf, bufsiz, timeout, cmd, err) \
+	_usb_start(cgpu, DEFAULT_EP_IN, buf, bufsiz, timeout, cmd, false, NULL, NULL, err)
+
+#define usb_start_write(cgpu, buf, bufsiz, cmd, err) \
+	_usb_start(cgpu, DEFAULT_EP_OUT, buf, bufsiz, DEVTIMEOUT, cmd, false, NULL, NULL, err)
+
+#define usb_start_write_timeout(cgpu, buf, bufsiz, timeout, cmd, err) \
+	_usb_start(cgpu, DEFAULT_EP_OUT, buf, bufsiz, timeout, cmd, false, NULL, NULL, err)
+
+#define usb_ftdi_start_read(cgpu, buf, bufsiz, cmd, err) \
+	_usb_start(cgpu, DEFAULT_EP_IN, buf, bufsiz, DEVTIMEOUT, cmd, true, NULL, NULL, err)
+
+#define usb_submit_read(cgpu, buf, bufsiz, cmd, callback, data) \
+	_usb_submit(cgpu, DEFAULT_EP_IN, buf, bufsiz, DEVTIMEOUT, cmd, false, callback, data)
+
+#define usb_submit_write(cgpu, buf, bufsiz, cmd, callback, data) \
+	_usb_submit(cgpu, DEFAULT_EP_OUT, buf, bufsiz, DEVTIMEOUT, cmd, false, callback, data)
+
+#define usb_ftdi_submit_read(cgpu, buf, bufsiz, cmd, callback, data) \
+	_usb_submit(cgpu, DEFAULT_EP_IN, buf, bufsiz, DEVTIMEOUT, cmd, true, callback, data)
+
 #endif
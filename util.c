@@ -15,12 +15,14 @@
 #include <ctype.h>
 #include <stdarg.h>
 #include <string.h>
+#include <limits.h>
 #include <jansson.h>
 #include <curl/curl.h>
 #include <time.h>
 #include <errno.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #ifndef WIN32
 # ifdef __linux
 #  include <sys/prctl.h>
@@ -543,24 +545,44 @@ char *get_proxy(char *url, struct pool *pool)
 	return url;
 }
 
+static const char hex_digits[] = "0123456789abcdef";
+
+/* Nibble value plus one for each valid hex digit, zero for anything else */
+static const unsigned char hex_values[256] = {
+	['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+	['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+	['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+	['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+};
+
+/* Encodes into s, which must have room for len * 2 + 1 chars */
+void __bin2hex(char *s, const unsigned char *p, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		*s++ = hex_digits[p[i] >> 4];
+		*s++ = hex_digits[p[i] & 0xf];
+	}
+	*s = '\0';
+}
+
 /* Returns a malloced array string of a binary value of arbitrary length. The
  * array is rounded up to a 4 byte size to appease architectures that need
  * aligned array  sizes */
 char *bin2hex(const unsigned char *p, size_t len)
 {
-	unsigned int i;
 	ssize_t slen;
 	char *s;
 
 	slen = len * 2 + 1;
 	if (slen % 4)
 		slen += 4 - (slen % 4);
-	s = calloc(slen, 1);
+	s = malloc(slen);
 	if (unlikely(!s))
-		quit(1, "Failed to calloc in bin2hex");
+		quit(1, "Failed to malloc in bin2hex");
 
-	for (i = 0; i < len; i++)
-		sprintf(s + (i * 2), "%02x", (unsigned int) p[i]);
+	__bin2hex(s, p, len);
 
 	return s;
 }
@@ -568,36 +590,29 @@ char *bin2hex(const unsigned char *p, size_t len)
 /* Does the reverse of bin2hex but does not allocate any ram */
 bool hex2bin(unsigned char *p, const char *hexstr, size_t len)
 {
-	bool ret = false;
-
 	while (*hexstr && len) {
-		char hex_byte[4];
-		unsigned int v;
+		int hi, lo;
 
 		if (unlikely(!hexstr[1])) {
 			applog(LOG_ERR, "hex2bin str truncated");
-			return ret;
+			return false;
 		}
 
-		memset(hex_byte, 0, 4);
-		hex_byte[0] = hexstr[0];
-		hex_byte[1] = hexstr[1];
-
-		if (unlikely(sscanf(hex_byte, "%x", &v) != 1)) {
-			applog(LOG_ERR, "hex2bin sscanf '%s' failed", hex_byte);
-			return ret;
+		hi = hex_values[(unsigned char)hexstr[0]];
+		lo = hex_values[(unsigned char)hexstr[1]];
+		if (unlikely(!hi || !lo)) {
+			applog(LOG_ERR, "hex2bin invalid hex '%.2s'", hexstr);
+			return false;
 		}
 
-		*p = (unsigned char) v;
-
-		p++;
+		*p++ = ((hi - 1) << 4) | (lo - 1);
 		hexstr += 2;
 		len--;
 	}
 
 	if (likely(len == 0 && *hexstr == 0))
-		ret = true;
-	return ret;
+		return true;
+	return false;
 }
 
 bool fulltest(const unsigned char *hash, const unsigned char *target)
@@ -605,7 +620,6 @@ bool fulltest(const unsigned char *hash, const unsigned char *target)
 	unsigned char hash_swap[32], target_swap[32];
 	uint32_t *hash32 = (uint32_t *) hash_swap;
 	uint32_t *target32 = (uint32_t *) target_swap;
-	char *hash_str, *target_str;
 	bool rc = true;
 	int i;
 
@@ -633,17 +647,16 @@ bool fulltest(const unsigned char *hash, const unsigned char *target)
 	}
 
 	if (opt_debug) {
-		hash_str = bin2hex(hash_swap, 32);
-		target_str = bin2hex(target_swap, 32);
+		char hash_str[65], target_str[65];
+
+		__bin2hex(hash_str, hash_swap, 32);
+		__bin2hex(target_str, target_swap, 32);
 
 		applog(LOG_DEBUG, " Proof: %s\nTarget: %s\nTrgVal? %s",
 			hash_str,
 			target_str,
 			rc ? "YES (hash < target)" :
 			     "no (false positive; hash > target)");
-
-		free(hash_str);
-		free(target_str);
 	}
 
 	return rc;
@@ -799,6 +812,190 @@ void thr_info_cancel(struct thr_info *thr)
 	}
 }
 
+/* Device detection runs on up to opt_detect_threads threads, each taking the
+ * next job in order. A job that finds a device waits in add_cgpu() until
+ * all the earlier jobs are done, so devices are still added and numbered
+ * in the order they were tried */
+struct detect_pool {
+	void (*job)(int, void *);
+	void *arg;
+	int count;
+	int next;
+	int first;
+	bool *done;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+struct detect_thread {
+	struct detect_pool *pool;
+	int index;
+};
+
+static pthread_key_t detect_key;
+static pthread_once_t detect_once = PTHREAD_ONCE_INIT;
+
+static void detect_key_init(void)
+{
+	if (unlikely(pthread_key_create(&detect_key, NULL)))
+		quit(1, "Failed to create detect key");
+}
+
+static void *detect_worker(void *userdata)
+{
+	struct detect_pool *pool = userdata;
+	struct detect_thread dt;
+
+	dt.pool = pool;
+	pthread_setspecific(detect_key, &dt);
+
+	mutex_lock(&pool->lock);
+	while (pool->next < pool->count) {
+		dt.index = pool->next++;
+		mutex_unlock(&pool->lock);
+
+		pool->job(dt.index, pool->arg);
+
+		mutex_lock(&pool->lock);
+		pool->done[dt.index] = true;
+		while (pool->first < pool->count && pool->done[pool->first])
+			pool->first++;
+		pthread_cond_broadcast(&pool->cond);
+	}
+	mutex_unlock(&pool->lock);
+
+	pthread_setspecific(detect_key, NULL);
+
+	return NULL;
+}
+
+/* Run job(0 .. count-1, arg), the calling thread being one of the workers */
+void detect_parallel(int count, void (*job)(int, void *), void *arg)
+{
+	struct detect_pool pool;
+	pthread_t *pth;
+	int i, threads;
+
+	if (count <= 0)
+		return;
+
+	pthread_once(&detect_once, detect_key_init);
+
+	pool.job = job;
+	pool.arg = arg;
+	pool.count = count;
+	pool.next = pool.first = 0;
+	pool.done = calloc(count, sizeof(bool));
+	if (unlikely(!pool.done))
+		quit(1, "Failed to calloc detect pool");
+	mutex_init(&pool.lock);
+	if (unlikely(pthread_cond_init(&pool.cond, NULL)))
+		quit(1, "Failed to pthread_cond_init detect pool");
+
+	threads = opt_detect_threads < count ? opt_detect_threads : count;
+	pth = calloc(threads, sizeof(pthread_t));
+	if (unlikely(!pth))
+		quit(1, "Failed to calloc detect threads");
+
+	for (i = 1; i < threads; i++)
+		if (unlikely(pthread_create(&pth[i], NULL, detect_worker, &pool)))
+			quit(1, "Failed to create detect thread");
+
+	detect_worker(&pool);
+
+	for (i = 1; i < threads; i++)
+		pthread_join(pth[i], NULL);
+
+	free(pth);
+	pthread_cond_destroy(&pool.cond);
+	pthread_mutex_destroy(&pool.lock);
+	free(pool.done);
+}
+
+// Which job of detect_parallel() is calling, or 0 outside it
+int detect_index(void)
+{
+	struct detect_thread *dt;
+
+	pthread_once(&detect_once, detect_key_init);
+	dt = pthread_getspecific(detect_key);
+
+	return dt ? dt->index : 0;
+}
+
+// Wait until every earlier job of detect_parallel() has finished
+void detect_ordered(void)
+{
+	struct detect_thread *dt;
+	struct detect_pool *pool;
+
+	pthread_once(&detect_once, detect_key_init);
+	dt = pthread_getspecific(detect_key);
+	if (!dt)
+		return;
+
+	pool = dt->pool;
+	mutex_lock(&pool->lock);
+	while (pool->first < dt->index)
+		pthread_cond_wait(&pool->cond, &pool->lock);
+	mutex_unlock(&pool->lock);
+}
+
+/* Settings cgminer learns about a device, such as a tuned clock, are kept
+ * between runs as a JSON object in a file in ~/.cgminer/ (as with the
+ * config file). state_load() sets path, which must hold PATH_MAX, and
+ * returns the object in the file, or an empty one, or NULL if the path is
+ * too long. state_save() replaces the file with root */
+json_t *state_load(const char *name, char *path)
+{
+	json_error_t err;
+	json_t *root;
+	int len;
+
+#if defined(unix)
+	if (getenv("HOME") && *getenv("HOME"))
+		len = snprintf(path, PATH_MAX, "%s/.cgminer/", getenv("HOME"));
+	else
+		len = snprintf(path, PATH_MAX, ".cgminer/");
+	if (len < PATH_MAX) {
+		mkdir(path, 0777);
+		len += snprintf(path + len, PATH_MAX - len, "%s", name);
+	}
+#else
+	len = snprintf(path, PATH_MAX, "%s", name);
+#endif
+	if (len >= PATH_MAX) {
+		applog(LOG_WARNING, "Path for %s is too long, not using it", name);
+		return NULL;
+	}
+
+#if JANSSON_MAJOR_VERSION > 1
+	root = json_load_file(path, 0, &err);
+#else
+	root = json_load_file(path, &err);
+#endif
+	if (root && !json_is_object(root)) {
+		applog(LOG_WARNING, "Ignoring %s, it is not a JSON object", path);
+		json_decref(root);
+		root = NULL;
+	}
+	if (!root)
+		root = json_object();
+	return root;
+}
+
+bool state_save(json_t *root, const char *path)
+{
+	char *tmppath = alloca(strlen(path) + 5);
+
+	sprintf(tmppath, "%s.tmp", path);
+	if (json_dump_file(root, tmppath, JSON_INDENT(1)) || rename(tmppath, path)) {
+		applog(LOG_WARNING, "Unable to save %s", path);
+		return false;
+	}
+	return true;
+}
+
 /* Provide a ms based sleep that uses nanosleep to avoid poor usleep accuracy
  * on SMP machines */
 void nmsleep(unsigned int msecs)